@@ -20,6 +20,11 @@
 #include <linux/proc_fs.h>
 #include <linux/delay.h>
 #include <linux/llist.h>
+#include <linux/srcu.h>
+#include <linux/seqlock.h>
+#include <linux/shrinker.h>
+#include <linux/ioprio.h>
+#include <linux/mempool.h>
 #include <linux/nvme.h>
 #include <linux/nvme_ioctl.h>
 #include <linux/blk-mq.h>
@@ -70,7 +75,7 @@ do {\
 /*Global config.*/
 #define LBZ_DATA_BLK_SHIFT 12
 #define LBZ_DATA_BLK_SIZE (1 << LBZ_DATA_BLK_SHIFT)
-#define LBZ_MAX_DEV_SIZE 64 /*GiB*/
+#define LBZ_MAX_DEV_BLKS (~0U) /*blkid and pbid are 32 bits, ~0U stands for unmapped.*/
 #define LBZ_MAX_NAME_LEN (BDEVNAME_SIZE * 2)
 
 /*memory related definitions.*/
@@ -86,6 +91,16 @@ extern atomic64_t lbz_mem_bytes;
 	LBZ_CLEAR_MEM(x, y);	\
 	kfree(x); 		\
 } while (0)
+/*for tables sized by device capacity, may be too large for kmalloc.*/
+#define	LBZ_ALLOC_LARGE_MEM(x, y, z) do { \
+	x = kvzalloc((y), (z)); 	\
+	if (x) 			\
+	atomic64_add(y, &lbz_mem_bytes); 	\
+} while (0)
+#define	LBZ_FREE_LARGE_MEM(x, y) do { \
+	atomic64_sub(y, &lbz_mem_bytes); 	\
+	kvfree(x); 		\
+} while (0)
 /*-------------------------------*/
 static inline unsigned int sector_to_blkid(sector_t sector)
 {
@@ -94,6 +109,6 @@ static inline unsigned int sector_to_blkid(sector_t sector)
 
 static inline sector_t blkid_to_sector(unsigned int blkid)
 {
-	return blkid << (LBZ_DATA_BLK_SHIFT - SECTOR_SHIFT);
+	return (sector_t)blkid << (LBZ_DATA_BLK_SHIFT - SECTOR_SHIFT);
 }
 #endif
@@ -12,9 +12,19 @@ struct lbz_zone_metadata;
 struct lbz_mapping;
 struct lbz_io_scheduler;
 struct lbz_gc_context;
+struct lbz_flush_ctx;
 #ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
 struct lbz_nat_sit_mgmt;
 #endif
+#ifdef CONFIG_LBZ_WRITE_BUFFER_SUPPORT
+struct lbz_write_buffer;
+#endif
+#ifdef CONFIG_LBZ_READ_CACHE_SUPPORT
+struct lbz_read_cache;
+#endif
+#ifdef CONFIG_LBZ_READAHEAD_SUPPORT
+struct lbz_readahead;
+#endif
 struct lbz_device {
 	struct list_head list;
 	struct gendisk *disk;
@@ -25,6 +35,11 @@ struct lbz_device {
 	sector_t dev_size; /*in sectors*/
 
 	struct bio_set bio_split;
+	struct bio_set coalesce_bio_set; /*adjacent small writes merged into one.*/
+#ifdef CONFIG_LBZ_BLK_MQ_SUPPORT
+	struct blk_mq_tag_set tag_set;
+	struct bio_set mq_bio_set; /*clone bios of request.*/
+#endif
 
 	struct proc_dir_entry *proc_entry;
 
@@ -46,9 +61,20 @@ struct lbz_device {
 
 	struct lbz_gc_context *gc_ctx;
 
+	struct lbz_flush_ctx *flush_ctx;
+
 #ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
 	struct lbz_nat_sit_mgmt *nat_sit_mgmt;
 #endif
+#ifdef CONFIG_LBZ_WRITE_BUFFER_SUPPORT
+	struct lbz_write_buffer *wb;
+#endif
+#ifdef CONFIG_LBZ_READ_CACHE_SUPPORT
+	struct lbz_read_cache *rc;
+#endif
+#ifdef CONFIG_LBZ_READAHEAD_SUPPORT
+	struct lbz_readahead *ra;
+#endif
 
 	/*statistics for IO and GC.*/
 	/*not include io, which encounter error before submit_bio.*/
@@ -56,7 +82,7 @@ struct lbz_device {
 	/*not include zero read io.*/
 	atomic64_t user_read_inflight_io_cnt;
 	atomic64_t user_read_err_cnt;
-	atomic64_t user_read_zero_cnt;
+	atomic64_t user_read_zero_cnt; /*unmapped blocks zero filled.*/
 	atomic64_t user_write_err_cnt;
 
 	atomic64_t user_encounter_emergency;
@@ -64,7 +90,11 @@ struct lbz_device {
 	atomic64_t gc_alloc_encounter_eagain;
 
 	atomic64_t user_write_blocks;
+	atomic64_t user_write_coalesced_bios; /*user bios merged into another.*/
 	atomic64_t user_read_blocks;
+	atomic64_t user_read_device_bios; /*runs of user read issued to phy_bdev.*/
+	atomic64_t user_read_polled; /*REQ_HIPRI reads, completed by lbz_mq_poll.*/
+	atomic64_t user_read_polled_inflight;
 	
 	atomic64_t gc_inflight_io_cnt;
 	atomic64_t gc_write_err_cnt;
@@ -24,33 +24,158 @@ struct lbz_io_hook {
 	bio_end_io_t *user_endio;
 	void *user_private;
 	union {
-		struct lbz_zone *zone; /*read io*/
+		int srcu_idx; /*read io, lbz_zone_read_lock.*/
 		struct lbz_io_task *task; /*write and gc IO.*/
 		void *priv; /*assgin.*/
 	};
 	unsigned int blkid;
+	bool pooled; /*alloced from lbz_hook_pool, others live in task or bio front_pad.*/
+	bool polled; /*read io with REQ_HIPRI, counted in user_read_polled_inflight.*/
+	u64 start_ns; /*read io, latency sample of lbz_gc_limit.*/
 };
 
+/*bio split from lbz_device->bio_split carries its hook in front_pad.*/
+struct lbz_split_bio {
+	struct lbz_io_hook hook;
+	struct bio bio; /*must be last, inline bvecs follow it.*/
+};
+#define LBZ_SPLIT_BIO_FRONT_PAD offsetof(struct lbz_split_bio, bio)
+
 struct lbz_io_task {
 	struct rb_node node;
 	union {
-		struct list_head list; /*in lbz_user_pending or lbz_gc_writes list.*/
+		/*
+		 * in lbz_user_pending, lbz_space_waiters, throttle waiters, lbz_gc_writes
+		 * list, or chained list of an in-flight write.
+		 */
+		struct list_head list;
 		struct lbz_zone *read_zone; /*invalid during gc reading.*/
 	};
 	struct bio *bio;
 	unsigned int blkid;
+	unsigned int nr_blks; /*write covers [blkid, blkid + nr_blks), gc is always 1.*/
 	unsigned int pbid; /*write and gc read.*/
 	struct page *page; /*gc read and write page.*/
 	void *integrity_buf;
+	struct lbz_io_hook hook; /*user write hook, no extra alloc for it.*/
 	struct lbz_zone *zone; /*target zone for write and gc read.*/
 	atomic_t refcount;
 	int error;
 	enum lbz_task_status status;
 	enum lbz_task_type type;
+	unsigned int ctx; /*index of retry ctx, user write only.*/
+	bool sync; /*sync, fua or rt user write, see __is_sync_write.*/
+	bool space_waiting; /*parked in space waiters, under space_lock.*/
+	/*
+	 * data of write bio at data_iter or gc page is the latest of range, reads
+	 * may copy it under shard lock, see __read_from_tasks.
+	 */
+	bool servable;
+	struct bvec_iter data_iter; /*iter of write bio at dispatch.*/
 	union {
 		struct lbz_io_task *pending_gc_node; /*may call gc handle func.*/
 		struct lbz_io_scheduler *iosched; /*used for gc read callback.*/
 	};
+	/*gc tasks pending on the same write task, linked under shard lock.*/
+	struct lbz_io_task *pending_gc_next;
+	/*user writes overlapping this in-flight write in arrival order, under shard lock.*/
+	struct list_head chained;
+	struct llist_node cnode; /*in completion ctx after write io completes, gc write too with extent mapping.*/
+};
+
+/*
+ * In-flight tasks are indexed by blkid range in shards, every shard covers
+ * LBZ_TASK_SHARD_BLKS continuous blocks and shards are interleaved by blkid,
+ * so writes to different area of device don't serialize on one lock.
+ * Write task never crosses shard boundary, see lbz_task_shard_end.
+ */
+#define LBZ_TASK_SHARD_SHIFT (10)
+#define LBZ_TASK_SHARD_BLKS (1 << LBZ_TASK_SHARD_SHIFT)
+#define LBZ_TASK_SHARDS (64)
+#define LBZ_TASK_READ_MAX_BLKS (16) /*larger reads always go to device.*/
+
+struct lbz_task_shard {
+	struct rb_root task_tree;
+	spinlock_t task_lock;
+	unsigned int task_count;
+} ____cacheline_aligned_in_smp;
+
+static inline unsigned int lbz_task_shard_end(unsigned int blkid)
+{
+	return round_down(blkid, LBZ_TASK_SHARD_BLKS) + LBZ_TASK_SHARD_BLKS;
+}
+
+/*
+ * User write retry context, one per hardware queue of blk-mq frontend (only
+ * one for bio frontend), so retry of different queues is not serialized on
+ * one list and one work.
+ */
+struct lbz_retry_ctx {
+	spinlock_t pending_lock;
+	int pending_count;
+	struct list_head lbz_user_sync_pending; /*retried before lbz_user_pending.*/
+	struct list_head lbz_user_pending;
+	struct delayed_work retry_wk;
+	struct lbz_io_scheduler *iosched;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Admission control of user writes. Once free blocks above gc reserve fall
+ * below the high gc watermark, user writes spend credits which are refilled
+ * every period by the measured gc reclaim rate plus a share of the free
+ * blocks left above the low watermark, so writes slow down smoothly instead
+ * of running into the gc reserve. Timer is armed by user writes and stops
+ * once device is idle and throttling is off.
+ */
+#define LBZ_THROTTLE_PERIOD (HZ / 20)
+#define LBZ_THROTTLE_DRAIN_PERIODS (20) /*periods to use up free blocks between watermarks.*/
+#define LBZ_THROTTLE_MIN_CREDITS (64) /*per period, in case gc is not started yet.*/
+struct lbz_throttle {
+	spinlock_t lock;
+	bool active;
+	long credits; /*blocks, negative is debt of a write larger than credits.*/
+	int wait_count;
+	struct list_head waiters;
+	struct timer_list timer;
+	long last_reclaimed; /*blocks reset by gc minus blocks written by gc.*/
+	unsigned long last_jiffies; /*of last sample, timer may be stopped between samples.*/
+	long reclaim_rate; /*blocks per period, ewma.*/
+	atomic64_t throttled_writes;
+};
+
+/*
+ * Completed user writes are pushed to per cpu lock-free list by endio, and
+ * drained in batches by a per cpu work, so mapping and reverse map updates
+ * run in process context and take leaf lock once per leaf of a task.
+ */
+#define LBZ_COMPLETE_CHUNK (64) /*blocks updated per leaf lock at most.*/
+struct lbz_completion_ctx {
+	struct llist_head tasks;
+	struct work_struct work;
+	struct lbz_io_scheduler *iosched;
+};
+
+/*
+ * GC IO is issued in idle class and gc tasks outstanding per device are
+ * capped. While user reads are slower than lat_target_us, the cap drops to
+ * LBZ_GC_YIELD_INFLIGHT so gc yields dispatch slots to them. Emergency gc
+ * runs in best effort class and is never held back by reads.
+ */
+#define LBZ_GC_IOPRIO IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)
+#define LBZ_GC_URGENT_IOPRIO IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, IOPRIO_BE_NR - 1)
+#define LBZ_GC_DEFAULT_INFLIGHT (256)
+#define LBZ_GC_YIELD_INFLIGHT (8)
+#define LBZ_GC_DEFAULT_LAT_TARGET_US (2000)
+#define LBZ_GC_YIELD_RECHECK (HZ / 100) /*read latency changes without wakeup.*/
+struct lbz_gc_limit {
+	wait_queue_head_t wait;
+	unsigned int max_inflight;
+	unsigned int lat_target_us; /*0 disables yielding.*/
+	u64 read_lat_ns; /*ewma of user read latency.*/
+	atomic_t reading; /*depth of gc reads on device.*/
+	atomic_t writing;
+	atomic64_t waits; /*gc submissions held by cap.*/
+	atomic64_t yields; /*of which read latency lowered the cap.*/
 };
 
 #define LBZ_RETRY_DELAY (HZ * 3)
@@ -58,22 +183,53 @@ struct lbz_io_task {
 #define LBZ_IO_WRITE_DELAY (0)
 #define LBZ_GC_WRITE_DELAY (HZ / 100)
 struct lbz_io_scheduler {
-	struct rb_root task_tree;
-	rwlock_t task_lock;
-	atomic64_t task_count;
+	struct lbz_task_shard task_shards[LBZ_TASK_SHARDS];
 
 	/*Only user io need to retry.*/
-	spinlock_t pending_lock;
-	int pending_count;
-	struct list_head lbz_user_pending;
+	struct lbz_retry_ctx *retry_ctxs;
+	unsigned int nr_retry_ctxs;
+
+	/*
+	 * user writes waiting for free space in FIFO, they are not retried until
+	 * zone reset wakes them, see lbz_iosched_wake_space_waiters. Sync writes
+	 * have their own FIFO which is woken first. A waiter that gc tasks pend
+	 * on is never parked, the reset it waits for needs those gc tasks. It
+	 * backs off in space_gc_backoff instead and is retried after
+	 * LBZ_GC_WRITE_DELAY with gc priority.
+	 */
+	spinlock_t space_lock;
+	int space_wait_count; /*include sync waiters.*/
+	int space_sync_wait_count;
+	struct list_head lbz_space_sync_waiters;
+	struct list_head lbz_space_waiters;
+	atomic64_t space_wakeups;
+	atomic64_t space_gc_kicks; /*waiters retried because gc pended on them.*/
+	struct list_head space_gc_backoff;
+	struct delayed_work space_backoff_wk;
+
+	struct lbz_throttle throttle;
+	struct lbz_gc_limit gc_limit;
+
+	atomic64_t chained_writes; /*writes chained behind in-flight ones.*/
+	atomic64_t sync_writes;
+	atomic64_t write_served_reads; /*blocks read from in-flight write bios.*/
+	atomic64_t gc_served_reads; /*blocks read from gc pages.*/
+
+	struct lbz_completion_ctx __percpu *cpl_ctxs;
+	struct workqueue_struct *cpl_wq;
+	atomic64_t cpl_batches;
+	atomic64_t cpl_tasks;
 
 	spinlock_t gc_write_lock;
 	int gc_write_count;
 	struct list_head lbz_gc_writes;
 
+	/*split write when alloc grant less blocks than task covers.*/
+	struct bio_set bio_split;
+
 	char wq_name[LBZ_MAX_NAME_LEN];
 	struct workqueue_struct *retry_wq;
-	struct delayed_work retry_wk;
+	struct delayed_work retry_wk; /*gc writes.*/
 	struct timer_list retry_timer;
 	unsigned long retry_delay;
 	unsigned int retry_expire;
@@ -104,8 +260,15 @@ struct lbz_disk_log {
 	char reserved[32];
 };
 
+int lbz_iosched_cache_init(void);
+void lbz_iosched_cache_exit(void);
 int lbz_submit_io_to_iosched(struct lbz_io_scheduler *iosched, struct bio *bio);
+int lbz_submit_io_to_iosched_direct(struct lbz_io_scheduler *iosched, struct bio *bio);
 int lbz_submit_gc_to_iosched(struct lbz_io_scheduler *iosched, struct lbz_zone *zone, unsigned int pbid, unsigned int blkid);
+void lbz_iosched_wake_space_waiters(struct lbz_io_scheduler *iosched);
+void lbz_iosched_gc_wait_slot(struct lbz_io_scheduler *iosched);
+void lbz_iosched_set_gc_limit(struct lbz_io_scheduler *iosched, unsigned int max_inflight,
+		unsigned int lat_target_us);
 void lbz_iosched_proc_read(struct lbz_io_scheduler *iosched, struct seq_file *seq);
 int lbz_iosched_init(struct lbz_io_scheduler *iosched, struct lbz_device *dev);
 void lbz_iosched_destory(struct lbz_io_scheduler *iosched);
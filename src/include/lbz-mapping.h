@@ -2,15 +2,23 @@
 #define _LBZ_MAPPING_H_
 #include "lbz-common.h"
 
-struct leaf_node_headr {
-	rwlock_t lock;
-	unsigned int blkid;
-};
-
 struct lbz_zone;
 struct lbz_io_scheduler;
 struct lbz_device;
 
+#ifndef CONFIG_LBZ_EXTENT_MAPPING_SUPPORT
+/*
+ * Writers of a leaf are serialized by lock and bump seq around updates.
+ * Lookup of one entry is a plain load, lookup of a run retries on seq,
+ * so readers never write the leaf.
+ */
+struct leaf_node_headr {
+	spinlock_t lock;
+	seqcount_spinlock_t seq;
+	unsigned int blkid;
+	unsigned int nr_mapped; /*0 means whole leaf is a hole, lookup of run skips it.*/
+};
+
 struct mapping_leaf_node {
 	struct leaf_node_headr header;
 	unsigned int pbids[];
@@ -35,25 +43,76 @@ struct mapping_internal_node {
 #define LBZ_INT_NODE_ENTRIES ((LBZ_MAPPING_BLK_SIZE - sizeof(struct internal_node_headr)) / sizeof(struct mapping_leaf_node *))
 #define LBZ_INT_NODE_INDEXED_BLKS (LBZ_LEAF_NODE_ENTIRES * LBZ_INT_NODE_ENTRIES)
 
-#define MAX_INTERNAL_NODES (((LBZ_MAX_DEV_SIZE << (30 - LBZ_DATA_BLK_SHIFT)) + LBZ_INT_NODE_INDEXED_BLKS - 1)\
-	   	/ LBZ_INT_NODE_INDEXED_BLKS)
-
+/*
+ * Root is sized by device capacity at init, internal and leaf nodes are
+ * allocated on first write to their range and published with release, so
+ * memory follows the mapped part of the device and lookup stays lockless.
+ * A missing node is a hole. Nodes are never freed until destroy.
+ */
 struct lbz_mapping {
 	/*three level tree.*/
-	struct mapping_internal_node *root[MAX_INTERNAL_NODES];
+	struct mapping_internal_node **root;
+	unsigned int nr_roots;
+	atomic_t nr_internal_nodes;
+	atomic_t nr_leaf_nodes;
 	/*Indicate the size of block device.*/
 	unsigned int max_blkid;
 	unsigned int superblock_pbid; 
 
 	void *host; /*struct lbz_device.*/
 };
+#else
+/*
+ * Extent mapping: every run of blocks contiguous in both blkid and pbid is
+ * one extent, appends adjacent to an extent extend it and overwrite in the
+ * middle splits it. Extents are kept in rbtree per group of blkids, writers
+ * of a group are serialized by lock and bump seq around updates. Lookup walks
+ * the tree under rcu and retries on seq, extents are freed after grace period.
+ */
+#define LBZ_EXT_GROUP_SHIFT (14)
+#define LBZ_EXT_GROUP_BLKS (1U << LBZ_EXT_GROUP_SHIFT) /*extent never crosses group.*/
+#define LBZ_EXT_MIN_POOL_OBJS (1024) /*remap under writeback, keeps it going under memory pressure.*/
+
+struct lbz_extent {
+	struct rb_node node;
+	unsigned int blkid;
+	unsigned int pbid;
+	unsigned int len;
+	struct rcu_head rcu;
+};
+
+struct lbz_extent_group {
+	spinlock_t lock;
+	seqcount_spinlock_t seq;
+	struct rb_root tree;
+};
+
+struct lbz_mapping {
+	struct lbz_extent_group *groups; /*sized by device capacity.*/
+	unsigned int nr_groups;
+	atomic64_t nr_extents;
+	/*Indicate the size of block device.*/
+	unsigned int max_blkid;
+	unsigned int superblock_pbid;
+
+	void *host; /*struct lbz_device.*/
+};
+
+int lbz_mapping_cache_init(void);
+void lbz_mapping_cache_exit(void);
+#endif
 
 #define UINT_MAX (~0U)
 #define LBZ_INVALID_PBID UINT_MAX /*stand for unmapped mapping.*/
 
-int lbz_mapping_lookup(struct lbz_mapping *mapping, struct lbz_zone **ret_zone, unsigned int *ret_pbid, unsigned int blkid);
+int lbz_mapping_lookup(struct lbz_mapping *mapping, unsigned int *ret_pbid, unsigned int blkid);
+unsigned int lbz_mapping_lookup_run(struct lbz_mapping *mapping, unsigned int *ret_pbid,
+		unsigned int blkid, unsigned int max_nr);
 unsigned int lbz_mapping_add(struct lbz_mapping *mapping, unsigned int blkid, unsigned int pbid);
+void lbz_mapping_add_range(struct lbz_mapping *mapping, unsigned int blkid, unsigned int pbid,
+		unsigned int nr, unsigned int *old_pbids);
 unsigned int lbz_mapping_remove(struct lbz_mapping *mapping, unsigned int blkid);
-void lbz_mapping_init(struct lbz_mapping *mapping, struct lbz_device *dev);
+void lbz_mapping_proc_read(struct lbz_mapping *mapping, struct seq_file *seq);
+int lbz_mapping_init(struct lbz_mapping *mapping, struct lbz_device *dev);
 void lbz_mapping_destroy(struct lbz_mapping *mapping);
 #endif
@@ -121,6 +121,24 @@ static inline bool lbz_nat_sit_is_second_cp_block(struct lbz_nat_sit_mgmt *mgmt,
 	return false;
 }
 
+/*
+ * first block after @block which may belong to another region (cp, nat/sit or main),
+ * task type and stream are decided by region, so one write task never crosses it.
+ */
+static inline unsigned int lbz_nat_sit_region_end(struct lbz_nat_sit_mgmt *mgmt, unsigned block)
+{
+	unsigned int bounds[] = {mgmt->cp_blkaddr, mgmt->cp_blkaddr + mgmt->cp_blocks,
+		mgmt->sit_blkaddr, mgmt->nat_blkaddr + mgmt->nat_blocks};
+	unsigned int end = UINT_MAX;
+	int i = 0;
+
+	for (; i < ARRAY_SIZE(bounds); i++) {
+		if (bounds[i] > block && bounds[i] < end)
+			end = bounds[i];
+	}
+	return end;
+}
+
 static inline void lbz_nat_sit_set_cur_cp(struct lbz_nat_sit_mgmt *mgmt, unsigned block)
 {
 	if (lbz_nat_sit_is_fisrt_cp_block(mgmt, block))
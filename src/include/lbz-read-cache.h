@@ -0,0 +1,65 @@
+#ifndef _LBZ_READ_CACHE_H_
+#define _LBZ_READ_CACHE_H_
+#include "lbz-common.h"
+
+#ifdef CONFIG_LBZ_READ_CACHE_SUPPORT
+/*
+ * DRAM read cache for hot blocks. F2FS reads cp/sit/nat blocks again and
+ * again, one block read of these area is kept in cache after it completes.
+ * Entry is put on recent list at first, moved to frequent list once it's hit,
+ * recent list is evicted first when it holds more than half of budget (ARC
+ * without ghost lists). Write completion drops copy of blocks it rewrites,
+ * the shrinker evicts under memory pressure.
+ */
+#define LBZ_RC_DEFAULT_PAGES (8192)
+#define LBZ_RC_SHRINK_BATCH (128)
+
+enum lbz_rc_entry_state {
+	LBZ_RC_FILLING, /*read to fill it is in flight, not in any list.*/
+	LBZ_RC_RECENT,
+	LBZ_RC_FREQUENT,
+};
+
+struct lbz_rc_entry {
+	struct rb_node node;
+	struct list_head link; /*in recent or frequent list by access order.*/
+	unsigned int blkid;
+	enum lbz_rc_entry_state state;
+	bool dead; /*invalidated during filling, freed by fill endio.*/
+	struct page *page;
+	struct bvec_iter iter; /*bio iter at submit, consumed by completion.*/
+	bio_end_io_t *user_endio;
+	void *user_private;
+	struct lbz_read_cache *rc;
+};
+
+struct lbz_read_cache {
+	spinlock_t lock;
+	struct rb_root tree;
+	struct list_head recent_list;
+	struct list_head frequent_list;
+	unsigned int nr_recent;
+	unsigned int nr_frequent;
+	unsigned int nr_filling;
+	unsigned int max_pages; /*budget, nr_recent + nr_frequent + nr_filling.*/
+
+	struct shrinker shrinker;
+
+	atomic64_t hits;
+	atomic64_t misses;
+	atomic64_t fills;
+	atomic64_t invalidations;
+	atomic64_t evictions;
+	atomic64_t shrinker_evictions;
+
+	void *host; /*struct lbz_device*/
+};
+
+bool lbz_rc_handle_read(struct lbz_read_cache *rc, struct bio *bio);
+void lbz_rc_invalidate(struct lbz_read_cache *rc, unsigned int blkid, unsigned int nr_blks);
+void lbz_rc_set_max_pages(struct lbz_read_cache *rc, unsigned int max_pages);
+void lbz_rc_proc_read(struct lbz_read_cache *rc, struct seq_file *seq);
+int lbz_rc_init(struct lbz_read_cache *rc, struct lbz_device *dev);
+void lbz_rc_destroy(struct lbz_read_cache *rc);
+#endif
+#endif
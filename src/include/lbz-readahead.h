@@ -0,0 +1,74 @@
+#ifndef _LBZ_READAHEAD_H_
+#define _LBZ_READAHEAD_H_
+#include "lbz-common.h"
+
+#ifdef CONFIG_LBZ_READAHEAD_SUPPORT
+/*
+ * Readahead by physical layout. Logically sequential blocks are scattered
+ * over zones after overwrite, readahead of upper layer turns into many small
+ * reads. Sequential read streams are detected per device, next logical window
+ * of a stream is planned by mapping tree, every physical run of it is read in
+ * parallel into prefetch buffer. Block is dropped from buffer once it's read.
+ */
+#define LBZ_RA_MAX_STREAMS (8)
+#define LBZ_RA_SEQ_TRIGGER (2) /*sequential reads before a stream is prefetched.*/
+#define LBZ_RA_WINDOW_BLKS (256)
+#define LBZ_RA_MAX_PAGES (2048)
+
+enum lbz_ra_entry_state {
+	LBZ_RA_FILLING, /*linked in plan or lbz_ra_bio, not in lru list.*/
+	LBZ_RA_VALID,
+};
+
+struct lbz_ra_entry {
+	struct rb_node node;
+	struct list_head link;
+	unsigned int blkid;
+	enum lbz_ra_entry_state state;
+	bool dead; /*invalidated during filling, freed by lbz_ra_endio.*/
+	struct page *page;
+};
+
+struct lbz_ra_bio {
+	struct lbz_readahead *ra;
+	struct list_head entries; /*by blkid order.*/
+	int srcu_idx;
+	struct bio bio; /*must be last, inline bvecs follow it.*/
+};
+#define LBZ_RA_BIO_FRONT_PAD offsetof(struct lbz_ra_bio, bio)
+
+struct lbz_ra_stream {
+	unsigned int next_blkid; /*expected blkid of next read.*/
+	unsigned int seq; /*sequential reads in a row.*/
+	unsigned int ra_end; /*end of window prefetched.*/
+	unsigned long last_jiffies;
+};
+
+struct lbz_readahead {
+	spinlock_t lock;
+	struct rb_root tree;
+	struct list_head lru_list; /*valid entries, oldest first.*/
+	unsigned int nr_valid;
+	unsigned int nr_filling;
+	struct lbz_ra_stream streams[LBZ_RA_MAX_STREAMS];
+
+	struct bio_set bio_set;
+	atomic_t inflight;
+
+	atomic64_t windows;
+	atomic64_t prefetch_bios;
+	atomic64_t prefetch_blocks;
+	atomic64_t hit_blocks;
+	atomic64_t invalidations;
+	atomic64_t evictions; /*prefetched but never read.*/
+
+	void *host; /*struct lbz_device*/
+};
+
+bool lbz_ra_handle_read(struct lbz_readahead *ra, struct bio *bio);
+void lbz_ra_invalidate(struct lbz_readahead *ra, unsigned int blkid, unsigned int nr_blks);
+void lbz_ra_proc_read(struct lbz_readahead *ra, struct seq_file *seq);
+int lbz_ra_init(struct lbz_readahead *ra, struct lbz_device *dev);
+void lbz_ra_destroy(struct lbz_readahead *ra);
+#endif
+#endif
@@ -12,5 +12,56 @@ struct lbz_req_hook {
 	struct page *clone_pages;
 	struct bio *user_bio;
 };
+/*
+ * bio from lbz_device->coalesce_bio_set, it carries pages of several adjacent
+ * user writes and ends them when itself completes.
+ */
+struct lbz_coalesce_bio {
+	struct bio_list members;
+	struct bio bio; /*must be last, inline bvecs follow it.*/
+};
+#define LBZ_COALESCE_BIO_FRONT_PAD offsetof(struct lbz_coalesce_bio, bio)
+#define LBZ_PLUG_MAX_BIOS (32) /*writes parked in one plug before flushing.*/
+
+/*
+ * Empty flush bios wait for one flush of phy_bdev, which covers every append
+ * completed before it. Flushes arriving while a device flush is in flight
+ * share the next one (group commit).
+ */
+struct lbz_flush_ctx {
+	spinlock_t lock;
+	struct bio_list waiting; /*wait for next device flush.*/
+	struct bio_list inflight; /*covered by device flush in flight.*/
+	bool flushing;
+	struct bio flush_bio;
+
+	struct workqueue_struct *flush_wq;
+	struct work_struct flush_wk;
+
+	atomic64_t user_flushes;
+	atomic64_t device_flushes;
+
+	void *host; /*struct lbz_device*/
+};
+
+struct lbz_device;
+void lbz_dev_flush(struct lbz_device *dev, struct bio *bio);
+void lbz_flush_proc_read(struct lbz_flush_ctx *fctx, struct seq_file *seq);
+int lbz_flush_ctx_init(struct lbz_flush_ctx *fctx, struct lbz_device *dev);
+void lbz_flush_ctx_destroy(struct lbz_flush_ctx *fctx);
+
 blk_qc_t lbz_dev_submit_bio(struct bio *bio);
+#ifdef CONFIG_LBZ_BLK_MQ_SUPPORT
+#define LBZ_MQ_QUEUE_DEPTH (128) /*requests in flight per hardware queue.*/
+#define LBZ_MQ_POLL_QUEUES (4) /*hardware queues of HCTX_TYPE_POLL, after default ones.*/
+
+/*pdu of blk-mq request.*/
+struct lbz_mq_cmd {
+	atomic_t remaining;
+	blk_status_t status;
+};
+extern const struct blk_mq_ops lbz_mq_ops;
+#endif
+int lbz_request_cache_init(void);
+void lbz_request_cache_exit(void);
 #endif
@@ -0,0 +1,72 @@
+#ifndef _LBZ_WRITE_BUFFER_H_
+#define _LBZ_WRITE_BUFFER_H_
+#include "lbz-common.h"
+
+#ifdef CONFIG_LBZ_WRITE_BUFFER_SUPPORT
+/*
+ * DRAM write-back buffer for hot blocks. F2FS rewrites cp/sit/nat blocks
+ * again and again between checkpoints, one block write of these area is
+ * copied to buffer and completed at once, rewrite of a buffered block only
+ * updates its page. Buffer is written back when it reaches high watermark,
+ * or all at once before a preflush bio.
+ */
+#define LBZ_WB_MAX_PAGES (4096)
+#define LBZ_WB_HIGH_WM (LBZ_WB_MAX_PAGES * 3 / 4)
+#define LBZ_WB_LOW_WM (LBZ_WB_MAX_PAGES / 2)
+
+enum lbz_wb_entry_state {
+	LBZ_WB_DIRTY,
+	LBZ_WB_FLUSHING,
+};
+
+struct lbz_wb_entry {
+	struct rb_node node;
+	struct list_head link; /*in dirty list by write order, or flushing list.*/
+	unsigned int blkid;
+	enum lbz_wb_entry_state state;
+	bool fence; /*preflush bios in barrier_wait wait for it.*/
+	struct page *page;
+	struct page *pending; /*rewrite during flushing.*/
+	struct bio_list deferred; /*writes to this block wait for its write back.*/
+	struct lbz_write_buffer *wb;
+};
+
+struct lbz_write_buffer {
+	spinlock_t lock;
+	struct rb_root tree;
+	struct list_head dirty_list;
+	struct list_head flushing_list;
+	unsigned int nr_pages; /*include pending pages.*/
+	unsigned int nr_dirty;
+	unsigned int nr_flushing;
+
+	struct bio_list barrier_bios; /*preflush bios not handled yet.*/
+	struct bio_list barrier_wait; /*preflush bios wait for fence_count.*/
+	unsigned int fence_count;
+	struct bio_list resubmit; /*deferred bios ready to go.*/
+	struct bio_list released; /*preflush bios whose fence is done.*/
+	blk_status_t wb_error; /*write back failed since last released preflush.*/
+	bool draining; /*write back all, device is going away.*/
+
+	struct bio_set bio_set; /*write back bios.*/
+
+	struct workqueue_struct *wb_wq;
+	struct work_struct wb_wk;
+
+	atomic64_t absorbed_writes;
+	atomic64_t overwrites;
+	atomic64_t read_hits;
+	atomic64_t flushed_blocks;
+	atomic64_t deferred_writes;
+	atomic64_t wb_errors;
+
+	void *host; /*struct lbz_device*/
+};
+
+bool lbz_wb_bufferable(struct lbz_write_buffer *wb, struct bio *bio);
+bool lbz_wb_handle_bio(struct lbz_write_buffer *wb, struct bio *bio);
+void lbz_wb_proc_read(struct lbz_write_buffer *wb, struct seq_file *seq);
+int lbz_wb_init(struct lbz_write_buffer *wb, struct lbz_device *dev);
+void lbz_wb_destroy(struct lbz_write_buffer *wb);
+#endif
+#endif
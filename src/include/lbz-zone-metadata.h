@@ -87,9 +87,9 @@ struct lbz_zone {
 	unsigned int wp_block;
 
 	/*variable in blk_zone.*/
-	unsigned int start_sector; /*u64 in blk_zone.*/
-	unsigned int len_sectors; /*number of sectors, u64 in blk_zone.*/
-	unsigned int capacity_sectors; /*capacity in sectors.*/
+	sector_t start_sector;
+	sector_t len_sectors; /*number of sectors.*/
+	sector_t capacity_sectors; /*capacity in sectors.*/
 	unsigned int cond;
 
 	/* Zone weight (number of valid blocks in the zone) */
@@ -110,6 +110,15 @@ struct lbz_zone {
 #define LBZ_GC_RECLAIM_DEFAULT_WM_HIGH (4)
 #define LBZ_ZONE_RECLAIM_DEFAULT_WM (1)
 #define LBZ_ZONE_MAX_STREAM (2)
+/*
+ * Every stream appends to up to LBZ_ZONE_MAX_FRONTIERS open zones (frontiers)
+ * in turn, so one stream's writes are spread over dies of several zones.
+ * Frontier id is stream_id * LBZ_ZONE_MAX_FRONTIERS + slot, only nr_frontiers
+ * slots of every stream are used, bounded by open/active limits of device.
+ */
+#define LBZ_ZONE_MAX_FRONTIERS (4)
+#define LBZ_ZONE_MAX_ACTIVE (LBZ_ZONE_MAX_STREAM * LBZ_ZONE_MAX_FRONTIERS)
+#define LBZ_SYNC_RESERVE_SHARE (4) /*sync user write may borrow 1/4 of reserved_blks_gc.*/
 struct lbz_zone_metadata {
 	/*Use zone index zones array.*/
 	struct lbz_zone **zones;
@@ -124,15 +133,26 @@ struct lbz_zone_metadata {
 	/* For write context, active zone may be full, partial and reference by
 	 * some context, so active zone would more than 1. */
 	struct list_head active_zone_list; /*not in use.*/
-	struct lbz_zone *active_zone[LBZ_ZONE_MAX_STREAM]; /*2 stream support f2fs.*/
+	struct lbz_zone *active_zone[LBZ_ZONE_MAX_ACTIVE]; /*by frontier id.*/
 	atomic64_t active_zone_writes[LBZ_ZONE_MAX_STREAM]; /*2 stream support f2fs.*/
+	/*
+	 * (zone id + 1) << 32 | wp_block of active zone, 0 for no active zone.
+	 * wp_block of active zone lives here and is written back when it's full.
+	 */
+	atomic64_t active_res[LBZ_ZONE_MAX_ACTIVE];
+	unsigned int nr_frontiers; /*per stream.*/
+	atomic_t frontier_rr[LBZ_ZONE_MAX_STREAM]; /*next slot of stream.*/
+	atomic64_t frontier_writes[LBZ_ZONE_MAX_ACTIVE];
+	/*sampled by zone state timer.*/
+	long frontier_last_writes[LBZ_ZONE_MAX_ACTIVE];
+	unsigned long frontier_rate[LBZ_ZONE_MAX_ACTIVE]; /*blocks per second.*/
 
 	int empty_zone_count;
 	int partial_zone_count; /*not in use.*/
 	int full_zone_count;
 	int active_zone_count; /*gc zone will not in any list, but it is active.*/
 
-	/* Protect list and variable. */
+	/* Protect list and variable, alloc only takes it to switch active zone. */
 	spinlock_t zmd_lock;
 
 	/*zone state management thread.*/
@@ -145,13 +165,17 @@ struct lbz_zone_metadata {
 	unsigned long zs_close_times;
 	unsigned long zs_reset_times;
 
+	/*user reads of mapped blocks, zone reset waits for them.*/
+	struct srcu_struct read_srcu;
+
 	/*Global resource, referenced by gc and alloc context.*/
-	atomic_t nr_total_blks;
-	atomic_t nr_allocable_blks;
-	atomic_t nr_valid_blks; /*not accurate and don't need.*/
+	atomic64_t nr_total_blks;
+	atomic64_t nr_allocable_blks;
+	atomic64_t nr_valid_blks; /*not accurate and don't need.*/
 
 	/*watermark*/
 	unsigned int reserved_blks_gc;
+	unsigned int reserved_blks_sync; /*part of reserved_blks_gc, sync user write can use.*/
 	unsigned int reclaim_wm_gc_low;
 	unsigned int reclaim_wm_gc_high;
 	unsigned int zone_reclaim_wm;
@@ -159,6 +183,7 @@ struct lbz_zone_metadata {
 	/*zone size.*/
 	unsigned int zone_size_sectors;
 	unsigned int zone_size_blks;
+	unsigned int zone_size_blks_shift; /*pbid to zone id.*/
 	unsigned int nr_zones;
 	unsigned int nr_useable_zones;
 
@@ -182,6 +207,7 @@ struct lbz_zone_metadata {
 
 enum lbz_alloc_flag {
 	LBZ_ALLOC_FLAG_USER,
+	LBZ_ALLOC_FLAG_USER_SYNC,
 	LBZ_ALLOC_FLAG_GC
 };
 
@@ -227,31 +253,58 @@ static inline bool lbz_check_zone_low_wm(struct lbz_zone_metadata *zmd, struct l
 
 static inline bool lbz_check_need_reclaim_low(struct lbz_zone_metadata *zmd)
 {
-	unsigned int wm = atomic_read(&zmd->nr_total_blks) * zmd->reclaim_wm_gc_low / 100;
+	s64 wm = div_u64(atomic64_read(&zmd->nr_total_blks) * zmd->reclaim_wm_gc_low, 100);
 
-	if (atomic_read(&zmd->nr_allocable_blks) - zmd->reserved_blks_gc < wm)
+	if (atomic64_read(&zmd->nr_allocable_blks) - zmd->reserved_blks_gc < wm)
 		return true;
 	return false;
 }
 
 static inline bool lbz_check_need_reclaim_high(struct lbz_zone_metadata *zmd)
 {
-	unsigned int wm = atomic_read(&zmd->nr_total_blks) * zmd->reclaim_wm_gc_high / 100;
+	s64 wm = div_u64(atomic64_read(&zmd->nr_total_blks) * zmd->reclaim_wm_gc_high, 100);
 
-	if (atomic_read(&zmd->nr_allocable_blks) - zmd->reserved_blks_gc < wm)
+	if (atomic64_read(&zmd->nr_allocable_blks) - zmd->reserved_blks_gc < wm)
 		return true;
 	return false;
 }
 
+/*zone size is power of 2, checked by lbz_init_zone_metadata.*/
+static inline struct lbz_zone *get_zone_by_pbid(struct lbz_zone_metadata *zmd, unsigned int pbid)
+{
+	return zmd->zones[pbid >> zmd->zone_size_blks_shift];
+}
+
+/*
+ * User read of a mapped block doesn't reference its zone, zone reset waits
+ * a grace period instead. Read side ends in bio endio, may be on another cpu,
+ * so the variants without lockdep annotation are used.
+ */
+static inline int lbz_zone_read_lock(struct lbz_zone_metadata *zmd)
+{
+	return __srcu_read_lock(&zmd->read_srcu);
+}
+
+static inline void lbz_zone_read_unlock(struct lbz_zone_metadata *zmd, int idx)
+{
+	__srcu_read_unlock(&zmd->read_srcu, idx);
+}
+
+static inline void lbz_zone_wait_readers(struct lbz_zone_metadata *zmd)
+{
+	synchronize_srcu(&zmd->read_srcu);
+}
+
 void lbz_get_zone(struct lbz_zone *zone);
 void lbz_put_zone(struct lbz_zone *zone);
 void lbz_zone_complete_write(struct lbz_zone *zone);
 void lbz_zone_release_global_res(struct lbz_zone_metadata *zmd, struct lbz_zone *zone);
-struct lbz_zone *get_zone_by_pbid(struct lbz_zone_metadata *zmd, unsigned int pbid);
+void lbz_zone_release_global_res_nr(struct lbz_zone_metadata *zmd, struct lbz_zone *zone, int nr);
 void lbz_zone_update_reverse_map(struct lbz_zone_metadata *zmd, struct lbz_zone *zone,
 		unsigned int pbid, unsigned int blkid);
 struct lbz_zone *lbz_find_victim_zone(struct lbz_zone_metadata *zmd, enum lbz_victim_mod mod);
-int lbz_zone_alloc_res(struct lbz_zone_metadata *zmd, struct lbz_zone **ret_zone, enum lbz_alloc_flag mod, int stream_id);
+int lbz_zone_alloc_res(struct lbz_zone_metadata *zmd, struct lbz_zone **ret_zone,
+		unsigned int *nr_blks, enum lbz_alloc_flag mod, int stream_id);
 /*not in use.*/
 void lbz_zone_del_list(struct lbz_zone_metadata *zmd, struct lbz_zone *zone, enum lbz_zone_state state);
 
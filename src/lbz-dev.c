@@ -5,6 +5,9 @@
 #include "lbz-gc.h"
 #include "lbz-request.h"
 #include "lbz-nat-sit.h"
+#include "lbz-write-buffer.h"
+#include "lbz-read-cache.h"
+#include "lbz-readahead.h"
 
 #define LBZ_MSG_PREFIX "lbz-dev"
 
@@ -68,6 +71,53 @@ static const struct block_device_operations lbz_dev_ops = {
 	.owner		= THIS_MODULE,
 };
 
+#ifdef CONFIG_LBZ_BLK_MQ_SUPPORT
+/*request based, IO comes from lbz_mq_ops.*/
+static const struct block_device_operations lbz_mq_dev_ops = {
+	.open		= open_dev,
+	.release	= release_dev,
+	.ioctl		= ioctl_dev,
+	.owner		= THIS_MODULE,
+};
+
+/*
+ * one hardware queue per cpu, queue depth bounds requests in flight, plus
+ * LBZ_MQ_POLL_QUEUES for REQ_HIPRI reads of io_uring iopoll.
+ */
+static struct gendisk *__alloc_mq_disk(struct lbz_device *d)
+{
+	struct gendisk *disk;
+	int ret = 0;
+
+	ret = bioset_init(&d->mq_bio_set, BIO_POOL_SIZE, 0, 0);
+	if (ret < 0)
+		return ERR_PTR(ret);
+	d->tag_set.ops = &lbz_mq_ops;
+	d->tag_set.nr_hw_queues = nr_cpu_ids + LBZ_MQ_POLL_QUEUES;
+	d->tag_set.nr_maps = HCTX_MAX_TYPES;
+	d->tag_set.queue_depth = LBZ_MQ_QUEUE_DEPTH;
+	d->tag_set.numa_node = NUMA_NO_NODE;
+	d->tag_set.cmd_size = sizeof(struct lbz_mq_cmd);
+	/*write may sleep on mempool and cp write may wait for completion.*/
+	d->tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+	d->tag_set.driver_data = d;
+	ret = blk_mq_alloc_tag_set(&d->tag_set);
+	if (ret < 0)
+		goto tag_err;
+	disk = blk_mq_alloc_disk(&d->tag_set, d);
+	if (IS_ERR(disk)) {
+		ret = PTR_ERR(disk);
+		goto disk_err;
+	}
+	return disk;
+disk_err:
+	blk_mq_free_tag_set(&d->tag_set);
+tag_err:
+	bioset_exit(&d->mq_bio_set);
+	return ERR_PTR(ret);
+}
+#endif
+
 static inline int first_minor_to_idx(int first_minor)
 {
 	return (first_minor / LBZ_MINORS);
@@ -99,7 +149,11 @@ static void __read_device_info(struct lbz_device *dev, struct seq_file *seq)
 					"write_alloc_encounter_eagain: %lld\n"
 					"gc_alloc_encounter_eagain: %lld\n"
 					"user_write_blocks: %lld(%lld GiB)\n"
+					"user_write_coalesced_bios: %lld\n"
 					"user_read_blocks: %lld(%lld GiB)\n"
+					"user_read_device_bios: %lld\n"
+					"user_read_polled: %lld\n"
+					"user_read_polled_inflight: %lld\n"
 					"gc_inflight_io_cnt: %lld\n"
 					"gc_write_err_cnt: %lld\n"
 					"gc_read_err_cnt: %lld\n"
@@ -129,7 +183,11 @@ static void __read_device_info(struct lbz_device *dev, struct seq_file *seq)
 					atomic64_read(&dev->write_alloc_encounter_eagain),
 					atomic64_read(&dev->gc_alloc_encounter_eagain),
 					atomic64_read(&dev->user_write_blocks), atomic64_read(&dev->user_write_blocks) >> (30 - LBZ_DATA_BLK_SHIFT),
+					atomic64_read(&dev->user_write_coalesced_bios),
 					atomic64_read(&dev->user_read_blocks), atomic64_read(&dev->user_read_blocks) >> (30 - LBZ_DATA_BLK_SHIFT),
+					atomic64_read(&dev->user_read_device_bios),
+					atomic64_read(&dev->user_read_polled),
+					atomic64_read(&dev->user_read_polled_inflight),
 					atomic64_read(&dev->gc_inflight_io_cnt),
 					atomic64_read(&dev->gc_write_err_cnt),
 					atomic64_read(&dev->gc_read_err_cnt),
@@ -154,10 +212,26 @@ static int read_lbz_dev_proc(struct seq_file *seq, void *v)
 	lbz_iosched_proc_read(dev->iosched, seq);
 	seq_printf(seq, "------------gc context------------\n");
 	lbz_gc_proc_read(dev->gc_ctx, seq);
+	seq_printf(seq, "------------flush context------------\n");
+	lbz_flush_proc_read(dev->flush_ctx, seq);
 #ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
 	seq_printf(seq, "------------nat-sit mgmt------------\n");
 	lbz_nat_sit_proc_read(dev->nat_sit_mgmt, seq);
 #endif
+#ifdef CONFIG_LBZ_WRITE_BUFFER_SUPPORT
+	seq_printf(seq, "------------write buffer------------\n");
+	lbz_wb_proc_read(dev->wb, seq);
+#endif
+#ifdef CONFIG_LBZ_READ_CACHE_SUPPORT
+	seq_printf(seq, "------------read cache------------\n");
+	lbz_rc_proc_read(dev->rc, seq);
+#endif
+#ifdef CONFIG_LBZ_READAHEAD_SUPPORT
+	seq_printf(seq, "------------readahead------------\n");
+	lbz_ra_proc_read(dev->ra, seq);
+#endif
+	seq_printf(seq, "------------mapping------------\n");
+	lbz_mapping_proc_read(dev->mapping, seq);
 	seq_printf(seq, "------------zone metadata------------\n");
 	lbz_zone_proc_read(dev->zone_metadata, seq);
 
@@ -221,9 +295,18 @@ static int lbz_device_init(struct lbz_device *d, unsigned int block_size,
         goto out;
 	}
 
+#ifdef CONFIG_LBZ_BLK_MQ_SUPPORT
+	d->disk = __alloc_mq_disk(d);
+	if (IS_ERR(d->disk)) {
+		d->disk = NULL;
+		goto out_ida_remove;
+	}
+	ops = &lbz_mq_dev_ops;
+#else
 	d->disk = blk_alloc_disk(NUMA_NO_NODE);
 	if (!d->disk)
 		goto out_ida_remove;
+#endif
 
 	set_capacity(d->disk, sectors);
 	d->dev_size = sectors;
@@ -231,7 +314,7 @@ static int lbz_device_init(struct lbz_device *d, unsigned int block_size,
 	atomic64_set(&d->transaction_id, 0);
 	atomic64_set(&d->timestamp, 0);
 	d->nr_zones = blk_queue_nr_zones(bdev_get_queue(phy_bdev));
-	d->meta_bytes = 64; /*default config.*/
+	d->meta_bytes = sizeof(struct lbz_disk_log); /*default config, one log per block.*/
 	snprintf(d->disk->disk_name, DISK_NAME_LEN, "lbz%i", idx);
 
 
@@ -246,7 +329,11 @@ static int lbz_device_init(struct lbz_device *d, unsigned int block_size,
 	atomic64_set(&d->gc_alloc_encounter_eagain, 0);
 
 	atomic64_set(&d->user_write_blocks, 0);
+	atomic64_set(&d->user_write_coalesced_bios, 0);
 	atomic64_set(&d->user_read_blocks, 0);
+	atomic64_set(&d->user_read_device_bios, 0);
+	atomic64_set(&d->user_read_polled, 0);
+	atomic64_set(&d->user_read_polled_inflight, 0);
 
 	atomic64_set(&d->gc_inflight_io_cnt, 0);
 	atomic64_set(&d->gc_write_err_cnt, 0);
@@ -281,7 +368,9 @@ static int lbz_device_init(struct lbz_device *d, unsigned int block_size,
 	blk_queue_flag_set(QUEUE_FLAG_NONROT, d->disk->queue);
 	blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, d->disk->queue);
 	blk_queue_flag_set(QUEUE_FLAG_DISCARD, d->disk->queue);
-	blk_queue_flag_set(QUEUE_FLAG_NOMERGES, d->disk->queue);
+	/*blk-mq merges adjacent writes into one request, which lbz appends as a whole.*/
+	if (!queue_is_mq(q))
+		blk_queue_flag_set(QUEUE_FLAG_NOMERGES, d->disk->queue);
 
 	/*
 	 * set flush and fua to true.
@@ -314,6 +403,10 @@ static void lbz_device_free(struct lbz_device *d)
 
 		blk_cleanup_disk(disk);
 		ida_simple_remove(&lbz_device_idx, first_minor);
+#ifdef CONFIG_LBZ_BLK_MQ_SUPPORT
+		blk_mq_free_tag_set(&d->tag_set);
+		bioset_exit(&d->mq_bio_set);
+#endif
 	}
 }
 
@@ -323,6 +416,11 @@ void lbz_remove_device(struct lbz_device *d)
 
 	init_waitqueue_head(&wq);
 	lbz_dev_set_remove(d);
+#ifdef CONFIG_LBZ_WRITE_BUFFER_SUPPORT
+	/*buffered blocks go to disk as normal io.*/
+	lbz_wb_destroy(d->wb);
+	LBZ_FREE_MEM(d->wb, sizeof(struct lbz_write_buffer));
+#endif
 	/*wait io complete.*/
 	do {
 		wait_event_timeout(wq,
@@ -337,6 +435,16 @@ void lbz_remove_device(struct lbz_device *d)
 	/*set unready before waitting may let IO can not be sent to phy_bdev and wait forever.*/
 	lbz_dev_set_unready(d);
 	lbz_dev_remove_proc(d);
+	lbz_flush_ctx_destroy(d->flush_ctx);
+	LBZ_FREE_MEM(d->flush_ctx, sizeof(struct lbz_flush_ctx));
+#ifdef CONFIG_LBZ_READ_CACHE_SUPPORT
+	lbz_rc_destroy(d->rc);
+	LBZ_FREE_MEM(d->rc, sizeof(struct lbz_read_cache));
+#endif
+#ifdef CONFIG_LBZ_READAHEAD_SUPPORT
+	lbz_ra_destroy(d->ra);
+	LBZ_FREE_MEM(d->ra, sizeof(struct lbz_readahead));
+#endif
 #ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
 	lbz_nat_sit_destroy(d->nat_sit_mgmt);
 	LBZ_FREE_MEM(d->nat_sit_mgmt, sizeof(struct lbz_nat_sit_mgmt));
@@ -350,6 +458,8 @@ void lbz_remove_device(struct lbz_device *d)
 	lbz_destroy_zone_metadata(d->zone_metadata);
 	LBZ_FREE_MEM(d->zone_metadata, sizeof(struct lbz_zone_metadata));
     lbz_device_free(d);
+	bioset_exit(&d->coalesce_bio_set);
+	bioset_exit(&d->bio_split);
 	list_del_init(&d->list);
 	blkdev_put(d->phy_bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
 	LBZ_FREE_MEM(d, sizeof(struct lbz_device));
@@ -364,6 +474,11 @@ int lbz_create_device(unsigned int block_size,
 	struct nat_sit_args args;
 #endif
 
+	if ((sectors >> (LBZ_DATA_BLK_SHIFT - SECTOR_SHIFT)) >= LBZ_MAX_DEV_BLKS) {
+		LBZERR("device size %llu sectors exceeds %u blocks", (unsigned long long)sectors, LBZ_MAX_DEV_BLKS);
+		return -EINVAL;
+	}
+
 	LBZ_ALLOC_MEM(d, sizeof(struct lbz_device), GFP_KERNEL);
 	if (!d) {
 		LBZERR("malloc lbz_device encounter err: -ENOMEM");
@@ -389,7 +504,11 @@ int lbz_create_device(unsigned int block_size,
 	LBZINFO("init zone_metadata: %lx", (unsigned long)d->zone_metadata);
 
 	LBZ_ALLOC_MEM(d->mapping, sizeof(struct lbz_mapping), GFP_NOIO);
-	lbz_mapping_init(d->mapping, d);
+	ret = lbz_mapping_init(d->mapping, d);
+	if (ret < 0) {
+		LBZERR("init mapping failed: %d", ret);
+		goto mapping_err;
+	}
 	LBZINFO("init mapping: %lx", (unsigned long)d->mapping);
 
 	LBZ_ALLOC_MEM(d->iosched, sizeof(struct lbz_io_scheduler), GFP_NOIO);
@@ -413,11 +532,46 @@ int lbz_create_device(unsigned int block_size,
 		LBZERR("create proc file: %s failed: %d", d->devname, ret);
 		goto proc_err;
 	}
-	ret = bioset_init(&d->bio_split, BIO_POOL_SIZE, 0, 0);
+	ret = bioset_init(&d->bio_split, BIO_POOL_SIZE, LBZ_SPLIT_BIO_FRONT_PAD, 0);
 	if (ret < 0) {
 		LBZERR("init bio_split failed: %d", ret);
 		goto bs_err;
 	}
+	ret = bioset_init(&d->coalesce_bio_set, BIO_POOL_SIZE, LBZ_COALESCE_BIO_FRONT_PAD, BIOSET_NEED_BVECS);
+	if (ret < 0) {
+		LBZERR("init coalesce_bio_set failed: %d", ret);
+		goto cbs_err;
+	}
+	LBZ_ALLOC_MEM(d->flush_ctx, sizeof(struct lbz_flush_ctx), GFP_NOIO);
+	ret = d->flush_ctx ? lbz_flush_ctx_init(d->flush_ctx, d) : -ENOMEM;
+	if (ret < 0) {
+		LBZERR("init flush_ctx failed: %d", ret);
+		goto fc_err;
+	}
+#ifdef CONFIG_LBZ_WRITE_BUFFER_SUPPORT
+	LBZ_ALLOC_MEM(d->wb, sizeof(struct lbz_write_buffer), GFP_NOIO);
+	ret = d->wb ? lbz_wb_init(d->wb, d) : -ENOMEM;
+	if (ret < 0) {
+		LBZERR("init write buffer failed: %d", ret);
+		goto wb_err;
+	}
+#endif
+#ifdef CONFIG_LBZ_READ_CACHE_SUPPORT
+	LBZ_ALLOC_MEM(d->rc, sizeof(struct lbz_read_cache), GFP_NOIO);
+	ret = d->rc ? lbz_rc_init(d->rc, d) : -ENOMEM;
+	if (ret < 0) {
+		LBZERR("init read cache failed: %d", ret);
+		goto rc_err;
+	}
+#endif
+#ifdef CONFIG_LBZ_READAHEAD_SUPPORT
+	LBZ_ALLOC_MEM(d->ra, sizeof(struct lbz_readahead), GFP_NOIO);
+	ret = d->ra ? lbz_ra_init(d->ra, d) : -ENOMEM;
+	if (ret < 0) {
+		LBZERR("init readahead failed: %d", ret);
+		goto ra_err;
+	}
+#endif
 #ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
 	LBZ_ALLOC_MEM(d->nat_sit_mgmt, sizeof(struct lbz_nat_sit_mgmt), GFP_NOIO);
 	memset(&args, 0x0, sizeof(struct nat_sit_args));
@@ -428,6 +582,40 @@ int lbz_create_device(unsigned int block_size,
 	lbz_dev_set_ready(d);
 	LBZINFO("Added disk: %s, size: %llu sectors", d->disk->disk_name, sectors);
 	return 0;
+#ifdef CONFIG_LBZ_READAHEAD_SUPPORT
+ra_err:
+	if (d->ra)
+		LBZ_FREE_MEM(d->ra, sizeof(struct lbz_readahead));
+#ifdef CONFIG_LBZ_READ_CACHE_SUPPORT
+	lbz_rc_destroy(d->rc);
+#elif defined(CONFIG_LBZ_WRITE_BUFFER_SUPPORT)
+	lbz_wb_destroy(d->wb);
+#else
+	lbz_flush_ctx_destroy(d->flush_ctx);
+#endif
+#endif
+#ifdef CONFIG_LBZ_READ_CACHE_SUPPORT
+rc_err:
+	if (d->rc)
+		LBZ_FREE_MEM(d->rc, sizeof(struct lbz_read_cache));
+#ifdef CONFIG_LBZ_WRITE_BUFFER_SUPPORT
+	lbz_wb_destroy(d->wb);
+#else
+	lbz_flush_ctx_destroy(d->flush_ctx);
+#endif
+#endif
+#ifdef CONFIG_LBZ_WRITE_BUFFER_SUPPORT
+wb_err:
+	if (d->wb)
+		LBZ_FREE_MEM(d->wb, sizeof(struct lbz_write_buffer));
+	lbz_flush_ctx_destroy(d->flush_ctx);
+#endif
+fc_err:
+	if (d->flush_ctx)
+		LBZ_FREE_MEM(d->flush_ctx, sizeof(struct lbz_flush_ctx));
+	bioset_exit(&d->coalesce_bio_set);
+cbs_err:
+	bioset_exit(&d->bio_split);
 bs_err:
 	lbz_dev_remove_proc(d);
 proc_err:
@@ -438,6 +626,7 @@ gc_err:
 iosched_err:
 	LBZ_FREE_MEM(d->iosched, sizeof(struct lbz_io_scheduler));
 	lbz_mapping_destroy(d->mapping);
+mapping_err:
 	LBZ_FREE_MEM(d->mapping, sizeof(struct lbz_mapping));
 	lbz_destroy_zone_metadata(d->zone_metadata);
 zone_err:
@@ -474,8 +663,30 @@ int lbz_dev_init(void)
 		LBZERR("create dev proc dir failed: %d", ret);
 		return ret;
 	}
+	ret = lbz_iosched_cache_init();
+	if (ret < 0)
+		goto iosched_cache_err;
+	ret = lbz_request_cache_init();
+	if (ret < 0)
+		goto request_cache_err;
+#ifdef CONFIG_LBZ_EXTENT_MAPPING_SUPPORT
+	ret = lbz_mapping_cache_init();
+	if (ret < 0)
+		goto mapping_cache_err;
+#endif
 
 	return 0;
+#ifdef CONFIG_LBZ_EXTENT_MAPPING_SUPPORT
+mapping_cache_err:
+	lbz_request_cache_exit();
+#endif
+request_cache_err:
+	lbz_iosched_cache_exit();
+iosched_cache_err:
+	LBZERR("create caches failed: %d", ret);
+	proc_remove(lbz_dev_proc_file);
+	unregister_blkdev(lbz_major, "lbz");
+	return ret;
 }
 
 void lbz_dev_exit(void)
@@ -485,6 +696,11 @@ void lbz_dev_exit(void)
 	list_for_each_entry_safe(d, tmp, &lbz_devices, list) {
 		lbz_remove_device(d);
 	}
+#ifdef CONFIG_LBZ_EXTENT_MAPPING_SUPPORT
+	lbz_mapping_cache_exit();
+#endif
+	lbz_request_cache_exit();
+	lbz_iosched_cache_exit();
 	if (lbz_major)
 		unregister_blkdev(lbz_major, "lbz");
 	proc_remove(lbz_dev_proc_file);
@@ -35,6 +35,7 @@ int __gc_one_zone(struct lbz_zone *zone, struct lbz_device *dev)
 			pbid++;
 			continue;
 		}
+		lbz_iosched_gc_wait_slot(dev->iosched);
 		lbz_get_zone(zone);
 		lbz_inc_gc_inflight(dev);
 		ret = lbz_submit_gc_to_iosched(dev->iosched, zone, pbid, pos);
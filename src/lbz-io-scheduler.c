@@ -4,6 +4,9 @@
 #include "lbz-mapping.h"
 #include "lbz-gc.h"
 #include "lbz-nat-sit.h"
+#include "lbz-write-buffer.h"
+#include "lbz-read-cache.h"
+#include "lbz-readahead.h"
 
 #define LBZ_MSG_PREFIX "lbz-iosched"
 
@@ -11,112 +14,382 @@ static void task_get(struct lbz_io_task *task);
 static void __gc_task_callback(struct lbz_io_task *task, unsigned int pbid);
 static int __submit_gc_task(struct lbz_io_scheduler *iosched, struct lbz_io_task *task);
 static void trigger_retry_work(struct lbz_io_scheduler *iosched, unsigned long delay);
-static void __add_task_to_retry(struct lbz_io_scheduler *iosched, struct lbz_io_task *task);
+static void __add_task_to_retry(struct lbz_retry_ctx *ctx, struct lbz_io_task *task);
+static void trigger_ctx_retry_work(struct lbz_retry_ctx *ctx, unsigned long delay);
+static void __add_task_to_space_wait(struct lbz_io_scheduler *iosched, struct lbz_io_task *task);
+static void __requeue_space_waiters(struct lbz_io_scheduler *iosched, struct list_head *tasks);
+static int __submit_write_task(struct lbz_io_scheduler *iosched, struct lbz_io_task *task);
+static void __handle_write_ret(struct lbz_io_scheduler *iosched, struct lbz_io_task *task, int ret);
+
+static struct lbz_task_shard *__task_shard(struct lbz_io_scheduler *iosched, unsigned int blkid)
+{
+	return &iosched->task_shards[(blkid >> LBZ_TASK_SHARD_SHIFT) % LBZ_TASK_SHARDS];
+}
 
-static struct lbz_io_task *insert_task_to_tree(struct lbz_io_scheduler *iosched, struct lbz_io_task *tk)
+/*
+ * tasks in tree never overlap, so a range search is a plain binary search.
+ * must be locked by caller.
+ */
+static struct lbz_io_task *__link_task(struct lbz_task_shard *shard, struct lbz_io_task *tk)
 {
-	struct rb_node **p = &iosched->task_tree.rb_node;
+	struct rb_node **p = &shard->task_tree.rb_node;
 	struct rb_node *parent = NULL;
-	struct lbz_io_task *retk = NULL, *tkp = NULL;
-	unsigned long flag = 0;
-	
-	write_lock_irqsave(&iosched->task_lock, flag);
+	struct lbz_io_task *tkp = NULL;
+
 	while (*p) {
 		parent = *p;
 		tkp = container_of(*p, struct lbz_io_task, node);
-		if (tk->blkid > tkp->blkid) {
+		if (tk->blkid >= tkp->blkid + tkp->nr_blks) {
 			p = &(*p)->rb_right;
-		} else if (tk->blkid < tkp->blkid) {
+		} else if (tk->blkid + tk->nr_blks <= tkp->blkid) {
 			p = &(*p)->rb_left;
 		} else {
-			retk = tkp;
-			task_get(retk);
-			goto out;
+			return tkp;
 		}
 	}
 	rb_link_node(&tk->node, parent, p);
-	rb_insert_color(&tk->node, &iosched->task_tree);
+	rb_insert_color(&tk->node, &shard->task_tree);
 	task_get(tk); /*after: task's refcount is 2.*/
-	atomic64_inc(&iosched->task_count);
-out:
-	write_unlock_irqrestore(&iosched->task_lock, flag);
+	shard->task_count++;
+	return NULL;
+}
+
+static inline bool __can_chain(struct lbz_io_task *tk, struct lbz_io_task *holder)
+{
+	return tk->type != LBZ_TASK_GC && holder->type != LBZ_TASK_GC;
+}
+
+/*
+ * gc task conflicted with write task will be pending on it, and user write
+ * conflicted with write task is chained behind it. Both are linked under shard
+ * lock, so split_task_in_tree can move them to the right task. Chained write
+ * may be dispatched as soon as the lock is released, caller must not touch it.
+ */
+static struct lbz_io_task *insert_task_to_tree(struct lbz_io_scheduler *iosched, struct lbz_io_task *tk)
+{
+	struct lbz_task_shard *shard = __task_shard(iosched, tk->blkid);
+	struct lbz_io_task *retk = NULL;
+	unsigned long flag = 0;
+	
+	BUG_ON(tk->blkid + tk->nr_blks > lbz_task_shard_end(tk->blkid));
+	spin_lock_irqsave(&shard->task_lock, flag);
+	retk = __link_task(shard, tk);
+	if (retk) {
+		if (tk->type == LBZ_TASK_GC) {
+			tk->pending_gc_next = retk->pending_gc_node;
+			retk->pending_gc_node = tk;
+		} else if (__can_chain(tk, retk)) {
+			list_add_tail(&tk->list, &retk->chained);
+			atomic64_inc(&iosched->chained_writes);
+		}
+		task_get(retk);
+	}
+	spin_unlock_irqrestore(&shard->task_lock, flag);
 	return retk;
 }
 
-static void del_task_from_tree(struct lbz_io_scheduler *iosched, struct lbz_io_task *tk)
+/*
+ * Shrink tk to nr_blks and hand the rest of its range to rest. Both happen under
+ * shard lock, so no write can slip into the range between them.
+ */
+static void split_task_in_tree(struct lbz_io_scheduler *iosched, struct lbz_io_task *tk,
+		struct lbz_io_task *rest, unsigned int nr_blks)
 {
+	struct lbz_task_shard *shard = __task_shard(iosched, tk->blkid);
+	struct lbz_io_task *pos, *next, *keep = NULL;
 	unsigned long flag = 0;
 
-	write_lock_irqsave(&iosched->task_lock, flag);
-	rb_erase(&tk->node, &iosched->task_tree);
-	write_unlock_irqrestore(&iosched->task_lock, flag);
-	atomic64_dec(&iosched->task_count);
+	spin_lock_irqsave(&shard->task_lock, flag);
+	rest->blkid = tk->blkid + nr_blks;
+	rest->nr_blks = tk->nr_blks - nr_blks;
+	tk->nr_blks = nr_blks;
+	BUG_ON(__link_task(shard, rest) != NULL);
+	for (pos = tk->pending_gc_node; pos != NULL; pos = next) {
+		next = pos->pending_gc_next;
+		if (pos->blkid >= rest->blkid) {
+			pos->pending_gc_next = rest->pending_gc_node;
+			rest->pending_gc_node = pos;
+		} else {
+			pos->pending_gc_next = keep;
+			keep = pos;
+		}
+	}
+	tk->pending_gc_node = keep;
+	/*chained write starting in rest can't go before rest.*/
+	list_for_each_entry_safe(pos, next, &tk->chained, list) {
+		if (pos->blkid >= rest->blkid)
+			list_move_tail(&pos->list, &rest->chained);
+	}
+	spin_unlock_irqrestore(&shard->task_lock, flag);
 }
 
-static __attribute__ ((unused)) struct lbz_io_task *search_task(struct lbz_io_scheduler *iosched, unsigned int blkid)
+static void __add_task_to_retry(struct lbz_retry_ctx *ctx, struct lbz_io_task *task);
+static void trigger_ctx_retry_work(struct lbz_retry_ctx *ctx, unsigned long delay);
+
+/*
+ * Range of tk is handed to its chained writes in the same critical section,
+ * so no later write can get in between. A chained write still overlapping
+ * another in-flight write is chained behind that one, otherwise it takes
+ * its range now and only needs space. One conflicting with gc task falls
+ * back to retry from INIT. Writes to dispatch are returned in ready.
+ */
+static void __unlink_task(struct lbz_io_scheduler *iosched, struct lbz_io_task *tk, struct list_head *ready)
 {
-	struct rb_node **p = &iosched->task_tree.rb_node;
-	struct lbz_io_task *tk = NULL;
+	struct lbz_task_shard *shard = __task_shard(iosched, tk->blkid);
+	struct lbz_io_task *pos, *next, *retk;
 	unsigned long flag = 0;
 
-	read_lock_irqsave(&iosched->task_lock, flag);
-	while (*p) {
-		tk = container_of(*p, struct lbz_io_task, node);
-		if (tk->blkid > blkid) {
-			p = &(*p)->rb_right;
-		} else if (tk->blkid < blkid) {
-			p = &(*p)->rb_left;
+	spin_lock_irqsave(&shard->task_lock, flag);
+	rb_erase(&tk->node, &shard->task_tree);
+	shard->task_count--;
+	list_for_each_entry_safe(pos, next, &tk->chained, list) {
+		list_del_init(&pos->list);
+		retk = __link_task(shard, pos);
+		if (retk == NULL) {
+			pos->status = LBZ_TASK_ALLOC_RES;
+			list_add_tail(&pos->list, ready);
+		} else if (__can_chain(pos, retk)) {
+			list_add_tail(&pos->list, &retk->chained);
 		} else {
-			break;
+			list_add_tail(&pos->list, ready);
+		}
+	}
+	spin_unlock_irqrestore(&shard->task_lock, flag);
+}
+
+static void del_task_from_tree(struct lbz_io_scheduler *iosched, struct lbz_io_task *tk)
+{
+	struct lbz_io_task *pos, *next;
+	struct list_head ready;
+
+	INIT_LIST_HEAD(&ready);
+	__unlink_task(iosched, tk, &ready);
+
+	/*dispatched by retry ctx, callers may not sleep.*/
+	list_for_each_entry_safe(pos, next, &ready, list) {
+		struct lbz_retry_ctx *ctx = &iosched->retry_ctxs[pos->ctx];
+
+		list_del_init(&pos->list);
+		__add_task_to_retry(ctx, pos);
+		trigger_ctx_retry_work(ctx, 0);
+	}
+}
+
+/*task covering blkid, must be locked by caller.*/
+static struct lbz_io_task *__search_task(struct lbz_task_shard *shard, unsigned int blkid)
+{
+	struct rb_node *p = shard->task_tree.rb_node;
+	struct lbz_io_task *tk = NULL;
+
+	while (p) {
+		tk = container_of(p, struct lbz_io_task, node);
+		if (blkid >= tk->blkid + tk->nr_blks) {
+			p = p->rb_right;
+		} else if (blkid < tk->blkid) {
+			p = p->rb_left;
+		} else {
+			return tk;
 		}
-		tk = NULL;
 	}
+	return NULL;
+}
+
+static __attribute__ ((unused)) struct lbz_io_task *search_task(struct lbz_io_scheduler *iosched, unsigned int blkid)
+{
+	struct lbz_task_shard *shard = __task_shard(iosched, blkid);
+	struct lbz_io_task *tk = NULL;
+	unsigned long flag = 0;
+
+	spin_lock_irqsave(&shard->task_lock, flag);
+	tk = __search_task(shard, blkid);
 	if (tk) {
 		task_get(tk);
 	}
-	read_unlock_irqrestore(&iosched->task_lock, flag);
+	spin_unlock_irqrestore(&shard->task_lock, flag);
 	return tk;
 }
 
+/*copy one block of page to bio at iter, iter is advanced past it.*/
+static void __copy_page_to_bio(struct bio *bio, struct bvec_iter *iter, struct page *page)
+{
+	struct bvec_iter blk = *iter, it;
+	struct bio_vec bv;
+	char *src = page_address(page), *dst;
+
+	blk.bi_size = LBZ_DATA_BLK_SIZE;
+	__bio_for_each_segment(bv, bio, it, blk) {
+		dst = kmap_atomic(bv.bv_page);
+		memcpy(dst + bv.bv_offset, src, bv.bv_len);
+		kunmap_atomic(dst);
+		src += bv.bv_len;
+	}
+	bio_advance_iter(bio, iter, LBZ_DATA_BLK_SIZE);
+}
+
+/*
+ * Read of blocks whose latest data is still in memory: a write bio in flight
+ * or page of a gc task being moved. If every block of bio is covered by such
+ * tasks, copy them under shard lock and complete bio without device IO. The
+ * lock keeps data alive, write task is retired before its bio completes and
+ * gc page is freed after task leaves tree.
+ */
+static bool __read_from_tasks(struct lbz_io_scheduler *iosched, struct bio *bio)
+{
+	struct lbz_task_shard *shard;
+	struct lbz_io_task *tk;
+	struct bvec_iter dst, src;
+	unsigned int blkid = sector_to_blkid(bio->bi_iter.bi_sector);
+	unsigned int nr = bio_sectors(bio) >> LBZ_BLOCK_SECTORS_SHIFT, end = blkid + nr, b, n;
+	long write_blks = 0, gc_blks = 0;
+	unsigned long flag = 0;
+
+	if (nr == 0 || nr > LBZ_TASK_READ_MAX_BLKS || end > lbz_task_shard_end(blkid))
+		return false;
+	shard = __task_shard(iosched, blkid);
+	if (READ_ONCE(shard->task_count) == 0)
+		return false;
+
+	spin_lock_irqsave(&shard->task_lock, flag);
+	for (b = blkid; b < end; b = tk->blkid + tk->nr_blks) {
+		tk = __search_task(shard, b);
+		if (!tk || !smp_load_acquire(&tk->servable))
+			goto miss;
+	}
+	dst = bio->bi_iter;
+	for (b = blkid; b < end; b += n) {
+		tk = __search_task(shard, b);
+		n = min(end, tk->blkid + tk->nr_blks) - b;
+		if (tk->type == LBZ_TASK_GC) {
+			__copy_page_to_bio(bio, &dst, tk->page);
+			gc_blks++;
+		} else {
+			src = tk->data_iter;
+			bio_advance_iter(tk->bio, &src, (b - tk->blkid) << LBZ_DATA_BLK_SHIFT);
+			src.bi_size = n << LBZ_DATA_BLK_SHIFT;
+			bio_copy_data_iter(bio, &dst, tk->bio, &src);
+			write_blks += n;
+		}
+	}
+	spin_unlock_irqrestore(&shard->task_lock, flag);
+
+	atomic64_add(write_blks, &iosched->write_served_reads);
+	atomic64_add(gc_blks, &iosched->gc_served_reads);
+	bio_endio(bio);
+	return true;
+miss:
+	spin_unlock_irqrestore(&shard->task_lock, flag);
+	return false;
+}
+
+/*reads stop copying from write bio before it is handed back to user.*/
+static void __retire_task_data(struct lbz_io_scheduler *iosched, struct lbz_io_task *task)
+{
+	struct lbz_task_shard *shard = __task_shard(iosched, task->blkid);
+	unsigned long flag = 0;
+
+	spin_lock_irqsave(&shard->task_lock, flag);
+	task->servable = false;
+	spin_unlock_irqrestore(&shard->task_lock, flag);
+}
+
 static __attribute__ ((unused)) bool is_task_tree_empty(struct lbz_io_scheduler *iosched)
 {
-	bool empty;
+	bool empty = true;
 	unsigned long flag = 0;
+	int i = 0;
 
-	read_lock_irqsave(&iosched->task_lock, flag);
-	empty = RB_EMPTY_ROOT(&iosched->task_tree);
-	read_unlock_irqrestore(&iosched->task_lock, flag);
+	for (; i < LBZ_TASK_SHARDS && empty; i++) {
+		spin_lock_irqsave(&iosched->task_shards[i].task_lock, flag);
+		empty = RB_EMPTY_ROOT(&iosched->task_shards[i].task_tree);
+		spin_unlock_irqrestore(&iosched->task_shards[i].task_lock, flag);
+	}
 
 	return empty;
 }
 
+static unsigned long __task_count(struct lbz_io_scheduler *iosched)
+{
+	unsigned long count = 0;
+	int i = 0;
+
+	for (; i < LBZ_TASK_SHARDS; i++)
+		count += READ_ONCE(iosched->task_shards[i].task_count);
+	return count;
+}
+
 static void task_get(struct lbz_io_task *task)
 {
 	atomic_inc(&task->refcount);
 }
 
+/*gc task called back, its slot of gc cap is free.*/
+static void __gc_task_done(struct lbz_io_scheduler *iosched)
+{
+	lbz_dec_gc_inflight(iosched->host);
+	if (wq_has_sleeper(&iosched->gc_limit.wait))
+		wake_up(&iosched->gc_limit.wait);
+}
+
+/*
+ * Hot path objects come from slab caches backed by mempools, so they never
+ * fail under GFP_NOIO and don't touch lbz_mem_bytes. Integrity logs of single
+ * block task come from lbz_log_pool, larger ones take one page.
+ */
+#define LBZ_MIN_POOL_OBJS (BIO_POOL_SIZE * 4)
+static struct kmem_cache *lbz_task_cache;
+static struct kmem_cache *lbz_hook_cache;
+static struct kmem_cache *lbz_log_cache;
+static mempool_t *lbz_task_pool;
+static mempool_t *lbz_hook_pool;
+static mempool_t *lbz_log_pool;
+static mempool_t *lbz_log_page_pool;
+
+static void *__alloc_integrity_buf(unsigned int nr_blks)
+{
+	void *buf;
+
+	if (nr_blks == 1)
+		buf = mempool_alloc(lbz_log_pool, GFP_NOIO);
+	else
+		buf = page_address((struct page *)mempool_alloc(lbz_log_page_pool, GFP_NOIO));
+	memset(buf, 0, sizeof(struct lbz_disk_log) * nr_blks);
+	return buf;
+}
+
+static void __free_integrity_buf(void *buf, unsigned int nr_blks)
+{
+	if (nr_blks == 1)
+		mempool_free(buf, lbz_log_pool);
+	else
+		mempool_free(virt_to_page(buf), lbz_log_page_pool);
+}
+
 static void task_destroy(struct lbz_io_task *task)
 {
-	if (NULL != task->integrity_buf)
-		LBZ_FREE_MEM(task->integrity_buf, sizeof(struct lbz_disk_log));
-	LBZ_FREE_MEM(task, sizeof(struct lbz_io_task));
+	if (!IS_ERR_OR_NULL(task->integrity_buf))
+		__free_integrity_buf(task->integrity_buf, task->nr_blks);
+	mempool_free(task, lbz_task_pool);
 }
 
 static void task_put(struct lbz_io_task *task)
 {
+	struct lbz_io_task *gc_task = NULL, *next = NULL;
+
 	smp_mb__before_atomic();
 	if (atomic_dec_and_test(&task->refcount)) {
 		smp_mb__after_atomic();
-		if (task->type != LBZ_TASK_GC && NULL != task->pending_gc_node) {
-			struct lbz_io_scheduler *iosched = task->pending_gc_node->iosched;
-			struct lbz_device *dev = iosched->host;
+		if (task->type != LBZ_TASK_GC)
+			gc_task = task->pending_gc_node;
+		for (; gc_task != NULL; gc_task = next) {
+			struct lbz_io_scheduler *iosched = gc_task->iosched;
 
+			next = gc_task->pending_gc_next;
 			/*write error will deliver to gc.*/
 			if (task->error < 0)
-				task->pending_gc_node->error = task->error;
+				gc_task->error = task->error;
 			/*task->error == -ENOENT, callback just invalid reverse mapping.*/
-			__gc_task_callback(task->pending_gc_node, LBZ_INVALID_PBID);
-			lbz_dec_gc_inflight(dev);
+			__gc_task_callback(gc_task, LBZ_INVALID_PBID);
+			__gc_task_done(iosched);
 		}
 		task_destroy(task);
 	}
@@ -129,16 +402,21 @@ static void __task_init(struct lbz_io_task *task)
 	task->status = LBZ_TASK_INIT;
 	task->error = 0;
 	task->zone = NULL;
+	task->nr_blks = 1;
 	task->pending_gc_node = NULL;
+	task->pending_gc_next = NULL;
+	task->space_waiting = false;
 	RB_CLEAR_NODE(&task->node);
 	INIT_LIST_HEAD(&task->list);
+	INIT_LIST_HEAD(&task->chained);
 }
 
 static struct lbz_io_task *task_alloc(enum lbz_task_type type, gfp_t flag)
 {
 	struct lbz_io_task *task;
 
-	LBZ_ALLOC_MEM(task, sizeof(struct lbz_io_task), GFP_NOIO);
+	task = mempool_alloc(lbz_task_pool, flag);
+	memset(task, 0, sizeof(struct lbz_io_task));
 	__task_init(task);
 	task->type = type;
 
@@ -151,54 +429,101 @@ static void __unhook_io(struct bio *bio)
 
 	bio->bi_private = hook->user_private;
 	bio->bi_end_io = hook->user_endio;
-	
+	/*hook in front_pad goes away with bio.*/
+	if (hook->pooled)
+		mempool_free(hook, lbz_hook_pool);
 	bio_endio(bio);
-	LBZ_FREE_MEM(hook, sizeof(struct lbz_io_hook));
 }
 
 static void lbz_read_io_endio(struct bio *bio)
 {
 	struct lbz_io_hook *hook = bio->bi_private;
 	struct lbz_device *dev = hook->dev;
-	struct lbz_zone *zone = hook->zone;
+	struct lbz_gc_limit *gl = &dev->iosched->gc_limit;
+	int srcu_idx = hook->srcu_idx;
+	bool polled = hook->polled;
 	int errno = blk_status_to_errno(bio->bi_status);
+	u64 lat = ktime_get_ns() - hook->start_ns, ewma = READ_ONCE(gl->read_lat_ns);
 
+	/*racy ewma, 1/8 weight of new sample, only steers gc cap.*/
+	WRITE_ONCE(gl->read_lat_ns, ewma - (ewma >> 3) + (lat >> 3));
 	if (errno < 0) {
 		atomic64_inc(&dev->user_read_err_cnt);
 		LBZERR("read IO encounter error: %d", errno);
 		lbz_dev_set_faulty(dev);
 	}
 	__unhook_io(bio);
-	lbz_put_zone(zone); /*lbz_mapping_lookup*/
+	lbz_zone_read_unlock(dev->zone_metadata, srcu_idx); /*__submit_read_io*/
+	if (polled)
+		atomic64_dec(&dev->user_read_polled_inflight);
 	atomic64_dec(&dev->user_read_inflight_io_cnt);
 }
 
-static void lbz_write_io_endio(struct bio *bio)
+/*invalid old blocks, weight of old zone is dropped once for a run in it.*/
+static void __release_old_blocks(struct lbz_device *dev, unsigned int *old_pbids, unsigned int nr)
+{
+	struct lbz_zone_metadata *zmd = dev->zone_metadata;
+	struct lbz_zone *zone = NULL, *old_zone;
+	unsigned int i = 0;
+	int run = 0;
+
+	for (; i < nr; i++) {
+		if (old_pbids[i] == LBZ_INVALID_PBID)
+			continue;
+		old_zone = get_zone_by_pbid(zmd, old_pbids[i]);
+		if (old_zone != zone) {
+			/*GC and write callback will not exec at the same time, global release won't dec zero.*/
+			if (run > 0)
+				lbz_zone_release_global_res_nr(zmd, zone, run);
+			zone = old_zone;
+			run = 0;
+		}
+		lbz_zone_update_reverse_map(zmd, old_zone, old_pbids[i], LBZ_INVALID_PBID);
+		run++;
+	}
+	if (run > 0)
+		lbz_zone_release_global_res_nr(zmd, zone, run);
+}
+
+/*process context, called by completion work.*/
+static void __complete_write_task(struct lbz_io_task *task)
 {
+	struct bio *bio = task->bio;
 	struct lbz_io_hook *hook = bio->bi_private;
 	struct lbz_device *dev = hook->dev;
-	struct lbz_io_task *task = hook->task;
 	struct lbz_zone *zone = task->zone;
 	sector_t ret_sec = bio->bi_iter.bi_sector;
-	unsigned int pbid = sector_to_blkid(ret_sec), old_pbid = LBZ_INVALID_PBID;
+	unsigned int pbid = sector_to_blkid(ret_sec);
+	unsigned int old_pbids[LBZ_COMPLETE_CHUNK];
 	int errno = blk_status_to_errno(bio->bi_status);
+	unsigned int i = 0, k = 0, n = 0;
+	struct lbz_io_task *pos, *next;
+	struct list_head ready;
 
+	INIT_LIST_HEAD(&ready);
 	if (0 == errno) {
-		old_pbid = lbz_mapping_add(dev->mapping, task->blkid, pbid);
-		if (old_pbid != LBZ_INVALID_PBID) {
-			struct lbz_zone *old_zone = get_zone_by_pbid(dev->zone_metadata, old_pbid);
-
-			/*GC and write callback will not exec at the same time, global release won't dec zero.*/
-			lbz_zone_update_reverse_map(dev->zone_metadata,
-					old_zone, old_pbid, LBZ_INVALID_PBID);
-			lbz_zone_release_global_res(dev->zone_metadata, old_zone);
+		/*zone append returns the first sector, the run is contiguous from it.*/
+		for (; i < task->nr_blks; i += n) {
+			n = min_t(unsigned int, task->nr_blks - i, LBZ_COMPLETE_CHUNK);
+			lbz_mapping_add_range(dev->mapping, task->blkid + i, pbid + i, n, old_pbids);
+			__release_old_blocks(dev, old_pbids, n);
+			for (k = 0; k < n; k++)
+				lbz_zone_update_reverse_map(dev->zone_metadata, zone, pbid + i + k, task->blkid + i + k);
 		}
-		lbz_zone_update_reverse_map(dev->zone_metadata, zone, pbid, task->blkid);
+#ifdef CONFIG_LBZ_READ_CACHE_SUPPORT
+		/*after mapping update, before user sees the completion.*/
+		lbz_rc_invalidate(dev->rc, task->blkid, task->nr_blks);
+#endif
+#ifdef CONFIG_LBZ_READAHEAD_SUPPORT
+		lbz_ra_invalidate(dev->ra, task->blkid, task->nr_blks);
+#endif
 	} else {
 		atomic64_inc(&dev->user_write_err_cnt);
 		LBZERR("write IO encounter error: %d", errno);
 		lbz_dev_set_faulty(dev);
 	}
+	if (task->servable)
+		__retire_task_data(dev->iosched, task);
 	__unhook_io(bio);
 #ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
 	if (task->type != LBZ_TASK_USER_WRITE) {
@@ -206,7 +531,7 @@ static void lbz_write_io_endio(struct bio *bio)
 	}
 #endif
 	if (task->status > LBZ_TASK_INIT) {
-		del_task_from_tree(dev->iosched, task);
+		__unlink_task(dev->iosched, task, &ready);
 		task_put(task); /*insert_task_to_tree*/
 	}
 	task_put(task); /*__task_init*/
@@ -216,15 +541,76 @@ static void lbz_write_io_endio(struct bio *bio)
 									* complete write before del_task_from_tree.*/
 	lbz_put_zone(zone); /*lbz_zone_alloc_res*/
 	atomic64_dec(&dev->user_write_inflight_io_cnt);
+
+	/*chained writes that got their range go out from here, no retry work round trip.*/
+	list_for_each_entry_safe(pos, next, &ready, list) {
+		list_del_init(&pos->list);
+		__handle_write_ret(dev->iosched, pos, __submit_write_task(dev->iosched, pos));
+	}
+}
+
+static void __complete_gc_write_task(struct lbz_io_task *task);
+static void cpl_wk_fn(struct work_struct *work)
+{
+	struct lbz_completion_ctx *cctx = container_of(work, struct lbz_completion_ctx, work);
+	struct llist_node *list = llist_reverse_order(llist_del_all(&cctx->tasks));
+	struct lbz_io_task *task, *next;
+	long nr = 0;
+
+	/*task may be freed by __complete_write_task.*/
+	llist_for_each_entry_safe(task, next, list, cnode) {
+		if (task->type == LBZ_TASK_GC)
+			__complete_gc_write_task(task);
+		else
+			__complete_write_task(task);
+		nr++;
+	}
+	atomic64_inc(&cctx->iosched->cpl_batches);
+	atomic64_add(nr, &cctx->iosched->cpl_tasks);
+}
+
+/*may be interrupt context, only queue task to completion ctx of this cpu.*/
+static void lbz_write_io_endio(struct bio *bio)
+{
+	struct lbz_io_hook *hook = bio->bi_private;
+	struct lbz_io_scheduler *iosched = hook->dev->iosched;
+	struct lbz_completion_ctx *cctx = get_cpu_ptr(iosched->cpl_ctxs);
+
+	/*work drains whole list, only first one needs to kick it.*/
+	if (llist_add(&hook->task->cnode, &cctx->tasks))
+		queue_work_on(smp_processor_id(), iosched->cpl_wq, &cctx->work);
+	put_cpu_ptr(iosched->cpl_ctxs);
+}
+
+/*
+ * write: hook lives in task.
+ * read: hook lives in front_pad of bio split from dev->bio_split, user bio
+ * takes one from pool.
+ */
+static struct lbz_io_hook *__get_hook(struct lbz_device *dev, struct bio *bio, int rw, void *priv)
+{
+	struct lbz_io_hook *hook;
+
+	if (rw == WRITE) {
+		hook = &((struct lbz_io_task *)priv)->hook;
+		hook->pooled = false;
+	} else if (bio->bi_pool == &dev->bio_split) {
+		hook = &container_of(bio, struct lbz_split_bio, bio)->hook;
+		hook->pooled = false;
+	} else {
+		hook = mempool_alloc(lbz_hook_pool, GFP_NOIO);
+		hook->pooled = true;
+	}
+	return hook;
 }
 
 void __hook_io(struct lbz_device *dev, struct bio *bio, unsigned int blkid, int rw, void *priv)
 {
-	struct lbz_io_hook *hook = NULL;
+	struct lbz_io_hook *hook = __get_hook(dev, bio, rw, priv);
 
-	LBZ_ALLOC_MEM(hook, sizeof(struct lbz_io_hook), GFP_NOIO);
 	hook->dev = dev;
-	hook->priv = priv; /*task for write, zone for read.*/
+	hook->priv = priv; /*task for write, srcu_idx is set by read.*/
+	hook->polled = false;
 	hook->blkid = blkid;
 	hook->user_private = bio->bi_private;
 	hook->user_endio = bio->bi_end_io;
@@ -238,37 +624,70 @@ void __hook_io(struct lbz_device *dev, struct bio *bio, unsigned int blkid, int
 	bio->bi_bdev = dev->phy_bdev;
 }
 
+/*
+ * Whole range of read bio is resolved at once, every run of blocks contiguous
+ * on device and in one zone is split from head of user bio and chained to it,
+ * runs are issued in parallel and user bio ends after all of them. Run of
+ * unmapped blocks is zero filled without device IO. Runs inherit REQ_HIPRI of
+ * a polled read and go to poll queues of phy_bdev, see lbz_mq_poll.
+ */
 static void __submit_read_io(struct lbz_io_scheduler *iosched, struct bio *bio)
 {
 	struct lbz_device *dev = iosched->host;
+	struct lbz_zone_metadata *zmd = dev->zone_metadata;
 	unsigned int blkid = sector_to_blkid(bio->bi_iter.bi_sector), pbid = LBZ_INVALID_PBID;
-	struct lbz_zone *zone;
-	int ret = 0;
-
-	ret = lbz_mapping_lookup(dev->mapping, &zone, &pbid, blkid);
-	if (ret < 0) {
-		LBZINFO_LIMIT("bio: %lx, blkid: %u read zero", (unsigned long)bio, blkid);
-		bio_endio(bio);
-		atomic64_inc(&dev->user_read_zero_cnt);
-		return;
+	unsigned int nr, left;
+	struct bio *split;
+	int srcu_idx;
+
+	/*zones of pbids can't be reset until user bio completes.*/
+	srcu_idx = lbz_zone_read_lock(zmd);
+	__hook_io(dev, bio, blkid, READ, NULL);
+	((struct lbz_io_hook *)bio->bi_private)->srcu_idx = srcu_idx;
+	((struct lbz_io_hook *)bio->bi_private)->start_ns = ktime_get_ns();
+	if (bio->bi_opf & REQ_HIPRI) {
+		((struct lbz_io_hook *)bio->bi_private)->polled = true;
+		atomic64_inc(&dev->user_read_polled);
+		atomic64_inc(&dev->user_read_polled_inflight);
 	}
-
-	__hook_io(dev, bio, blkid, READ, zone);
-	bio->bi_iter.bi_sector = blkid_to_sector(pbid);
-	submit_bio(bio);
+	do {
+		left = bio_sectors(bio) >> LBZ_BLOCK_SECTORS_SHIFT;
+		nr = lbz_mapping_lookup_run(dev->mapping, &pbid, blkid, left);
+		if (pbid != LBZ_INVALID_PBID)
+			nr = min(nr, zmd->zone_size_blks - (pbid & (zmd->zone_size_blks - 1)));
+		if (nr < left) {
+			split = bio_split(bio, nr << LBZ_BLOCK_SECTORS_SHIFT, GFP_NOIO, &iosched->bio_split);
+			bio_chain(split, bio);
+		} else {
+			split = bio;
+		}
+		if (pbid == LBZ_INVALID_PBID) {
+			/*hole, never written or discarded.*/
+			zero_fill_bio(split);
+			atomic64_add(nr, &dev->user_read_zero_cnt);
+			bio_endio(split);
+		} else {
+			atomic64_inc(&dev->user_read_device_bios);
+			split->bi_iter.bi_sector = blkid_to_sector(pbid);
+			submit_bio(split);
+		}
+		blkid += nr;
+	} while (split != bio);
 }
 
 static void * __add_integrity(struct lbz_io_task *task, struct lbz_device *dev, enum lbz_log_type type)
 {
-	int len = dev->meta_bytes;
+	/*one log per block, write task is limited to one page of logs.*/
+	int len = sizeof(struct lbz_disk_log) * task->nr_blks;
 	struct bio *bio = task->bio;
 	unsigned int seed = sector_to_blkid(bio->bi_iter.bi_sector);
 	struct bio_integrity_payload *bip;
-	int ret = 0;
+	int ret = 0, i = 0;
 	void *buf;
 	struct lbz_disk_log *log;
+	long txid = 0;
 
-	LBZ_ALLOC_MEM(buf, len, GFP_NOIO);
+	buf = __alloc_integrity_buf(task->nr_blks);
 
 	bip = bio_integrity_alloc(bio, GFP_NOIO, 1);
 	if (IS_ERR(bip)) {
@@ -285,33 +704,38 @@ static void * __add_integrity(struct lbz_io_task *task, struct lbz_device *dev,
 		ret = -EINVAL;
 		goto out_free_integ;
 	}
-	log = (struct lbz_disk_log *)buf;
-	log->timestamp = lbz_dev_get_timestamp(dev);
 #ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
-	switch (task->type) {
-	case LBZ_TASK_WRITE_TX_FATHER:
-		log->txid = lbz_dev_get_tx_id(dev);
-		log->log_type = LBZ_LOG_TRANSACTION_FATHER;
-		break;
-	case LBZ_TASK_WRITE_TX_CHILD:
-		log->txid = lbz_dev_read_tx_id(dev);
-		log->log_type = LBZ_LOG_TRANSACTION_CHILD;
-		log->free_blkid = lbz_nat_sit_to_free(dev->nat_sit_mgmt, task->blkid);
+	if (task->type == LBZ_TASK_WRITE_TX_FATHER)
+		txid = lbz_dev_get_tx_id(dev);
+	else if (task->type == LBZ_TASK_WRITE_TX_CHILD)
+		txid = lbz_dev_read_tx_id(dev);
+#endif
+	for (; i < task->nr_blks; i++) {
+		log = (struct lbz_disk_log *)buf + i;
+		log->timestamp = lbz_dev_get_timestamp(dev);
+		log->txid = txid;
+		log->free_blkid = 0;
+#ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
+		switch (task->type) {
+		case LBZ_TASK_WRITE_TX_FATHER:
+			log->log_type = LBZ_LOG_TRANSACTION_FATHER;
+			break;
+		case LBZ_TASK_WRITE_TX_CHILD:
+			log->log_type = LBZ_LOG_TRANSACTION_CHILD;
+			log->free_blkid = lbz_nat_sit_to_free(dev->nat_sit_mgmt, task->blkid + i);
 #ifdef CONFIG_LBZ_NAT_SIT_FREE_SUPPORT
-		lbz_nat_sit_add_blkid(dev->nat_sit_mgmt, log->free_blkid);
+			lbz_nat_sit_add_blkid(dev->nat_sit_mgmt, log->free_blkid);
 #endif
-		break;
-	default:
-		log->txid = 0;
-		log->log_type = type;
-	}
+			break;
+		default:
+			log->log_type = type;
+		}
 #else
-	log->txid = 0;
-	log->free_blkid = 0;
-	log->log_type = type;
+		log->log_type = type;
 #endif
-	log->blkid = task->blkid;
-	log->crc = 0; /*TODO:*/
+		log->blkid = task->blkid + i;
+		log->crc = 0; /*TODO:*/
+	}
 	return buf;
 
 out_free_integ:
@@ -320,26 +744,64 @@ out_free_integ:
 	 * bio_integrity_free(bio);
 	 */
 out_free_meta:
-	LBZ_FREE_MEM(buf, len);
+	__free_integrity_buf(buf, task->nr_blks);
 	return ERR_PTR(ret);
 }
 
+
+/*
+ * Alloc may grant less blocks than task covers when active zone runs out, split
+ * the bio at the grant and hand the rest to a new task, which is returned.
+ */
+static struct lbz_io_task *__split_write_task(struct lbz_io_scheduler *iosched,
+		struct lbz_io_task *task, unsigned int nr_blks)
+{
+	struct lbz_device *dev = iosched->host;
+	struct lbz_io_task *rest;
+	struct bio *split;
+
+	split = bio_split(task->bio, nr_blks << LBZ_BLOCK_SECTORS_SHIFT, GFP_NOIO, &iosched->bio_split);
+	/*user endio of split is bio_chain_endio, __unhook_io will restore it.*/
+	bio_chain(split, task->bio);
+	rest = task_alloc(task->type, GFP_NOIO);
+	rest->bio = task->bio;
+	rest->ctx = task->ctx;
+	rest->sync = task->sync;
+	rest->status = LBZ_TASK_ALLOC_RES;
+	task->bio = split;
+	split_task_in_tree(iosched, task, rest, nr_blks);
+	atomic64_inc(&dev->user_write_inflight_io_cnt);
+#ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
+	if (rest->type != LBZ_TASK_USER_WRITE)
+		lbz_nat_sit_add_write(dev->nat_sit_mgmt);
+#endif
+	return rest;
+}
+
+/*sync write gets a bounded share of gc reserve, see LBZ_SYNC_RESERVE_SHARE.*/
+static inline enum lbz_alloc_flag __alloc_flag(struct lbz_io_task *task)
+{
+	if (task->pending_gc_node != NULL)
+		return LBZ_ALLOC_FLAG_GC;
+	return task->sync ? LBZ_ALLOC_FLAG_USER_SYNC : LBZ_ALLOC_FLAG_USER;
+}
+
 static int __submit_write_task(struct lbz_io_scheduler *iosched, struct lbz_io_task *task)
 {
 	struct lbz_device *dev = iosched->host;
 	struct lbz_zone *zone = NULL;
-	struct lbz_io_task *tk = NULL;
+	struct lbz_io_task *tk = NULL, *rest = NULL;
 	struct bio *bio = task->bio;
-	unsigned int blkid = sector_to_blkid(bio->bi_iter.bi_sector);
+	unsigned int blkid = task->blkid, nr_blks = task->nr_blks;
 	int ret = 0, stream_id = 0;
 
-	task->blkid = blkid;
 	switch (task->status) {
 	case LBZ_TASK_INIT:
 		tk = insert_task_to_tree(iosched, task);
 		if (tk != NULL) {
 			LBZDEBUG("write IO conflict with task : %d", tk->type);
-			ret = -EAGAIN;
+			/*chained task is dispatched by del_task_from_tree of tk.*/
+			ret = __can_chain(task, tk) ? -EINPROGRESS : -EAGAIN;
 			task_put(tk);
 			goto out;
 		}
@@ -348,8 +810,8 @@ static int __submit_write_task(struct lbz_io_scheduler *iosched, struct lbz_io_t
 		/*if have pending gc task, we can borrow one block from reserved_blks_gc in case dead lock.*/
 #ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
 		stream_id = lbz_nat_sit_get_stream_id(dev->nat_sit_mgmt, blkid);
-		ret = lbz_zone_alloc_res(dev->zone_metadata, &zone,
-				task->pending_gc_node == NULL ? LBZ_ALLOC_FLAG_USER : LBZ_ALLOC_FLAG_GC, stream_id);
+		ret = lbz_zone_alloc_res(dev->zone_metadata, &zone, &nr_blks,
+				__alloc_flag(task), stream_id);
 #ifdef CONFIG_LBZ_NAT_SIT_STREAM_SUPPORT
 		//if (ret < 0 && task->pending_gc_node != NULL) {
 		if (ret < 0) {
@@ -358,8 +820,9 @@ static int __submit_write_task(struct lbz_io_scheduler *iosched, struct lbz_io_t
 			LBZDEBUG("alloc res encounter: %d, stream_id: %d", ret, stream_id);
 			for (i = 0; i < LBZ_ZONE_MAX_STREAM; i++) {
 				if (i != stream_id) {
-					ret = lbz_zone_alloc_res(dev->zone_metadata, &zone,
-							task->pending_gc_node == NULL ? LBZ_ALLOC_FLAG_USER : LBZ_ALLOC_FLAG_GC, i);
+					nr_blks = task->nr_blks;
+					ret = lbz_zone_alloc_res(dev->zone_metadata, &zone, &nr_blks,
+							__alloc_flag(task), i);
 					if (0 == ret){
 						atomic64_inc(&dev->write_alloc_encounter_eagain);
 						break;
@@ -369,20 +832,26 @@ static int __submit_write_task(struct lbz_io_scheduler *iosched, struct lbz_io_t
 		}
 #endif
 #else
-		ret = lbz_zone_alloc_res(dev->zone_metadata, &zone,
-				task->pending_gc_node == NULL ? LBZ_ALLOC_FLAG_USER : LBZ_ALLOC_FLAG_GC, stream_id);
+		ret = lbz_zone_alloc_res(dev->zone_metadata, &zone, &nr_blks,
+				__alloc_flag(task), stream_id);
 #endif
 		if (ret < 0) {
 			LBZDEBUG("alloc res encounter: %d", ret);
 			if (ret != -EAGAIN) {
 				del_task_from_tree(iosched, task);
 				task_put(task); /*insert_task_to_tree*/
+			} else {
+				ret = -ENOSPC; /*wait for space, range is kept in tree.*/
 			}
 			lbz_trigger_gc_reclaim_emergency(dev->gc_ctx);
 			goto out;
 		}
 		if (lbz_check_need_reclaim_high(dev->zone_metadata))
 			lbz_trigger_gc_reclaim(dev->gc_ctx);
+		if (nr_blks < task->nr_blks) {
+			rest = __split_write_task(iosched, task, nr_blks);
+			bio = task->bio;
+		}
 		task->zone = zone;
 		__hook_io(dev, bio, blkid, WRITE, task);
 		bio->bi_iter.bi_sector = zone->start_sector;
@@ -398,58 +867,111 @@ static int __submit_write_task(struct lbz_io_scheduler *iosched, struct lbz_io_t
 			goto out;
 		}
 		task->status = LBZ_TASK_DISPATCH;
+		task->data_iter = bio->bi_iter;
+		smp_store_release(&task->servable, true);
 		break;
 	default:
 		BUG();
 	}
 	submit_bio(bio);
-	return 0;
 out:
+	/*rest keeps its range in task tree, it's dispatched no matter how task goes.*/
+	if (rest != NULL)
+		__handle_write_ret(iosched, rest, __submit_write_task(iosched, rest));
 	return ret;
 }
 
-void __retry_submit_io_task(struct lbz_io_scheduler *iosched)
+/*
+ * Task waits for space without trying alloc. It takes its range in task tree
+ * first like __submit_write_task does, so a later write of the range, even a
+ * sync one that waits in another class, chains behind it instead of landing
+ * on device before it.
+ */
+static int __hold_write_for_space(struct lbz_io_scheduler *iosched, struct lbz_io_task *task)
+{
+	struct lbz_io_task *tk = insert_task_to_tree(iosched, task);
+	int ret = -ENOSPC;
+
+	if (tk != NULL) {
+		ret = __can_chain(task, tk) ? -EINPROGRESS : -EAGAIN;
+		task_put(tk);
+		return ret;
+	}
+	task->status = LBZ_TASK_ALLOC_RES;
+	return ret;
+}
+
+/*
+ * -EINPROGRESS: chained behind in-flight write, task may be gone already.
+ * -EAGAIN: conflict with in-flight gc task, wait for retry.
+ * -ENOSPC: no space, wait until zone reset wakes it.
+ * others: complete bio with error, task will be destroy by lbz_write_io_endio when
+ * task->status > LBZ_TASK_ALLOC_RES.
+ */
+static void __handle_write_ret(struct lbz_io_scheduler *iosched, struct lbz_io_task *task, int ret)
 {
 	struct lbz_device *dev = iosched->host;
-	struct list_head task_list;
+	struct lbz_retry_ctx *ctx;
+	enum lbz_task_status status;
+
+	switch(ret) {
+	case 0:
+	case -EINPROGRESS:
+		break;
+	case -EAGAIN:
+		ctx = &iosched->retry_ctxs[task->ctx];
+		__add_task_to_retry(ctx, task);
+		trigger_ctx_retry_work(ctx, LBZ_IO_WRITE_DELAY);
+		break;
+	case -ENOSPC:
+		__add_task_to_space_wait(iosched, task);
+		break;
+	default:
+		task->bio->bi_status = BLK_STS_IOERR;
+		status = task->status; /*task may be freed after next statement.*/
+		bio_endio(task->bio);
+		if (status == LBZ_TASK_ALLOC_RES) {
+#ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
+			if (task->type != LBZ_TASK_USER_WRITE)
+				lbz_nat_sit_complete_write(dev->nat_sit_mgmt);
+#endif
+			task_put(task); /*__task_init*/
+			atomic64_dec(&dev->user_write_inflight_io_cnt);
+		}
+		atomic64_inc(&dev->user_write_err_cnt);
+		break;
+	}
+}
+
+void __retry_submit_io_task(struct lbz_retry_ctx *ctx)
+{
+	struct lbz_io_scheduler *iosched = ctx->iosched;
+	struct list_head task_list, nospc_list;
 	unsigned long flag = 0;
 	struct lbz_io_task *pos, *n;
-	enum lbz_task_status status;
 	int ret = 0;
 
 	INIT_LIST_HEAD(&task_list);
-	spin_lock_irqsave(&iosched->pending_lock, flag);
-	list_splice_init(&iosched->lbz_user_pending, &task_list);
-	iosched->pending_count = 0;
-	spin_unlock_irqrestore(&iosched->pending_lock, flag);
+	INIT_LIST_HEAD(&nospc_list);
+	spin_lock_irqsave(&ctx->pending_lock, flag);
+	/*sync writes go first.*/
+	list_splice_init(&ctx->lbz_user_sync_pending, &task_list);
+	list_splice_tail_init(&ctx->lbz_user_pending, &task_list);
+	ctx->pending_count = 0;
+	spin_unlock_irqrestore(&ctx->pending_lock, flag);
 
 	list_for_each_entry_safe(pos, n, &task_list, list) {
 		list_del_init(&pos->list);
 		ret = __submit_write_task(iosched, pos);
-		switch(ret) {
-		case 0:
-			break;
-		case -EAGAIN:
-			__add_task_to_retry(iosched, pos);
-			trigger_retry_work(iosched, LBZ_IO_WRITE_DELAY);
-			break;
-		default:
-			pos->bio->bi_status = BLK_STS_IOERR;
-			status = pos->status; /*pos may be freed after next statement.*/
-			bio_endio(pos->bio);
-			/*task will be destroy by lbz_write_io_endio when task->status > LBZ_TASK_ALLOC_RES.*/
-			if (status == LBZ_TASK_ALLOC_RES) {
-#ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
-				if (pos->type != LBZ_TASK_USER_WRITE)
-					lbz_nat_sit_complete_write(dev->nat_sit_mgmt);
-#endif
-				task_put(pos); /*__task_init*/
-				atomic64_dec(&dev->user_write_inflight_io_cnt);
-			}
-			atomic64_inc(&dev->user_write_err_cnt);
-			break;
+		/*woken waiters lost the race for space, keep their turn.*/
+		if (ret == -ENOSPC) {
+			list_add_tail(&pos->list, &nospc_list);
+			continue;
 		}
+		__handle_write_ret(iosched, pos, ret);
 	}
+	if (!list_empty(&nospc_list))
+		__requeue_space_waiters(iosched, &nospc_list);
 }
 
 /*
@@ -458,7 +980,6 @@ void __retry_submit_io_task(struct lbz_io_scheduler *iosched)
 static void __add_task_to_gc_writes(struct lbz_io_scheduler *iosched, struct lbz_io_task *task);
 void __retry_submit_gc_task(struct lbz_io_scheduler *iosched)
 {
-	struct lbz_device *dev = iosched->host;
 	struct list_head task_list;
 	unsigned long flag = 0;
 	struct lbz_io_task *pos, *n;
@@ -489,7 +1010,7 @@ void __retry_submit_gc_task(struct lbz_io_scheduler *iosched)
 			/*don't need to execute gc, just callback.*/
 			LBZDEBUG("gc write encounter: %d", ret);
 			__gc_task_callback(pos, LBZ_INVALID_PBID);
-			lbz_dec_gc_inflight(dev);
+			__gc_task_done(iosched);
 			break;
 		default:
 			BUG();
@@ -505,24 +1026,339 @@ static void retry_wk_fn(struct work_struct *work)
 	if (is_dev_faulty(dev) || !is_dev_ready(dev))
 		return;
 
-	__retry_submit_io_task(iosched);
 	__retry_submit_gc_task(iosched);
 	yield();
 }
 
+static void ctx_retry_wk_fn(struct work_struct *work)
+{
+	struct lbz_retry_ctx *ctx = container_of(to_delayed_work(work), struct lbz_retry_ctx, retry_wk);
+	struct lbz_device *dev = ctx->iosched->host;
+
+	if (is_dev_faulty(dev) || !is_dev_ready(dev))
+		return;
+
+	__retry_submit_io_task(ctx);
+	yield();
+}
+
 static void trigger_retry_work(struct lbz_io_scheduler *iosched, unsigned long delay)
 {
 	queue_delayed_work(iosched->retry_wq, &iosched->retry_wk, delay);
 }
 
-static void __add_task_to_retry(struct lbz_io_scheduler *iosched, struct lbz_io_task *task)
+static void trigger_ctx_retry_work(struct lbz_retry_ctx *ctx, unsigned long delay)
+{
+	queue_delayed_work(ctx->iosched->retry_wq, &ctx->retry_wk, delay);
+}
+
+static void __add_task_to_retry(struct lbz_retry_ctx *ctx, struct lbz_io_task *task)
+{
+	unsigned long flag = 0;
+
+	spin_lock_irqsave(&ctx->pending_lock, flag);
+	ctx->pending_count++;
+	list_add_tail(&task->list, task->sync ? &ctx->lbz_user_sync_pending : &ctx->lbz_user_pending);
+	spin_unlock_irqrestore(&ctx->pending_lock, flag);
+}
+
+/*
+ * Park task unless gc tasks pend on it, then it goes to retry and allocs with
+ * LBZ_ALLOC_FLAG_GC. pending_gc_node is checked under space_lock, and gc task
+ * linking onto a parked task kicks it under the same lock, see
+ * __kick_space_waiter, so either side sees the other. Return false if not parked.
+ */
+static bool __park_space_waiter(struct lbz_io_scheduler *iosched, struct lbz_io_task *task, bool head)
+{
+	if (READ_ONCE(task->pending_gc_node) != NULL)
+		return false;
+	iosched->space_wait_count++;
+	task->space_waiting = true;
+	if (task->sync) {
+		iosched->space_sync_wait_count++;
+		if (head)
+			list_move(&task->list, &iosched->lbz_space_sync_waiters);
+		else
+			list_add_tail(&task->list, &iosched->lbz_space_sync_waiters);
+	} else {
+		if (head)
+			list_move(&task->list, &iosched->lbz_space_waiters);
+		else
+			list_add_tail(&task->list, &iosched->lbz_space_waiters);
+	}
+	return true;
+}
+
+static void __unpark_space_waiter(struct lbz_io_scheduler *iosched, struct lbz_io_task *task)
+{
+	iosched->space_wait_count--;
+	if (task->sync)
+		iosched->space_sync_wait_count--;
+	task->space_waiting = false;
+}
+
+static void __retry_space_waiter(struct lbz_io_scheduler *iosched, struct lbz_io_task *task,
+		unsigned long delay)
+{
+	struct lbz_retry_ctx *ctx = &iosched->retry_ctxs[task->ctx];
+
+	__add_task_to_retry(ctx, task);
+	trigger_ctx_retry_work(ctx, delay);
+}
+
+/*
+ * Retry ctx work may already be queued without delay, so backoff has its own
+ * list and delayed work.
+ */
+static void __backoff_space_waiter(struct lbz_io_scheduler *iosched, struct lbz_io_task *task)
+{
+	unsigned long flag = 0;
+
+	spin_lock_irqsave(&iosched->space_lock, flag);
+	list_add_tail(&task->list, &iosched->space_gc_backoff);
+	spin_unlock_irqrestore(&iosched->space_lock, flag);
+	queue_delayed_work(iosched->retry_wq, &iosched->space_backoff_wk, LBZ_GC_WRITE_DELAY);
+}
+
+static void space_backoff_wk_fn(struct work_struct *work)
+{
+	struct lbz_io_scheduler *iosched = container_of(to_delayed_work(work),
+			struct lbz_io_scheduler, space_backoff_wk);
+	struct lbz_io_task *pos, *n;
+	struct list_head tasks;
+	unsigned long flag = 0;
+
+	INIT_LIST_HEAD(&tasks);
+	spin_lock_irqsave(&iosched->space_lock, flag);
+	list_splice_init(&iosched->space_gc_backoff, &tasks);
+	spin_unlock_irqrestore(&iosched->space_lock, flag);
+
+	list_for_each_entry_safe(pos, n, &tasks, list) {
+		list_del_init(&pos->list);
+		__retry_space_waiter(iosched, pos, 0);
+	}
+}
+
+static void __add_task_to_space_wait(struct lbz_io_scheduler *iosched, struct lbz_io_task *task)
+{
+	unsigned long flag = 0;
+	bool parked;
+
+	spin_lock_irqsave(&iosched->space_lock, flag);
+	parked = __park_space_waiter(iosched, task, false);
+	spin_unlock_irqrestore(&iosched->space_lock, flag);
+	if (!parked) {
+		/*gc reserve is short too, don't spin on it.*/
+		__backoff_space_waiter(iosched, task);
+		return;
+	}
+	/*zone may be reset between alloc and here.*/
+	lbz_iosched_wake_space_waiters(iosched);
+}
+
+static void __requeue_space_waiters(struct lbz_io_scheduler *iosched, struct list_head *tasks)
+{
+	struct lbz_io_task *pos, *n;
+	unsigned long flag = 0;
+
+	spin_lock_irqsave(&iosched->space_lock, flag);
+	/*backward, so they keep their order at head.*/
+	list_for_each_entry_safe_reverse(pos, n, tasks, list)
+		__park_space_waiter(iosched, pos, true);
+	spin_unlock_irqrestore(&iosched->space_lock, flag);
+
+	/*left ones have gc tasks pending on them.*/
+	list_for_each_entry_safe(pos, n, tasks, list) {
+		list_del_init(&pos->list);
+		__backoff_space_waiter(iosched, pos);
+	}
+}
+
+/*
+ * gc task just pended on tk, a parked tk would wait for the zone reset that
+ * waits for this gc task. Retry it now, it allocs from gc reserve.
+ */
+static void __kick_space_waiter(struct lbz_io_scheduler *iosched, struct lbz_io_task *tk)
+{
+	unsigned long flag = 0;
+	bool kicked = false;
+
+	spin_lock_irqsave(&iosched->space_lock, flag);
+	if (tk->space_waiting) {
+		list_del_init(&tk->list);
+		__unpark_space_waiter(iosched, tk);
+		kicked = true;
+	}
+	spin_unlock_irqrestore(&iosched->space_lock, flag);
+	if (kicked) {
+		__retry_space_waiter(iosched, tk, 0);
+		atomic64_inc(&iosched->space_gc_kicks);
+	}
+}
+
+/*
+ * Wake space waiters in FIFO order as long as blocks above gc reserve can
+ * cover them, woken ones are retried by their retry ctx. Alloc may grant less
+ * than a waiter wants and split it, so a waiter costs at least one block.
+ * Sync waiters are woken first and may also use reserved_blks_sync.
+ * Called after zone reset, and by retry timer in case wakeup is missed.
+ */
+void lbz_iosched_wake_space_waiters(struct lbz_io_scheduler *iosched)
 {
+	struct lbz_device *dev = iosched->host;
+	struct lbz_zone_metadata *zmd = dev->zone_metadata;
+	long avail = (long)atomic64_read(&zmd->nr_allocable_blks) - zmd->reserved_blks_gc;
+	long sync_avail = avail + zmd->reserved_blks_sync;
+	struct lbz_io_task *pos, *n;
+	struct list_head woken;
 	unsigned long flag = 0;
 
-	spin_lock_irqsave(&iosched->pending_lock, flag);
-	iosched->pending_count++;
-	list_add_tail(&task->list, &iosched->lbz_user_pending);
-	spin_unlock_irqrestore(&iosched->pending_lock, flag);
+	if (sync_avail <= 0 || READ_ONCE(iosched->space_wait_count) == 0)
+		return;
+
+	INIT_LIST_HEAD(&woken);
+	spin_lock_irqsave(&iosched->space_lock, flag);
+	while (sync_avail > 0 && !list_empty(&iosched->lbz_space_sync_waiters)) {
+		pos = list_first_entry(&iosched->lbz_space_sync_waiters, struct lbz_io_task, list);
+		list_move_tail(&pos->list, &woken);
+		__unpark_space_waiter(iosched, pos);
+		sync_avail -= pos->nr_blks;
+		avail -= pos->nr_blks;
+	}
+	while (avail > 0 && !list_empty(&iosched->lbz_space_waiters)) {
+		pos = list_first_entry(&iosched->lbz_space_waiters, struct lbz_io_task, list);
+		list_move_tail(&pos->list, &woken);
+		__unpark_space_waiter(iosched, pos);
+		avail -= pos->nr_blks;
+	}
+	spin_unlock_irqrestore(&iosched->space_lock, flag);
+
+	list_for_each_entry_safe(pos, n, &woken, list) {
+		list_del_init(&pos->list);
+		__retry_space_waiter(iosched, pos, 0);
+		atomic64_inc(&iosched->space_wakeups);
+	}
+}
+
+/*
+ * return false if task is parked for credits, it will be retried by its retry
+ * ctx when throttle timer refills. Sync write is never parked, but it spends
+ * credits, so async writes absorb the throttling.
+ */
+static bool __throttle_admit(struct lbz_io_scheduler *iosched, struct lbz_io_task *task)
+{
+	struct lbz_throttle *tr = &iosched->throttle;
+	unsigned long flag = 0;
+	bool admit = true;
+
+	/*racing writers may both arm it, mod_timer keeps one.*/
+	if (!timer_pending(&tr->timer))
+		mod_timer(&tr->timer, jiffies + LBZ_THROTTLE_PERIOD);
+	if (!READ_ONCE(tr->active))
+		return true;
+	spin_lock_irqsave(&tr->lock, flag);
+	if (tr->active) {
+		if (task->sync || (tr->wait_count == 0 && tr->credits > 0)) {
+			tr->credits -= task->nr_blks;
+		} else {
+			list_add_tail(&task->list, &tr->waiters);
+			tr->wait_count++;
+			admit = false;
+		}
+	}
+	spin_unlock_irqrestore(&tr->lock, flag);
+	if (!admit)
+		atomic64_inc(&tr->throttled_writes);
+	return admit;
+}
+
+static void __throttle_timer_fn(struct timer_list *timer)
+{
+	struct lbz_throttle *tr = container_of(timer, struct lbz_throttle, timer);
+	struct lbz_io_scheduler *iosched = container_of(tr, struct lbz_io_scheduler, throttle);
+	struct lbz_device *dev = iosched->host;
+	struct lbz_zone_metadata *zmd = dev->zone_metadata;
+	long total = atomic64_read(&zmd->nr_total_blks);
+	long free = (long)atomic64_read(&zmd->nr_allocable_blks) - zmd->reserved_blks_gc;
+	long low = total * zmd->reclaim_wm_gc_low / 100;
+	long high = total * zmd->reclaim_wm_gc_high / 100;
+	long reclaimed, refill, periods;
+	struct lbz_io_task *pos, *n;
+	struct lbz_retry_ctx *ctx;
+	struct list_head woken;
+	unsigned long flag = 0;
+	bool rearm;
+
+	/*reclaim while timer was stopped is spread over the periods it missed.*/
+	periods = max_t(long, (jiffies - tr->last_jiffies) / LBZ_THROTTLE_PERIOD, 1);
+	tr->last_jiffies = jiffies;
+	reclaimed = (long)READ_ONCE(zmd->zs_reset_times) * zmd->zone_nr_blocks -
+		atomic64_read(&dev->gc_write_blocks);
+	tr->reclaim_rate = (tr->reclaim_rate * 7 + max(reclaimed - tr->last_reclaimed, 0L) / periods) / 8;
+	tr->last_reclaimed = reclaimed;
+	refill = tr->reclaim_rate + max(free - low, 0L) / LBZ_THROTTLE_DRAIN_PERIODS;
+	refill = max_t(long, refill, LBZ_THROTTLE_MIN_CREDITS);
+
+	INIT_LIST_HEAD(&woken);
+	spin_lock_irqsave(&tr->lock, flag);
+	if (free >= high) {
+		tr->active = false;
+		tr->credits = 0;
+	} else {
+		tr->active = true;
+		/*unused credits are not saved up for a burst.*/
+		tr->credits = min(tr->credits, 0L) + refill;
+	}
+	while (!list_empty(&tr->waiters) && (!tr->active || tr->credits > 0)) {
+		pos = list_first_entry(&tr->waiters, struct lbz_io_task, list);
+		list_move_tail(&pos->list, &woken);
+		tr->wait_count--;
+		if (tr->active)
+			tr->credits -= pos->nr_blks;
+	}
+	rearm = tr->active || tr->wait_count > 0;
+	spin_unlock_irqrestore(&tr->lock, flag);
+
+	list_for_each_entry_safe(pos, n, &woken, list) {
+		list_del_init(&pos->list);
+		ctx = &iosched->retry_ctxs[pos->ctx];
+		__add_task_to_retry(ctx, pos);
+		trigger_ctx_retry_work(ctx, 0);
+	}
+	/*next user write arms it again.*/
+	if (rearm || atomic64_read(&dev->user_write_inflight_io_cnt) > 0)
+		mod_timer(&tr->timer, jiffies + LBZ_THROTTLE_PERIOD);
+}
+
+static void __init_throttle(struct lbz_throttle *tr)
+{
+	spin_lock_init(&tr->lock);
+	tr->active = false;
+	tr->credits = 0;
+	tr->wait_count = 0;
+	INIT_LIST_HEAD(&tr->waiters);
+	tr->last_reclaimed = 0;
+	tr->reclaim_rate = 0;
+	tr->last_jiffies = jiffies;
+	atomic64_set(&tr->throttled_writes, 0);
+	timer_setup(&tr->timer, __throttle_timer_fn, 0);
+}
+
+/*commit and fsync writes, they go first in alloc, retry and space wait.*/
+static bool __is_sync_write(struct bio *bio)
+{
+	return op_is_sync(bio->bi_opf) || IOPRIO_PRIO_CLASS(bio_prio(bio)) == IOPRIO_CLASS_RT;
+}
+
+/*
+ * hctx of blk-mq is mapped by cpu, so does retry ctx. Cpu is only a hint to
+ * spread writes over ctxs: id is kept in task and used long after this cpu
+ * may be left, and every ctx has its own lock and work that runs on any cpu.
+ * A stale cpu after preemption only picks another ctx, so no get_cpu here.
+ */
+static unsigned int __retry_ctx_id(struct lbz_io_scheduler *iosched)
+{
+	return raw_smp_processor_id() % iosched->nr_retry_ctxs;
 }
 
 static void __add_task_to_gc_writes(struct lbz_io_scheduler *iosched, struct lbz_io_task *task)
@@ -535,19 +1371,18 @@ static void __add_task_to_gc_writes(struct lbz_io_scheduler *iosched, struct lbz
 	spin_unlock_irqrestore(&iosched->gc_write_lock, flag);
 }
 
-int lbz_submit_io_to_iosched(struct lbz_io_scheduler *iosched, struct bio *bio)
+/*submit bio bypassing write buffer.*/
+int lbz_submit_io_to_iosched_direct(struct lbz_io_scheduler *iosched, struct bio *bio)
 {
 	struct lbz_device *dev = iosched->host;
 	struct lbz_io_task *task;
 	enum lbz_task_type type = LBZ_TASK_USER_WRITE;
-	enum lbz_task_status status;
 #ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
 	unsigned int blkid = sector_to_blkid(bio->bi_iter.bi_sector);
 #endif
 	int ret = 0;
 
 	if (bio_data_dir(bio) == WRITE) {
-		atomic64_inc(&dev->user_write_blocks);
 		atomic64_inc(&dev->user_write_inflight_io_cnt);
 #ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
 		if (lbz_nat_sit_is_cp_block(dev->nat_sit_mgmt, blkid)) {
@@ -566,43 +1401,130 @@ int lbz_submit_io_to_iosched(struct lbz_io_scheduler *iosched, struct bio *bio)
 #endif
 		task = task_alloc(type, GFP_NOIO);
 		task->bio = bio;
+		task->ctx = __retry_ctx_id(iosched);
+		task->sync = __is_sync_write(bio);
+		if (task->sync)
+			atomic64_inc(&iosched->sync_writes);
+		task->blkid = sector_to_blkid(bio->bi_iter.bi_sector);
+		task->nr_blks = bio_sectors(bio) >> LBZ_BLOCK_SECTORS_SHIFT;
+		atomic64_add(task->nr_blks, &dev->user_write_blocks);
+		if (!__throttle_admit(iosched, task))
+			return 0;
 		/*
 		* bio->bi_opf &= ~REQ_PREFLUSH;
 		* bio->bi_opf &= ~REQ_FUA;
 		* bio->bi_opf &= ~REQ_SYNC;
 		*/
-		ret = __submit_write_task(iosched, task);
-		switch(ret) {
-		case 0:
-			break;
-		case -EAGAIN:
+		/*queue behind earlier waiters of the same class, don't jump their turn for space.*/
+		if (READ_ONCE(task->sync ? iosched->space_sync_wait_count : iosched->space_wait_count) > 0)
+			ret = __hold_write_for_space(iosched, task);
+		else
+			ret = __submit_write_task(iosched, task);
+		if (ret == -ENOSPC)
 			atomic64_inc(&dev->user_encounter_emergency);
-			__add_task_to_retry(iosched, task);
-			trigger_retry_work(iosched, LBZ_IO_WRITE_DELAY);
-			break;
-		default:
-			status = task->status;
-			bio->bi_status = BLK_STS_IOERR;
-			bio_endio(bio);
-			/*task will be destroy by lbz_write_io_endio when task->status > LBZ_TASK_ALLOC_RES.*/
-			if (task->status == LBZ_TASK_ALLOC_RES) {
-#ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
-				if (task->type != LBZ_TASK_USER_WRITE)
-					lbz_nat_sit_complete_write(dev->nat_sit_mgmt);
-#endif
-				task_put(task); /*__task_init*/
-				atomic64_dec(&dev->user_write_inflight_io_cnt);
-			}
-			atomic64_inc(&dev->user_write_err_cnt);
-			break;
-		}
+		__handle_write_ret(iosched, task, ret);
 	} else {
-		atomic64_inc(&dev->user_read_blocks);
+		atomic64_add(bio_sectors(bio) >> LBZ_BLOCK_SECTORS_SHIFT, &dev->user_read_blocks);
+		if (__read_from_tasks(iosched, bio))
+			return 0;
+#ifdef CONFIG_LBZ_READAHEAD_SUPPORT
+		if (lbz_ra_handle_read(dev->ra, bio))
+			return 0;
+#endif
+#ifdef CONFIG_LBZ_READ_CACHE_SUPPORT
+		if (lbz_rc_handle_read(dev->rc, bio))
+			return 0;
+#endif
 		__submit_read_io(iosched, bio);
 	}
 	return 0;
 }
 
+int lbz_submit_io_to_iosched(struct lbz_io_scheduler *iosched, struct bio *bio)
+{
+#ifdef CONFIG_LBZ_WRITE_BUFFER_SUPPORT
+	struct lbz_device *dev = iosched->host;
+
+	if (lbz_wb_handle_bio(dev->wb, bio))
+		return 0;
+#endif
+	return lbz_submit_io_to_iosched_direct(iosched, bio);
+}
+
+static inline bool __gc_urgent(struct lbz_device *dev)
+{
+	return lbz_check_need_reclaim_low(dev->zone_metadata) ||
+		test_bit(LBZ_GC_STAT_EMERGENCY, &dev->gc_ctx->gc_state);
+}
+
+static inline unsigned short __gc_ioprio(struct lbz_device *dev)
+{
+	return __gc_urgent(dev) ? LBZ_GC_URGENT_IOPRIO : LBZ_GC_IOPRIO;
+}
+
+/*cap of gc tasks, lowered while user reads miss latency target.*/
+static unsigned int __gc_cap(struct lbz_io_scheduler *iosched, bool *yield)
+{
+	struct lbz_device *dev = iosched->host;
+	struct lbz_gc_limit *gl = &iosched->gc_limit;
+	unsigned int cap = READ_ONCE(gl->max_inflight), target = READ_ONCE(gl->lat_target_us);
+
+	*yield = false;
+	if (target == 0 || cap <= LBZ_GC_YIELD_INFLIGHT || __gc_urgent(dev))
+		return cap;
+	if (atomic64_read(&dev->user_read_inflight_io_cnt) > 0 &&
+			READ_ONCE(gl->read_lat_ns) > (u64)target * NSEC_PER_USEC) {
+		*yield = true;
+		return LBZ_GC_YIELD_INFLIGHT;
+	}
+	return cap;
+}
+
+static bool __gc_slot_free(struct lbz_io_scheduler *iosched, bool *yield)
+{
+	struct lbz_device *dev = iosched->host;
+
+	return atomic64_read(&dev->gc_inflight_io_cnt) < __gc_cap(iosched, yield);
+}
+
+/*called by gc thread before it submits a gc task, may sleep.*/
+void lbz_iosched_gc_wait_slot(struct lbz_io_scheduler *iosched)
+{
+	struct lbz_gc_limit *gl = &iosched->gc_limit;
+	bool yield = false;
+
+	if (__gc_slot_free(iosched, &yield))
+		return;
+	atomic64_inc(&gl->waits);
+	if (yield)
+		atomic64_inc(&gl->yields);
+	while (!wait_event_timeout(gl->wait, __gc_slot_free(iosched, &yield), LBZ_GC_YIELD_RECHECK))
+		;
+}
+
+void lbz_iosched_set_gc_limit(struct lbz_io_scheduler *iosched, unsigned int max_inflight,
+		unsigned int lat_target_us)
+{
+	struct lbz_gc_limit *gl = &iosched->gc_limit;
+
+	WRITE_ONCE(gl->max_inflight, max(max_inflight, 1U));
+	WRITE_ONCE(gl->lat_target_us, lat_target_us);
+	wake_up(&gl->wait);
+	LBZINFO("gc max_inflight: %u, read latency target: %uus", gl->max_inflight, lat_target_us);
+}
+
+static void __init_gc_limit(struct lbz_gc_limit *gl)
+{
+	init_waitqueue_head(&gl->wait);
+	gl->max_inflight = LBZ_GC_DEFAULT_INFLIGHT;
+	gl->lat_target_us = LBZ_GC_DEFAULT_LAT_TARGET_US;
+	gl->read_lat_ns = 0;
+	atomic_set(&gl->reading, 0);
+	atomic_set(&gl->writing, 0);
+	atomic64_set(&gl->waits, 0);
+	atomic64_set(&gl->yields, 0);
+}
+
 /*
  * gc task callback handler.
  * consider task error for gc context, focus on dev faulty for pending_gc_node context.
@@ -654,6 +1576,7 @@ static void lbz_gc_read_endio(struct bio *bio)
 	struct lbz_device *dev = iosched->host;
 	int errno = blk_status_to_errno(bio->bi_status);
 
+	atomic_dec(&iosched->gc_limit.reading);
 	if (errno == 0) {
 		/*before task->read_zone are valid.*/
 		INIT_LIST_HEAD(&task->list);
@@ -664,7 +1587,7 @@ static void lbz_gc_read_endio(struct bio *bio)
 		task->error = errno;
 		__gc_task_callback(task, LBZ_INVALID_PBID);
 		lbz_inc_gc_read_err(dev);
-		lbz_dec_gc_inflight(dev);
+		__gc_task_done(iosched);
 		LBZERR("gc write IO encounter error: %d", errno);
 		lbz_dev_set_faulty(dev);
 	}
@@ -685,6 +1608,7 @@ struct bio *__init_gc_read_block(struct lbz_io_task *task, struct lbz_device *de
 	bio->bi_iter.bi_sector = blkid_to_sector(task->pbid); /*read pbid.*/
 	bio->bi_opf |= REQ_OP_READ;
 	bio->bi_end_io = lbz_gc_read_endio;
+	bio_set_prio(bio, __gc_ioprio(dev));
 
 	page = alloc_pages(GFP_NOIO, 0);
 	task->page = page;
@@ -695,11 +1619,10 @@ struct bio *__init_gc_read_block(struct lbz_io_task *task, struct lbz_device *de
 	return bio;
 }
 
-static void lbz_gc_write_endio(struct bio *bio)
+static void __complete_gc_write_task(struct lbz_io_task *task)
 {
-	struct lbz_io_task *task = bio->bi_private;
-	sector_t ret_sec = bio->bi_iter.bi_sector;
-	unsigned int pbid = sector_to_blkid(ret_sec);
+	struct bio *bio = task->bio;
+	unsigned int pbid = sector_to_blkid(bio->bi_iter.bi_sector);
 	int errno = blk_status_to_errno(bio->bi_status);
 	struct lbz_io_scheduler *iosched = task->iosched;
 	struct lbz_device *dev = iosched->host;
@@ -713,7 +1636,27 @@ static void lbz_gc_write_endio(struct bio *bio)
 		LBZERR("gc write IO encounter error: %d", errno);
 		lbz_dev_set_faulty(dev);
 	}
-	lbz_dec_gc_inflight(dev);
+	__gc_task_done(iosched);
+}
+
+static void lbz_gc_write_endio(struct bio *bio)
+{
+	struct lbz_io_task *task = bio->bi_private;
+	struct lbz_io_scheduler *iosched = task->iosched;
+#ifdef CONFIG_LBZ_EXTENT_MAPPING_SUPPORT
+	struct lbz_completion_ctx *cctx;
+#endif
+
+	atomic_dec(&iosched->gc_limit.writing);
+#ifdef CONFIG_LBZ_EXTENT_MAPPING_SUPPORT
+	/*remap may allocate extents, finish it in completion ctx as user writes.*/
+	cctx = get_cpu_ptr(iosched->cpl_ctxs);
+	if (llist_add(&task->cnode, &cctx->tasks))
+		queue_work_on(smp_processor_id(), iosched->cpl_wq, &cctx->work);
+	put_cpu_ptr(iosched->cpl_ctxs);
+#else
+	__complete_gc_write_task(task);
+#endif
 }
 
 struct bio *__init_gc_write_block(struct lbz_io_task *task, struct lbz_device *dev)
@@ -728,6 +1671,7 @@ struct bio *__init_gc_write_block(struct lbz_io_task *task, struct lbz_device *d
 	bio->bi_iter.bi_sector = task->zone->start_sector; /*must be assigned because of bio_add_page.*/
 	bio->bi_opf |= REQ_OP_WRITE;
 	bio->bi_end_io = lbz_gc_write_endio;
+	bio_set_prio(bio, __gc_ioprio(dev));
 
 	ret = bio_add_page(bio, task->page, PAGE_SIZE, 0);
 	BUG_ON(bio->bi_vcnt != 1);
@@ -741,7 +1685,7 @@ static int __submit_gc_task(struct lbz_io_scheduler *iosched, struct lbz_io_task
 	struct lbz_io_task *tk = NULL;
 	struct lbz_zone *zone;
 	int ret = 0, stream_id = 0;
-	unsigned int origin_pbid = 0;
+	unsigned int origin_pbid = 0, nr_blks = 1;
 	struct bio *read_bio = NULL, *write_bio = NULL;
 
 	switch (task->status) {
@@ -751,6 +1695,7 @@ static int __submit_gc_task(struct lbz_io_scheduler *iosched, struct lbz_io_task
 		task->iosched = iosched;
 		task->bio = read_bio;
 		atomic64_inc(&dev->gc_read_blocks);
+		atomic_inc(&iosched->gc_limit.reading);
 		submit_bio(read_bio);
 		goto read_out;
 	case LBZ_TASK_GC_READING:
@@ -762,14 +1707,14 @@ static int __submit_gc_task(struct lbz_io_scheduler *iosched, struct lbz_io_task
 		if (tk != NULL) {
 			LBZDEBUG("write IO conflict with task : %d", tk->type);
 			atomic64_inc(&dev->gc_write_agency_blocks);
-			task->error = ret = -ENOENT;
-			tk->pending_gc_node = task;
+			task->error = ret = -ENOENT; /*linked to tk->pending_gc_node by insert_task_to_tree.*/
+			__kick_space_waiter(iosched, tk);
 			smp_mb__before_atomic();
 			task_put(tk);
 			smp_mb__after_atomic();
 			goto pending_out;
 		}
-		ret = lbz_mapping_lookup(dev->mapping, &zone, &origin_pbid, task->blkid);
+		ret = lbz_mapping_lookup(dev->mapping, &origin_pbid, task->blkid);
 		/*support internal discard operation.*/
 		if (ret == -ENOENT) {
 			atomic64_inc(&dev->gc_write_discarded_blocks);
@@ -780,7 +1725,6 @@ static int __submit_gc_task(struct lbz_io_scheduler *iosched, struct lbz_io_task
 			task_put(task); /*insert_task_to_tree exec task_get.*/
 			goto discarded;
 		}
-		lbz_put_zone(zone); /*lookup will inc zone, but it's not necessary for gc.*/
 		if (origin_pbid != task->pbid) {
 			atomic64_inc(&dev->gc_write_complete_blocks);
 			task->error = ret = -EEXIST; /*already rewrite.*/
@@ -790,11 +1734,13 @@ static int __submit_gc_task(struct lbz_io_scheduler *iosched, struct lbz_io_task
 			task_put(task); /*insert_task_to_tree exec task_get.*/
 			goto skip_gc;
 		}
+		/*page holds current data of blkid until task leaves tree.*/
+		smp_store_release(&task->servable, true);
 		task->status = LBZ_TASK_ALLOC_RES;
 	case LBZ_TASK_ALLOC_RES:
 #ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
 		stream_id = lbz_nat_sit_get_stream_id(dev->nat_sit_mgmt, task->blkid);
-		ret = lbz_zone_alloc_res(dev->zone_metadata, &zone, LBZ_ALLOC_FLAG_GC, stream_id);
+		ret = lbz_zone_alloc_res(dev->zone_metadata, &zone, &nr_blks, LBZ_ALLOC_FLAG_GC, stream_id);
 #ifdef CONFIG_LBZ_NAT_SIT_STREAM_SUPPORT
 		if (ret < 0) {
 			int i = 0;
@@ -802,7 +1748,7 @@ static int __submit_gc_task(struct lbz_io_scheduler *iosched, struct lbz_io_task
 			LBZDEBUG("alloc res encounter: %d, stream_id: %d", ret, stream_id);
 			for (i = 0; i < LBZ_ZONE_MAX_STREAM; i++) {
 				if (i != stream_id) {
-					ret = lbz_zone_alloc_res(dev->zone_metadata, &zone, LBZ_ALLOC_FLAG_GC, i);
+					ret = lbz_zone_alloc_res(dev->zone_metadata, &zone, &nr_blks, LBZ_ALLOC_FLAG_GC, i);
 					if (0 == ret) {
 						atomic64_inc(&dev->gc_alloc_encounter_eagain);
 						break;
@@ -812,7 +1758,7 @@ static int __submit_gc_task(struct lbz_io_scheduler *iosched, struct lbz_io_task
 		}
 #endif
 #else
-		ret = lbz_zone_alloc_res(dev->zone_metadata, &zone, LBZ_ALLOC_FLAG_GC, stream_id);
+		ret = lbz_zone_alloc_res(dev->zone_metadata, &zone, &nr_blks, LBZ_ALLOC_FLAG_GC, stream_id);
 #endif
 		if (ret < 0) {
 			BUG_ON(ret == -EAGAIN); /*gc write may encounter -EAGAIN for more stream.*/
@@ -842,6 +1788,7 @@ static int __submit_gc_task(struct lbz_io_scheduler *iosched, struct lbz_io_task
 		BUG();
 	}
 	atomic64_inc(&dev->gc_write_blocks);
+	atomic_inc(&iosched->gc_limit.writing);
 	submit_bio(write_bio);
 	return 0;
 add_meta_err:
@@ -873,53 +1820,248 @@ int lbz_submit_gc_to_iosched(struct lbz_io_scheduler *iosched, struct lbz_zone *
 
 void lbz_iosched_proc_read(struct lbz_io_scheduler *iosched, struct seq_file *seq)
 {
+	struct lbz_device *dev = iosched->host;
+	struct lbz_gc_limit *gl = &iosched->gc_limit;
+	int pending_count = 0, i = 0;
+
+	for (; i < iosched->nr_retry_ctxs; i++)
+		pending_count += READ_ONCE(iosched->retry_ctxs[i].pending_count);
 	seq_printf(seq, "pending_count: %d\n"
+					"retry_ctxs: %u\n"
+					"space_wait_count: %d\n"
+					"space_sync_wait_count: %d\n"
+					"space_wakeups: %lld\n"
+					"space_gc_kicks: %lld\n"
+					"chained_writes: %lld\n"
+					"sync_writes: %lld\n"
+					"write_served_reads: %lld\n"
+					"gc_served_reads: %lld\n"
+					"completion_batches: %lld\n"
+					"completion_tasks: %lld\n"
+					"throttle_active: %d\n"
+					"throttle_credits: %ld\n"
+					"throttle_wait_count: %d\n"
+					"throttled_writes: %lld\n"
+					"gc_reclaim_rate: %ld blks/%ums\n"
 					"gc_write_count: %d\n"
-					"task_count: %lld\n",
-					iosched->pending_count,
+					"task_count: %lu\n"
+					"depth_user_read: %lld\n"
+					"depth_user_write: %lld\n"
+					"depth_gc_read: %d\n"
+					"depth_gc_write: %d\n"
+					"gc_max_inflight: %u\n"
+					"gc_read_lat_target: %uus\n"
+					"read_lat_ewma: %lluus\n"
+					"gc_slot_waits: %lld\n"
+					"gc_read_yields: %lld\n",
+					pending_count,
+					iosched->nr_retry_ctxs,
+					iosched->space_wait_count,
+					iosched->space_sync_wait_count,
+					atomic64_read(&iosched->space_wakeups),
+					atomic64_read(&iosched->space_gc_kicks),
+					atomic64_read(&iosched->chained_writes),
+					atomic64_read(&iosched->sync_writes),
+					atomic64_read(&iosched->write_served_reads),
+					atomic64_read(&iosched->gc_served_reads),
+					atomic64_read(&iosched->cpl_batches),
+					atomic64_read(&iosched->cpl_tasks),
+					iosched->throttle.active,
+					iosched->throttle.credits,
+					iosched->throttle.wait_count,
+					atomic64_read(&iosched->throttle.throttled_writes),
+					iosched->throttle.reclaim_rate, jiffies_to_msecs(LBZ_THROTTLE_PERIOD),
 					iosched->gc_write_count,
-					atomic64_read(&iosched->task_count));
+					__task_count(iosched),
+					atomic64_read(&dev->user_read_inflight_io_cnt),
+					atomic64_read(&dev->user_write_inflight_io_cnt),
+					atomic_read(&gl->reading),
+					atomic_read(&gl->writing),
+					gl->max_inflight,
+					gl->lat_target_us,
+					READ_ONCE(gl->read_lat_ns) / NSEC_PER_USEC,
+					atomic64_read(&gl->waits),
+					atomic64_read(&gl->yields));
 }
 
 static void __retry_timer_fn(struct timer_list *timer)
 {
 	struct lbz_io_scheduler *iosched = container_of(timer, struct lbz_io_scheduler, retry_timer);
+	int i = 0;
 
+	for (; i < iosched->nr_retry_ctxs; i++)
+		trigger_ctx_retry_work(&iosched->retry_ctxs[i], 0);
+	lbz_iosched_wake_space_waiters(iosched);
 	queue_delayed_work(iosched->retry_wq, &iosched->retry_wk, 0);
 	mod_timer(&iosched->retry_timer, jiffies + iosched->retry_expire);
 }
 
+static int __init_retry_ctxs(struct lbz_io_scheduler *iosched, struct lbz_device *dev)
+{
+	struct lbz_retry_ctx *ctx;
+	int i = 0;
+
+#ifdef CONFIG_LBZ_BLK_MQ_SUPPORT
+	iosched->nr_retry_ctxs = dev->tag_set.nr_hw_queues;
+#else
+	iosched->nr_retry_ctxs = 1;
+#endif
+	LBZ_ALLOC_MEM(iosched->retry_ctxs, sizeof(struct lbz_retry_ctx) * iosched->nr_retry_ctxs, GFP_KERNEL);
+	if (!iosched->retry_ctxs)
+		return -ENOMEM;
+	for (; i < iosched->nr_retry_ctxs; i++) {
+		ctx = &iosched->retry_ctxs[i];
+		spin_lock_init(&ctx->pending_lock);
+		ctx->pending_count = 0;
+		INIT_LIST_HEAD(&ctx->lbz_user_sync_pending);
+		INIT_LIST_HEAD(&ctx->lbz_user_pending);
+		INIT_DELAYED_WORK(&ctx->retry_wk, ctx_retry_wk_fn);
+		ctx->iosched = iosched;
+	}
+	return 0;
+}
+
+static int __init_cpl_ctxs(struct lbz_io_scheduler *iosched, struct lbz_device *dev)
+{
+	struct lbz_completion_ctx *cctx;
+	int cpu;
+
+	iosched->cpl_ctxs = alloc_percpu(struct lbz_completion_ctx);
+	if (!iosched->cpl_ctxs)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		cctx = per_cpu_ptr(iosched->cpl_ctxs, cpu);
+		init_llist_head(&cctx->tasks);
+		INIT_WORK(&cctx->work, cpl_wk_fn);
+		cctx->iosched = iosched;
+	}
+	/*bound, work runs on cpu where write completes.*/
+	iosched->cpl_wq = alloc_workqueue("%s_cpl", WQ_MEM_RECLAIM | WQ_HIGHPRI, 0, dev->devname);
+	if (!iosched->cpl_wq) {
+		free_percpu(iosched->cpl_ctxs);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
 int lbz_iosched_init(struct lbz_io_scheduler *iosched, struct lbz_device *dev)
 {
-	iosched->task_tree.rb_node = NULL;
-	rwlock_init(&iosched->task_lock);
-	atomic64_set(&iosched->task_count, 0);
-	spin_lock_init(&iosched->pending_lock);
-	iosched->pending_count = 0;
-	INIT_LIST_HEAD(&iosched->lbz_user_pending);
+	int ret = 0, i = 0;
+
+	for (; i < LBZ_TASK_SHARDS; i++) {
+		iosched->task_shards[i].task_tree = RB_ROOT;
+		spin_lock_init(&iosched->task_shards[i].task_lock);
+		iosched->task_shards[i].task_count = 0;
+	}
+	spin_lock_init(&iosched->space_lock);
+	iosched->space_wait_count = 0;
+	iosched->space_sync_wait_count = 0;
+	INIT_LIST_HEAD(&iosched->lbz_space_sync_waiters);
+	INIT_LIST_HEAD(&iosched->lbz_space_waiters);
+	INIT_LIST_HEAD(&iosched->space_gc_backoff);
+	atomic64_set(&iosched->space_wakeups, 0);
+	atomic64_set(&iosched->space_gc_kicks, 0);
+	atomic64_set(&iosched->chained_writes, 0);
+	atomic64_set(&iosched->sync_writes, 0);
+	atomic64_set(&iosched->write_served_reads, 0);
+	atomic64_set(&iosched->gc_served_reads, 0);
+	atomic64_set(&iosched->cpl_batches, 0);
+	atomic64_set(&iosched->cpl_tasks, 0);
+	__init_gc_limit(&iosched->gc_limit);
 
 	spin_lock_init(&iosched->gc_write_lock);
 	iosched->gc_write_count = 0;
 	INIT_LIST_HEAD(&iosched->lbz_gc_writes);
 	iosched->host = dev;
 
+	ret = __init_retry_ctxs(iosched, dev);
+	if (ret < 0) {
+		LBZERR("init retry ctxs failed: %d", ret);
+		return ret;
+	}
+
+	ret = bioset_init(&iosched->bio_split, BIO_POOL_SIZE, 0, 0);
+	if (ret < 0) {
+		LBZERR("init write split bioset failed: %d", ret);
+		goto bs_err;
+	}
+
+	ret = __init_cpl_ctxs(iosched, dev);
+	if (ret < 0) {
+		LBZERR("init completion ctxs failed: %d", ret);
+		goto cpl_err;
+	}
+
 	snprintf(iosched->wq_name, LBZ_MAX_NAME_LEN, "%s_retry", dev->devname);
-	iosched->retry_wq = create_singlethread_workqueue(iosched->wq_name);
-	if (IS_ERR(iosched->retry_wq)) {
-		LBZERR("alloc workqueue [%s] error:%ld", iosched->wq_name, PTR_ERR(iosched->retry_wq));
-		return PTR_ERR(iosched->retry_wq);
+	/*retry ctxs run in parallel, gc retry_wk is still serialized as one work.*/
+	if (iosched->nr_retry_ctxs > 1)
+		iosched->retry_wq = alloc_workqueue("%s", WQ_MEM_RECLAIM | WQ_UNBOUND, 0, iosched->wq_name);
+	else
+		iosched->retry_wq = create_singlethread_workqueue(iosched->wq_name);
+	if (!iosched->retry_wq) {
+		ret = -ENOMEM;
+		LBZERR("alloc workqueue [%s] error:%d", iosched->wq_name, ret);
+		goto wq_err;
 	}
 	INIT_DELAYED_WORK(&iosched->retry_wk, retry_wk_fn);
+	INIT_DELAYED_WORK(&iosched->space_backoff_wk, space_backoff_wk_fn);
 	timer_setup(&iosched->retry_timer, __retry_timer_fn, 0);
 	iosched->retry_expire = HZ;
 	iosched->retry_timer.expires = jiffies + iosched->retry_expire;
 	add_timer(&iosched->retry_timer);
+	__init_throttle(&iosched->throttle);
 
 	return 0;
+wq_err:
+	destroy_workqueue(iosched->cpl_wq);
+	free_percpu(iosched->cpl_ctxs);
+cpl_err:
+	bioset_exit(&iosched->bio_split);
+bs_err:
+	LBZ_FREE_MEM(iosched->retry_ctxs, sizeof(struct lbz_retry_ctx) * iosched->nr_retry_ctxs);
+	return ret;
 }
 
 void lbz_iosched_destory(struct lbz_io_scheduler *iosched)
 {
+	del_timer_sync(&iosched->throttle.timer);
 	del_timer_sync(&iosched->retry_timer);
+	cancel_delayed_work_sync(&iosched->space_backoff_wk);
 	destroy_workqueue(iosched->retry_wq);
+	destroy_workqueue(iosched->cpl_wq);
+	free_percpu(iosched->cpl_ctxs);
+	bioset_exit(&iosched->bio_split);
+	LBZ_FREE_MEM(iosched->retry_ctxs, sizeof(struct lbz_retry_ctx) * iosched->nr_retry_ctxs);
+}
+
+void lbz_iosched_cache_exit(void)
+{
+	mempool_destroy(lbz_log_page_pool);
+	mempool_destroy(lbz_log_pool);
+	mempool_destroy(lbz_hook_pool);
+	mempool_destroy(lbz_task_pool);
+	kmem_cache_destroy(lbz_log_cache);
+	kmem_cache_destroy(lbz_hook_cache);
+	kmem_cache_destroy(lbz_task_cache);
+}
+
+int lbz_iosched_cache_init(void)
+{
+	lbz_task_cache = KMEM_CACHE(lbz_io_task, 0);
+	lbz_hook_cache = KMEM_CACHE(lbz_io_hook, 0);
+	lbz_log_cache = KMEM_CACHE(lbz_disk_log, 0);
+	if (!lbz_task_cache || !lbz_hook_cache || !lbz_log_cache)
+		goto err;
+
+	lbz_task_pool = mempool_create_slab_pool(LBZ_MIN_POOL_OBJS, lbz_task_cache);
+	lbz_hook_pool = mempool_create_slab_pool(LBZ_MIN_POOL_OBJS, lbz_hook_cache);
+	lbz_log_pool = mempool_create_slab_pool(LBZ_MIN_POOL_OBJS, lbz_log_cache);
+	lbz_log_page_pool = mempool_create_page_pool(BIO_POOL_SIZE, 0);
+	if (!lbz_task_pool || !lbz_hook_pool || !lbz_log_pool || !lbz_log_page_pool)
+		goto err;
+	return 0;
+err:
+	LBZERR("create iosched caches failed");
+	lbz_iosched_cache_exit();
+	return -ENOMEM;
 }
@@ -0,0 +1,383 @@
+#include "lbz-mapping.h"
+#include "lbz-zone-metadata.h"
+#include "lbz-dev.h"
+
+#ifdef CONFIG_LBZ_EXTENT_MAPPING_SUPPORT
+#define LBZ_MSG_PREFIX "lbz-mapping"
+
+static struct kmem_cache *lbz_extent_cache;
+static mempool_t *lbz_extent_pool;
+
+static inline unsigned int __ext_end(struct lbz_extent *ext)
+{
+	return ext->blkid + ext->len;
+}
+
+static inline unsigned int __group_end(unsigned int blkid)
+{
+	return round_down(blkid, LBZ_EXT_GROUP_BLKS) + LBZ_EXT_GROUP_BLKS;
+}
+
+static struct lbz_extent_group *__ext_group(struct lbz_mapping *mapping, unsigned int blkid)
+{
+	BUG_ON(blkid >= mapping->max_blkid);
+	return &mapping->groups[blkid >> LBZ_EXT_GROUP_SHIFT];
+}
+
+/*
+ * Every remap runs in process context, gc write completion included, so
+ * mempool_alloc waits for the reserve instead of failing.
+ */
+static struct lbz_extent *__ext_alloc(void)
+{
+	might_sleep();
+	return mempool_alloc(lbz_extent_pool, GFP_NOIO);
+}
+
+static void __ext_free_rcu(struct rcu_head *rcu)
+{
+	mempool_free(container_of(rcu, struct lbz_extent, rcu), lbz_extent_pool);
+}
+
+/*
+ * extent containing blkid, or the first one after blkid if there is none.
+ * Walk without lock may see a tree being rotated, it never loops and caller
+ * retries on seq. Successor is tracked while descending, rb_next is not safe
+ * for lockless walk.
+ */
+static struct lbz_extent *__ext_search(struct lbz_extent_group *group, unsigned int blkid)
+{
+	struct rb_node *node = rcu_dereference_raw(group->tree.rb_node);
+	struct lbz_extent *ext, *next = NULL;
+
+	while (node) {
+		ext = rb_entry(node, struct lbz_extent, node);
+		if (blkid >= READ_ONCE(ext->blkid) + READ_ONCE(ext->len)) {
+			node = rcu_dereference_raw(node->rb_right);
+		} else if (blkid < READ_ONCE(ext->blkid)) {
+			next = ext;
+			node = rcu_dereference_raw(node->rb_left);
+		} else {
+			return ext;
+		}
+	}
+	return next;
+}
+
+/*must be locked by caller.*/
+static void __ext_link(struct lbz_mapping *mapping, struct lbz_extent_group *group, struct lbz_extent *ext)
+{
+	struct rb_node **p = &group->tree.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		if (ext->blkid < rb_entry(parent, struct lbz_extent, node)->blkid)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node_rcu(&ext->node, parent, p);
+	rb_insert_color(&ext->node, &group->tree);
+	atomic64_inc(&mapping->nr_extents);
+}
+
+/*must be locked by caller, lockless walkers may still hold it until grace period.*/
+static void __ext_erase(struct lbz_mapping *mapping, struct lbz_extent_group *group, struct lbz_extent *ext)
+{
+	rb_erase(&ext->node, &group->tree);
+	atomic64_dec(&mapping->nr_extents);
+	call_rcu(&ext->rcu, __ext_free_rcu);
+}
+
+/*
+ * Drop [blkid, blkid + nr) from group, old pbids of range are returned in
+ * old_pbids, LBZ_INVALID_PBID for holes. Extent covering both sides of range
+ * is split and spare takes its right part. Return true if spare is used, must
+ * be locked by caller.
+ */
+static bool __ext_punch(struct lbz_mapping *mapping, struct lbz_extent_group *group, unsigned int blkid,
+		unsigned int nr, unsigned int *old_pbids, struct lbz_extent *spare)
+{
+	struct lbz_extent *ext = __ext_search(group, blkid), *next;
+	unsigned int end = blkid + nr, i, e, cut;
+
+	for (i = 0; i < nr; i++)
+		old_pbids[i] = LBZ_INVALID_PBID;
+	for (; ext && ext->blkid < end; ext = next) {
+		next = rb_entry_safe(rb_next(&ext->node), struct lbz_extent, node);
+		e = min(__ext_end(ext), end);
+		for (i = max(ext->blkid, blkid); i < e; i++)
+			old_pbids[i - blkid] = ext->pbid + (i - ext->blkid);
+		if (ext->blkid < blkid && __ext_end(ext) > end) {
+			/*overwrite in the middle.*/
+			spare->blkid = end;
+			spare->pbid = ext->pbid + (end - ext->blkid);
+			spare->len = __ext_end(ext) - end;
+			WRITE_ONCE(ext->len, blkid - ext->blkid);
+			__ext_link(mapping, group, spare);
+			return true;
+		} else if (ext->blkid < blkid) {
+			WRITE_ONCE(ext->len, blkid - ext->blkid);
+		} else if (__ext_end(ext) > end) {
+			cut = end - ext->blkid;
+			WRITE_ONCE(ext->blkid, end);
+			WRITE_ONCE(ext->pbid, ext->pbid + cut);
+			WRITE_ONCE(ext->len, ext->len - cut);
+		} else {
+			__ext_erase(mapping, group, ext);
+		}
+	}
+	return false;
+}
+
+/*
+ * Extents __ext_map of range needs from pool: one if it splits an extent in
+ * the middle, one more if new run merges with neither neighbour. Must be
+ * locked by caller.
+ */
+static int __ext_spares_needed(struct lbz_extent_group *group, unsigned int blkid,
+		unsigned int nr, unsigned int pbid)
+{
+	struct lbz_extent *ext = __ext_search(group, blkid);
+	unsigned int end = blkid + nr;
+	int need = 0;
+
+	if (ext && ext->blkid < blkid && __ext_end(ext) > end)
+		need++;
+	if (pbid == LBZ_INVALID_PBID)
+		return need;
+	/*left neighbour after punch is the extent holding blkid - 1.*/
+	if (blkid > round_down(blkid, LBZ_EXT_GROUP_BLKS)) {
+		ext = __ext_search(group, blkid - 1);
+		if (ext && ext->blkid < blkid && ext->pbid + (blkid - ext->blkid) == pbid)
+			return need;
+	}
+	if (end < __group_end(blkid)) {
+		ext = __ext_search(group, end);
+		if (ext && ext->blkid <= end && ext->pbid + (end - ext->blkid) == pbid + nr)
+			return need;
+	}
+	return need + 1;
+}
+
+/*
+ * Map [blkid, blkid + nr) in one group to [pbid, pbid + nr), run is merged
+ * with neighbour extents contiguous to it. LBZ_INVALID_PBID only unmaps.
+ * Spares are taken from pool only when the range needs them, the lock is
+ * dropped to wait for them and the need is checked again.
+ */
+static void __ext_map(struct lbz_mapping *mapping, unsigned int blkid, unsigned int pbid,
+		unsigned int nr, unsigned int *old_pbids)
+{
+	struct lbz_extent_group *group = __ext_group(mapping, blkid);
+	struct lbz_extent *spare[2] = {NULL, NULL}, *left, *right, *ext;
+	struct rb_node *prev;
+	unsigned long flag;
+	int used = 0, have = 0, need;
+
+	spin_lock_irqsave(&group->lock, flag);
+	while ((need = __ext_spares_needed(group, blkid, nr, pbid)) > have) {
+		spin_unlock_irqrestore(&group->lock, flag);
+		for (; have < need; have++)
+			spare[have] = __ext_alloc();
+		spin_lock_irqsave(&group->lock, flag);
+	}
+	write_seqcount_begin(&group->seq);
+	if (__ext_punch(mapping, group, blkid, nr, old_pbids, spare[used]))
+		used++;
+	if (pbid == LBZ_INVALID_PBID)
+		goto out;
+	right = __ext_search(group, blkid);
+	prev = right ? rb_prev(&right->node) : rb_last(&group->tree);
+	left = rb_entry_safe(prev, struct lbz_extent, node);
+	if (right && (right->blkid != blkid + nr || right->pbid != pbid + nr))
+		right = NULL;
+	if (left && __ext_end(left) == blkid && left->pbid + left->len == pbid) {
+		WRITE_ONCE(left->len, left->len + nr);
+		if (right) {
+			WRITE_ONCE(left->len, left->len + right->len);
+			__ext_erase(mapping, group, right);
+		}
+	} else if (right) {
+		WRITE_ONCE(right->blkid, blkid);
+		WRITE_ONCE(right->pbid, pbid);
+		WRITE_ONCE(right->len, right->len + nr);
+	} else {
+		ext = spare[used++];
+		ext->blkid = blkid;
+		ext->pbid = pbid;
+		ext->len = nr;
+		__ext_link(mapping, group, ext);
+	}
+out:
+	write_seqcount_end(&group->seq);
+	spin_unlock_irqrestore(&group->lock, flag);
+	for (; used < have; used++)
+		mempool_free(spare[used], lbz_extent_pool);
+}
+
+/*caller holds lbz_zone_read_lock if it reads the block, zone is not referenced.*/
+int lbz_mapping_lookup(struct lbz_mapping *mapping, unsigned int *ret_pbid, unsigned int blkid)
+{
+	struct lbz_extent_group *group = __ext_group(mapping, blkid);
+	struct lbz_extent *ext;
+	unsigned int seq, pbid;
+
+	rcu_read_lock();
+	do {
+		seq = read_seqcount_begin(&group->seq);
+		pbid = LBZ_INVALID_PBID;
+		ext = __ext_search(group, blkid);
+		if (ext && READ_ONCE(ext->blkid) <= blkid)
+			pbid = READ_ONCE(ext->pbid) + (blkid - READ_ONCE(ext->blkid));
+	} while (read_seqcount_retry(&group->seq, seq));
+	rcu_read_unlock();
+	if (pbid == LBZ_INVALID_PBID)
+		return -ENOENT;
+
+	*ret_pbid = pbid;
+
+	return 0;
+}
+
+/*
+ * Resolve at most max_nr blocks from blkid whose pbids are contiguous, or
+ * which are all unmapped. Return number of blocks, pbid of the first one is
+ * LBZ_INVALID_PBID for unmapped run. One extent or hole is resolved per step.
+ */
+unsigned int lbz_mapping_lookup_run(struct lbz_mapping *mapping, unsigned int *ret_pbid,
+		unsigned int blkid, unsigned int max_nr)
+{
+	struct lbz_extent_group *group;
+	struct lbz_extent *ext;
+	unsigned int nr = 0, first = LBZ_INVALID_PBID, seq, b, n, pbid;
+
+	rcu_read_lock();
+	while (nr < max_nr) {
+		b = blkid + nr;
+		group = __ext_group(mapping, b);
+		do {
+			seq = read_seqcount_begin(&group->seq);
+			ext = __ext_search(group, b);
+			if (ext && READ_ONCE(ext->blkid) <= b) {
+				pbid = READ_ONCE(ext->pbid) + (b - READ_ONCE(ext->blkid));
+				n = READ_ONCE(ext->blkid) + READ_ONCE(ext->len) - b;
+			} else {
+				pbid = LBZ_INVALID_PBID;
+				n = (ext ? READ_ONCE(ext->blkid) : __group_end(b)) - b;
+			}
+		} while (read_seqcount_retry(&group->seq, seq));
+		if (nr == 0)
+			first = pbid;
+		else if (pbid != (first == LBZ_INVALID_PBID ? LBZ_INVALID_PBID : first + nr))
+			break;
+		nr += min(n, max_nr - nr);
+	}
+	rcu_read_unlock();
+
+	*ret_pbid = first;
+	return nr;
+}
+
+unsigned int lbz_mapping_add(struct lbz_mapping *mapping, unsigned int blkid, unsigned int pbid)
+{
+	unsigned int old_pbid = LBZ_INVALID_PBID;
+
+	__ext_map(mapping, blkid, pbid, 1, &old_pbid);
+	return old_pbid;
+}
+
+/*
+ * Map [blkid, blkid + nr) to [pbid, pbid + nr), old pbids are returned in
+ * old_pbids. Group lock is taken once for the part in it, lookup of a run
+ * sees all of them or none.
+ */
+void lbz_mapping_add_range(struct lbz_mapping *mapping, unsigned int blkid, unsigned int pbid,
+		unsigned int nr, unsigned int *old_pbids)
+{
+	unsigned int i = 0, n;
+
+	while (i < nr) {
+		n = min(nr - i, __group_end(blkid + i) - (blkid + i));
+		__ext_map(mapping, blkid + i, pbid + i, n, old_pbids + i);
+		i += n;
+	}
+}
+
+unsigned int lbz_mapping_remove(struct lbz_mapping *mapping, unsigned int blkid)
+{
+	return lbz_mapping_add(mapping, blkid, LBZ_INVALID_PBID);
+}
+
+void lbz_mapping_proc_read(struct lbz_mapping *mapping, struct seq_file *seq)
+{
+	long nr_extents = atomic64_read(&mapping->nr_extents);
+
+	seq_printf(seq, "mode: extent\n"
+					"extents: %ld\n"
+					"mapping_bytes: %lu\n",
+					nr_extents,
+					sizeof(struct lbz_mapping) + mapping->nr_groups * sizeof(struct lbz_extent_group) +
+					nr_extents * sizeof(struct lbz_extent));
+}
+
+int lbz_mapping_init(struct lbz_mapping *mapping, struct lbz_device *dev)
+{
+	unsigned int i = 0;
+
+	mapping->max_blkid = dev->dev_size >> (LBZ_DATA_BLK_SHIFT - SECTOR_SHIFT);
+	mapping->superblock_pbid = LBZ_INVALID_PBID;
+	mapping->host = dev;
+	atomic64_set(&mapping->nr_extents, 0);
+
+	mapping->nr_groups = DIV_ROUND_UP(mapping->max_blkid, LBZ_EXT_GROUP_BLKS);
+	LBZ_ALLOC_LARGE_MEM(mapping->groups, mapping->nr_groups * sizeof(struct lbz_extent_group), GFP_KERNEL);
+	if (!mapping->groups)
+		return -ENOMEM;
+
+	for (; i < mapping->nr_groups; i++) {
+		spin_lock_init(&mapping->groups[i].lock);
+		seqcount_spinlock_init(&mapping->groups[i].seq, &mapping->groups[i].lock);
+		mapping->groups[i].tree = RB_ROOT;
+	}
+	return 0;
+}
+
+/*no lookup is left, extents go back to pool directly.*/
+void lbz_mapping_destroy(struct lbz_mapping *mapping)
+{
+	struct lbz_extent *ext, *next;
+	unsigned int i = 0;
+
+	for (; i < mapping->nr_groups; i++) {
+		rbtree_postorder_for_each_entry_safe(ext, next, &mapping->groups[i].tree, node)
+			mempool_free(ext, lbz_extent_pool);
+	}
+	atomic64_set(&mapping->nr_extents, 0);
+	LBZ_FREE_LARGE_MEM(mapping->groups, mapping->nr_groups * sizeof(struct lbz_extent_group));
+	mapping->groups = NULL;
+}
+
+void lbz_mapping_cache_exit(void)
+{
+	rcu_barrier(); /*extents freed by __ext_erase.*/
+	mempool_destroy(lbz_extent_pool);
+	kmem_cache_destroy(lbz_extent_cache);
+}
+
+int lbz_mapping_cache_init(void)
+{
+	lbz_extent_cache = KMEM_CACHE(lbz_extent, 0);
+	if (!lbz_extent_cache)
+		goto err;
+	lbz_extent_pool = mempool_create_slab_pool(LBZ_EXT_MIN_POOL_OBJS, lbz_extent_cache);
+	if (!lbz_extent_pool)
+		goto err;
+	return 0;
+err:
+	LBZERR("create mapping caches failed");
+	lbz_mapping_cache_exit();
+	return -ENOMEM;
+}
+#endif
@@ -2,67 +2,224 @@
 #include "lbz-zone-metadata.h"
 #include "lbz-dev.h"
 
-static void __find_specific_node(struct lbz_mapping *mapping, unsigned int blkid, struct mapping_leaf_node **leaf, int *index)
+#ifndef CONFIG_LBZ_EXTENT_MAPPING_SUPPORT
+static void * __alloc_mapping_node(void)
 {
-	int root_index, int_index, leaf_index;
+	void *buf;
+	
+retry:
+	buf = (void *)__get_free_page(GFP_NOIO);
+	if (!buf) {
+		msleep(5);
+		goto retry;
+	}
+	return buf;
+}
 
-	BUG_ON(blkid < 0 || blkid >= mapping->max_blkid);
+static void __free_mapping_node(void *buf)
+{
+	free_page((unsigned long)buf);
+}
 
-	root_index = blkid / LBZ_INT_NODE_INDEXED_BLKS; 
-	int_index = blkid / LBZ_LEAF_NODE_ENTIRES % LBZ_INT_NODE_ENTRIES;
-	leaf_index = blkid % LBZ_LEAF_NODE_ENTIRES;
+static void __init_internal_node(struct mapping_internal_node *int_node, unsigned int blkid)
+{
+	int_node->internal_header.entries = 0;
+	int_node->internal_header.blkid = blkid;
+	memset(int_node->childern, 0, LBZ_INT_NODE_ENTRIES * sizeof(struct mapping_leaf_node *));
+}
 
-	*leaf = mapping->root[root_index]->childern[int_index];
-	*index = leaf_index;
+static void __init_leaf_node(struct mapping_leaf_node *leaf_node, unsigned int blkid)
+{
+	spin_lock_init(&leaf_node->header.lock);
+	seqcount_spinlock_init(&leaf_node->header.seq, &leaf_node->header.lock);
+	leaf_node->header.blkid = blkid;
+	leaf_node->header.nr_mapped = 0;
+	memset(leaf_node->pbids, 0xff, LBZ_LEAF_NODE_ENTIRES * sizeof(unsigned int));
 }
 
-int lbz_mapping_lookup(struct lbz_mapping *mapping, struct lbz_zone **ret_zone, unsigned int *ret_pbid, unsigned int blkid)
+/*leaf covering blkid, NULL if no block of it was ever mapped.*/
+static struct mapping_leaf_node *__find_leaf(struct lbz_mapping *mapping, unsigned int blkid, int *index)
 {
-	struct lbz_device *dev = mapping->host;
-	struct mapping_leaf_node *leaf;
-	unsigned int index, pbid;
-	unsigned long flag;
-	struct leaf_node_headr *header;
-	struct lbz_zone *zone = NULL;
+	struct mapping_internal_node *int_node;
 
-	__find_specific_node(mapping, blkid, &leaf, &index);
-	header = &leaf->header;
-	/*add zone reference, in case that zone becomes invalid.*/
-	read_lock_irqsave(&header->lock, flag);
-	pbid = leaf->pbids[index];
-	if (pbid != LBZ_INVALID_PBID) {
-		zone = get_zone_by_pbid(dev->zone_metadata, pbid);
-		lbz_get_zone(zone);
+	BUG_ON(blkid >= mapping->max_blkid);
+
+	*index = blkid % LBZ_LEAF_NODE_ENTIRES;
+	int_node = smp_load_acquire(&mapping->root[blkid / LBZ_INT_NODE_INDEXED_BLKS]);
+	if (!int_node)
+		return NULL;
+	return smp_load_acquire(&int_node->childern[blkid / LBZ_LEAF_NODE_ENTIRES % LBZ_INT_NODE_ENTRIES]);
+}
+
+/*
+ * Leaf covering blkid, allocated on first write to it. Racing writers both
+ * allocate, loser of cmpxchg frees its node. Only write completion allocates,
+ * gc remaps blocks mapped before and always finds their leaves.
+ */
+static struct mapping_leaf_node *__get_leaf(struct lbz_mapping *mapping, unsigned int blkid, int *index)
+{
+	struct mapping_internal_node *int_node, **slot = &mapping->root[blkid / LBZ_INT_NODE_INDEXED_BLKS];
+	struct mapping_leaf_node *leaf, **leaf_slot;
+	void *node;
+
+	leaf = __find_leaf(mapping, blkid, index);
+	if (leaf)
+		return leaf;
+	BUG_ON(!in_task());
+
+	int_node = smp_load_acquire(slot);
+	if (!int_node) {
+		node = __alloc_mapping_node();
+		__init_internal_node(node, rounddown(blkid, LBZ_INT_NODE_INDEXED_BLKS));
+		int_node = cmpxchg_release(slot, NULL, node);
+		if (int_node) {
+			__free_mapping_node(node);
+		} else {
+			int_node = node;
+			atomic_inc(&mapping->nr_internal_nodes);
+		}
+	}
+
+	leaf_slot = &int_node->childern[blkid / LBZ_LEAF_NODE_ENTIRES % LBZ_INT_NODE_ENTRIES];
+	leaf = smp_load_acquire(leaf_slot);
+	if (!leaf) {
+		node = __alloc_mapping_node();
+		__init_leaf_node(node, rounddown(blkid, LBZ_LEAF_NODE_ENTIRES));
+		leaf = cmpxchg_release(leaf_slot, NULL, node);
+		if (leaf) {
+			__free_mapping_node(node);
+		} else {
+			leaf = node;
+			atomic_inc(&mapping->nr_leaf_nodes);
+		}
 	}
-	read_unlock_irqrestore(&header->lock, flag);
+	return leaf;
+}
 
+/*caller holds lbz_zone_read_lock if it reads the block, zone is not referenced.*/
+int lbz_mapping_lookup(struct lbz_mapping *mapping, unsigned int *ret_pbid, unsigned int blkid)
+{
+	struct mapping_leaf_node *leaf;
+	unsigned int pbid;
+	int index;
+
+	leaf = __find_leaf(mapping, blkid, &index);
+	if (!leaf)
+		return -ENOENT;
+	pbid = READ_ONCE(leaf->pbids[index]);
 	if (pbid == LBZ_INVALID_PBID)
 		return -ENOENT;
 
 	*ret_pbid = pbid;
-	*ret_zone = zone;
 
 	return 0;
 }
 
+/*
+ * Resolve at most max_nr blocks from blkid whose pbids are contiguous, or
+ * which are all unmapped. Return number of blocks, pbid of the first one is
+ * LBZ_INVALID_PBID for unmapped run.
+ */
+unsigned int lbz_mapping_lookup_run(struct lbz_mapping *mapping, unsigned int *ret_pbid,
+		unsigned int blkid, unsigned int max_nr)
+{
+	struct mapping_leaf_node *leaf;
+	unsigned int nr = 0, start, first = LBZ_INVALID_PBID, seq, mapped, n;
+	int index, start_index;
+
+	do {
+		leaf = __find_leaf(mapping, blkid + nr, &start_index);
+		start = nr;
+		if (!leaf) {
+			/*never written, same as a leaf without mapped block.*/
+			index = start_index;
+			if (first != LBZ_INVALID_PBID)
+				break;
+			n = min_t(unsigned int, max_nr - nr, LBZ_LEAF_NODE_ENTIRES - index);
+			nr += n;
+			index += n;
+			continue;
+		}
+		/*run within one leaf is a snapshot, retry if a writer raced with it.*/
+		do {
+			seq = read_seqcount_begin(&leaf->header.seq);
+			nr = start;
+			index = start_index;
+			mapped = READ_ONCE(leaf->header.nr_mapped);
+			if (nr == 0)
+				first = mapped ? READ_ONCE(leaf->pbids[index]) : LBZ_INVALID_PBID;
+			if (!mapped && first == LBZ_INVALID_PBID) {
+				n = min_t(unsigned int, max_nr - nr, LBZ_LEAF_NODE_ENTIRES - index);
+				nr += n;
+				index += n;
+				continue;
+			}
+			for (; index < LBZ_LEAF_NODE_ENTIRES && nr < max_nr; index++, nr++) {
+				if (READ_ONCE(leaf->pbids[index]) !=
+						(first == LBZ_INVALID_PBID ? LBZ_INVALID_PBID : first + nr))
+					break;
+			}
+		} while (read_seqcount_retry(&leaf->header.seq, seq));
+	} while (index == LBZ_LEAF_NODE_ENTIRES && nr < max_nr);
+
+	*ret_pbid = first;
+	return nr;
+}
+
 unsigned int lbz_mapping_add(struct lbz_mapping *mapping, unsigned int blkid, unsigned int pbid)
 {
 	struct mapping_leaf_node *leaf;
-	unsigned int index;
+	int index;
 	unsigned long flag;
 	struct leaf_node_headr *header;
 	unsigned int old_pbid = LBZ_INVALID_PBID;
 
-	__find_specific_node(mapping, blkid, &leaf, &index);
+	leaf = __get_leaf(mapping, blkid, &index);
 	header = &leaf->header;
-	write_lock_irqsave(&header->lock, flag);
+	spin_lock_irqsave(&header->lock, flag);
+	write_seqcount_begin(&header->seq);
 	old_pbid = leaf->pbids[index];
-	leaf->pbids[index] = pbid;
-	write_unlock_irqrestore(&header->lock, flag);
+	WRITE_ONCE(leaf->pbids[index], pbid);
+	if (old_pbid == LBZ_INVALID_PBID && pbid != LBZ_INVALID_PBID)
+		WRITE_ONCE(header->nr_mapped, header->nr_mapped + 1);
+	write_seqcount_end(&header->seq);
+	spin_unlock_irqrestore(&header->lock, flag);
 
 	return old_pbid;
 }
 
+/*
+ * Map [blkid, blkid + nr) to [pbid, pbid + nr), old pbids are returned in
+ * old_pbids. Leaf lock is taken once for all blocks it covers, lookup of a
+ * run sees all of them or none.
+ */
+void lbz_mapping_add_range(struct lbz_mapping *mapping, unsigned int blkid, unsigned int pbid,
+		unsigned int nr, unsigned int *old_pbids)
+{
+	struct mapping_leaf_node *leaf;
+	unsigned int i = 0, k, n, mapped;
+	unsigned long flag;
+	int index;
+
+	while (i < nr) {
+		mapped = 0;
+		leaf = __get_leaf(mapping, blkid + i, &index);
+		n = min_t(unsigned int, nr - i, LBZ_LEAF_NODE_ENTIRES - index);
+		spin_lock_irqsave(&leaf->header.lock, flag);
+		write_seqcount_begin(&leaf->header.seq);
+		for (k = 0; k < n; k++) {
+			old_pbids[i + k] = leaf->pbids[index + k];
+			WRITE_ONCE(leaf->pbids[index + k], pbid + i + k);
+			if (old_pbids[i + k] == LBZ_INVALID_PBID)
+				mapped++;
+		}
+		WRITE_ONCE(leaf->header.nr_mapped, leaf->header.nr_mapped + mapped);
+		write_seqcount_end(&leaf->header.seq);
+		spin_unlock_irqrestore(&leaf->header.lock, flag);
+		i += n;
+	}
+}
+
 unsigned int lbz_mapping_remove(struct lbz_mapping *mapping, unsigned int blkid)
 {
 	struct mapping_leaf_node *leaf;
@@ -71,83 +228,69 @@ unsigned int lbz_mapping_remove(struct lbz_mapping *mapping, unsigned int blkid)
 	struct leaf_node_headr *header;
 	unsigned int old_pbid = LBZ_INVALID_PBID;
 
-	__find_specific_node(mapping, blkid, &leaf, &index);
+	leaf = __find_leaf(mapping, blkid, &index);
+	if (!leaf)
+		return LBZ_INVALID_PBID;
 	header = &leaf->header;
-	write_lock_irqsave(&header->lock, flag);
+	spin_lock_irqsave(&header->lock, flag);
+	write_seqcount_begin(&header->seq);
 	old_pbid = leaf->pbids[index];
-	leaf->pbids[index] = LBZ_INVALID_PBID;
-	write_unlock_irqrestore(&header->lock, flag);
+	WRITE_ONCE(leaf->pbids[index], LBZ_INVALID_PBID);
+	if (old_pbid != LBZ_INVALID_PBID)
+		WRITE_ONCE(header->nr_mapped, header->nr_mapped - 1);
+	write_seqcount_end(&header->seq);
+	spin_unlock_irqrestore(&header->lock, flag);
 
 	return old_pbid;
 }
 
-static void * __alloc_mapping_node(void)
+void lbz_mapping_proc_read(struct lbz_mapping *mapping, struct seq_file *seq)
 {
-	void *buf;
-	
-retry:
-	buf = (void *)__get_free_page(GFP_KERNEL);
-	if (IS_ERR(buf)) {
-		msleep(5);
-		goto retry;
-	}
-	return buf;
-}
+	unsigned long nr_internal_node = atomic_read(&mapping->nr_internal_nodes);
+	unsigned long nr_leaf_node = atomic_read(&mapping->nr_leaf_nodes);
 
-static void __free_mapping_node(void *buf)
-{
-	free_page((unsigned long)buf);
-}
-
-static void __init_internal_node(struct mapping_internal_node *int_node, unsigned int blkid)
-{
-	int_node->internal_header.entries = 0;
-	int_node->internal_header.blkid = blkid;
-}
-
-static void __init_leaf_node(struct mapping_leaf_node *leaf_node, unsigned int blkid)
-{
-	rwlock_init(&leaf_node->header.lock);
-	leaf_node->header.blkid = blkid;
-	memset(leaf_node->pbids, 0xff, LBZ_LEAF_NODE_ENTIRES * sizeof(unsigned int));
+	seq_printf(seq, "mode: block\n"
+					"root_entries: %u\n"
+					"internal_nodes: %lu\n"
+					"leaf_nodes: %lu\n"
+					"mapping_bytes: %lu\n",
+					mapping->nr_roots, nr_internal_node, nr_leaf_node,
+					mapping->nr_roots * sizeof(struct mapping_internal_node *) +
+					(nr_internal_node + nr_leaf_node) * LBZ_MAPPING_BLK_SIZE);
 }
 
-void lbz_mapping_init(struct lbz_mapping *mapping, struct lbz_device *dev)
+int lbz_mapping_init(struct lbz_mapping *mapping, struct lbz_device *dev)
 {
-	int nr_internal_node = 0, nr_leaf_node = 0, max_blkid = 0, i = 0, j = 0, count = 0, start_blkid = 0;
-
-	max_blkid = mapping->max_blkid = dev->dev_size >> (LBZ_DATA_BLK_SHIFT - SECTOR_SHIFT);
+	mapping->max_blkid = dev->dev_size >> (LBZ_DATA_BLK_SHIFT - SECTOR_SHIFT);
 	mapping->superblock_pbid = LBZ_INVALID_PBID;
 	mapping->host = dev;
+	atomic_set(&mapping->nr_internal_nodes, 0);
+	atomic_set(&mapping->nr_leaf_nodes, 0);
 
-	nr_internal_node = (max_blkid + LBZ_INT_NODE_INDEXED_BLKS - 1) / LBZ_INT_NODE_INDEXED_BLKS;
-	nr_leaf_node = (max_blkid + LBZ_LEAF_NODE_ENTIRES - 1) / LBZ_LEAF_NODE_ENTIRES;
-
-	for (; i < nr_internal_node; i++) {
-		mapping->root[i] = __alloc_mapping_node();
-		__init_internal_node(mapping->root[i], start_blkid);
-		for (j = 0; j < LBZ_INT_NODE_ENTRIES && count < nr_leaf_node; j++, count++) {
-			mapping->root[i]->childern[j] = __alloc_mapping_node();
-			mapping->root[i]->internal_header.entries++;
-			__init_leaf_node(mapping->root[i]->childern[j], start_blkid);
-			start_blkid += LBZ_LEAF_NODE_ENTIRES;
-		}
-	}
+	mapping->nr_roots = DIV_ROUND_UP(mapping->max_blkid, LBZ_INT_NODE_INDEXED_BLKS);
+	LBZ_ALLOC_LARGE_MEM(mapping->root, mapping->nr_roots * sizeof(struct mapping_internal_node *), GFP_KERNEL);
+	if (!mapping->root)
+		return -ENOMEM;
+
+	return 0;
 }
 
 void lbz_mapping_destroy(struct lbz_mapping *mapping)
 {
-	int nr_internal_node = 0, nr_leaf_node = 0, max_blkid = 0, i = 0, j = 0, count = 0;
-
-	max_blkid = mapping->max_blkid;
-
-	nr_internal_node = (max_blkid + LBZ_INT_NODE_INDEXED_BLKS - 1) / LBZ_INT_NODE_INDEXED_BLKS;
-	nr_leaf_node = (max_blkid + LBZ_LEAF_NODE_ENTIRES - 1) / LBZ_LEAF_NODE_ENTIRES;
+	struct mapping_internal_node *int_node;
+	unsigned int i = 0, j = 0;
 
-	for (; i < nr_internal_node; i++) {
-		for (j = 0; j < LBZ_INT_NODE_ENTRIES && count < nr_leaf_node; j++, count++) {
-			__free_mapping_node(mapping->root[i]->childern[j]);
+	for (; i < mapping->nr_roots; i++) {
+		int_node = mapping->root[i];
+		if (!int_node)
+			continue;
+		for (j = 0; j < LBZ_INT_NODE_ENTRIES; j++) {
+			if (int_node->childern[j])
+				__free_mapping_node(int_node->childern[j]);
 		}
-		__free_mapping_node(mapping->root[i]);
+		__free_mapping_node(int_node);
 	}
+	LBZ_FREE_LARGE_MEM(mapping->root, mapping->nr_roots * sizeof(struct mapping_internal_node *));
+	mapping->root = NULL;
 }
+#endif
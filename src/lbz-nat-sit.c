@@ -5,6 +5,8 @@
 #include "lbz-gc.h"
 #include "lbz-request.h"
 #include "lbz-nat-sit.h"
+#include "lbz-read-cache.h"
+#include "lbz-readahead.h"
 
 #define LBZ_MSG_PREFIX "lbz-nat-sit"
 
@@ -68,6 +70,12 @@ void lbz_nat_sit_tx_complete(struct lbz_nat_sit_mgmt *mgmt)
 				lbz_zone_update_reverse_map(dev->zone_metadata,
 						old_zone, old_pbid, LBZ_INVALID_PBID);
 				lbz_zone_release_global_res(dev->zone_metadata, old_zone);
+#ifdef CONFIG_LBZ_READ_CACHE_SUPPORT
+				lbz_rc_invalidate(dev->rc, node->to_free_blkids[i], 1);
+#endif
+#ifdef CONFIG_LBZ_READAHEAD_SUPPORT
+				lbz_ra_invalidate(dev->ra, node->to_free_blkids[i], 1);
+#endif
 				mgmt->total_freed_blks++;
 			}
 		}
@@ -1,6 +1,8 @@
 #include "lbz-proc.h"
 #include "lbz-dev.h"
 #include "lbz-nat-sit.h"
+#include "lbz-read-cache.h"
+#include "lbz-io-scheduler.h"
 
 #define LBZ_MSG_PREFIX "lbz-proc"
 
@@ -81,6 +83,50 @@ ssize_t module_input(struct file *filp, const char *buff, size_t len, loff_t *of
 			lbz_nat_sit_add_rule(dev->nat_sit_mgmt, &args, dev);
 			break;
 #endif
+#ifdef CONFIG_LBZ_READ_CACHE_SUPPORT
+		case 'm': {
+			/*memory budget of read cache in pages, 0 disables it.*/
+			struct lbz_device *target;
+			unsigned int max_pages;
+			int minor;
+
+			cnt = sscanf((Message + 1), "%d,%u", &minor, &max_pages);
+			if (cnt < 2) {
+				LBZERR("input error %s", Message);
+				rc = -EINVAL;
+				goto out;
+			}
+			target = lbz_dev_find_by_minor(minor);
+			if (NULL == target) {
+				LBZERR("dev not found, minor: %d", minor);
+				rc = -EINVAL;
+				goto out;
+			}
+			lbz_rc_set_max_pages(target->rc, max_pages);
+			break;
+		}
+#endif
+		case 'g': {
+			/*gc tasks outstanding at most, user read latency target in us (0: never yield).*/
+			struct lbz_device *target;
+			unsigned int max_inflight, lat_target_us;
+			int minor;
+
+			cnt = sscanf((Message + 1), "%d,%u,%u", &minor, &max_inflight, &lat_target_us);
+			if (cnt < 3) {
+				LBZERR("input error %s", Message);
+				rc = -EINVAL;
+				goto out;
+			}
+			target = lbz_dev_find_by_minor(minor);
+			if (NULL == target) {
+				LBZERR("dev not found, minor: %d", minor);
+				rc = -EINVAL;
+				goto out;
+			}
+			lbz_iosched_set_gc_limit(target->iosched, max_inflight, lat_target_us);
+			break;
+		}
 	}
 out:
 	if (rc)
@@ -0,0 +1,394 @@
+#include "lbz-dev.h"
+#include "lbz-nat-sit.h"
+#include "lbz-read-cache.h"
+
+#define LBZ_MSG_PREFIX "lbz-read-cache"
+
+#ifdef CONFIG_LBZ_READ_CACHE_SUPPORT
+/*must be locked by caller.*/
+static struct lbz_rc_entry *__rc_search(struct lbz_read_cache *rc, unsigned int blkid)
+{
+	struct rb_node *n = rc->tree.rb_node;
+	struct lbz_rc_entry *entry;
+
+	while (n) {
+		entry = rb_entry(n, struct lbz_rc_entry, node);
+		if (blkid < entry->blkid)
+			n = n->rb_left;
+		else if (blkid > entry->blkid)
+			n = n->rb_right;
+		else
+			return entry;
+	}
+	return NULL;
+}
+
+/*first entry in [blkid, blkid + nr_blks), must be locked by caller.*/
+static struct lbz_rc_entry *__rc_search_range(struct lbz_read_cache *rc,
+		unsigned int blkid, unsigned int nr_blks)
+{
+	struct rb_node *n = rc->tree.rb_node;
+	struct lbz_rc_entry *entry, *found = NULL;
+
+	while (n) {
+		entry = rb_entry(n, struct lbz_rc_entry, node);
+		if (entry->blkid >= blkid) {
+			found = entry;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+	if (found && found->blkid < blkid + nr_blks)
+		return found;
+	return NULL;
+}
+
+static void __rc_link(struct lbz_read_cache *rc, struct lbz_rc_entry *new)
+{
+	struct rb_node **p = &rc->tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct lbz_rc_entry *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct lbz_rc_entry, node);
+		if (new->blkid < entry->blkid)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, &rc->tree);
+}
+
+static inline unsigned int __rc_nr_pages(struct lbz_read_cache *rc)
+{
+	return rc->nr_recent + rc->nr_frequent + rc->nr_filling;
+}
+
+static struct lbz_rc_entry *__rc_alloc_entry(struct lbz_read_cache *rc, unsigned int blkid)
+{
+	struct lbz_rc_entry *entry;
+
+	/*cache is best effort, never wait for memory in io path.*/
+	LBZ_ALLOC_MEM(entry, sizeof(struct lbz_rc_entry), GFP_NOWAIT | __GFP_NOWARN);
+	if (!entry)
+		return NULL;
+	entry->page = alloc_page(GFP_NOWAIT | __GFP_NOWARN);
+	if (!entry->page) {
+		LBZ_FREE_MEM(entry, sizeof(struct lbz_rc_entry));
+		return NULL;
+	}
+	INIT_LIST_HEAD(&entry->link);
+	entry->blkid = blkid;
+	entry->state = LBZ_RC_FILLING;
+	entry->dead = false;
+	entry->rc = rc;
+	return entry;
+}
+
+static void __rc_free_entry(struct lbz_rc_entry *entry)
+{
+	__free_page(entry->page);
+	LBZ_FREE_MEM(entry, sizeof(struct lbz_rc_entry));
+}
+
+/*take entry out of tree and lists, must be locked by caller.*/
+static void __rc_unlink(struct lbz_read_cache *rc, struct lbz_rc_entry *entry)
+{
+	rb_erase(&entry->node, &rc->tree);
+	switch (entry->state) {
+	case LBZ_RC_FILLING:
+		rc->nr_filling--;
+		break;
+	case LBZ_RC_RECENT:
+		list_del_init(&entry->link);
+		rc->nr_recent--;
+		break;
+	case LBZ_RC_FREQUENT:
+		list_del_init(&entry->link);
+		rc->nr_frequent--;
+		break;
+	}
+}
+
+/*recent list goes first if it holds more than its share, must be locked by caller.*/
+static bool __rc_evict_one(struct lbz_read_cache *rc)
+{
+	struct list_head *list = &rc->frequent_list;
+	struct lbz_rc_entry *entry;
+
+	if (rc->nr_recent > rc->max_pages / 2 || list_empty(list))
+		list = &rc->recent_list;
+	if (list_empty(list))
+		return false;
+	entry = list_last_entry(list, struct lbz_rc_entry, link);
+	__rc_unlink(rc, entry);
+	__rc_free_entry(entry);
+	return true;
+}
+
+static void __rc_copy_to_bio(struct bio *bio, struct page *page)
+{
+	char *src = page_address(page), *dst;
+	struct bio_vec bv;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bv, bio, iter) {
+		dst = kmap_atomic(bv.bv_page);
+		memcpy(dst + bv.bv_offset, src, bv.bv_len);
+		kunmap_atomic(dst);
+		src += bv.bv_len;
+	}
+}
+
+/*bio iter is consumed when bio completes, walk the one saved at submit.*/
+static void __rc_copy_from_bio(struct page *page, struct bio *bio, struct bvec_iter start)
+{
+	char *dst = page_address(page), *src;
+	struct bio_vec bv;
+	struct bvec_iter iter;
+
+	__bio_for_each_segment(bv, bio, iter, start) {
+		src = kmap_atomic(bv.bv_page);
+		memcpy(dst, src + bv.bv_offset, bv.bv_len);
+		kunmap_atomic(src);
+		dst += bv.bv_len;
+	}
+}
+
+/*one plain block read of cp/sit/nat area.*/
+static bool __rc_cacheable(struct lbz_read_cache *rc, struct bio *bio)
+{
+#ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
+	struct lbz_device *dev = rc->host;
+	struct lbz_nat_sit_mgmt *mgmt = dev->nat_sit_mgmt;
+	unsigned int blkid = sector_to_blkid(bio->bi_iter.bi_sector);
+#endif
+
+	if (bio->bi_iter.bi_size != LBZ_DATA_BLK_SIZE || READ_ONCE(rc->max_pages) == 0)
+		return false;
+#ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
+	return blkid >= mgmt->cp_blkaddr && blkid < mgmt->nat_blkaddr + mgmt->nat_blocks;
+#else
+	return true;
+#endif
+}
+
+static void lbz_rc_fill_endio(struct bio *bio)
+{
+	struct lbz_rc_entry *entry = bio->bi_private;
+	struct lbz_read_cache *rc = entry->rc;
+	unsigned long flag = 0;
+	bool drop = false;
+
+	bio->bi_end_io = entry->user_endio;
+	bio->bi_private = entry->user_private;
+	/*nobody else touches page of a filling entry.*/
+	if (!bio->bi_status)
+		__rc_copy_from_bio(entry->page, bio, entry->iter);
+
+	spin_lock_irqsave(&rc->lock, flag);
+	if (entry->dead) {
+		drop = true;
+	} else if (bio->bi_status) {
+		__rc_unlink(rc, entry);
+		drop = true;
+	} else {
+		rc->nr_filling--;
+		entry->state = LBZ_RC_RECENT;
+		list_add(&entry->link, &rc->recent_list);
+		rc->nr_recent++;
+	}
+	spin_unlock_irqrestore(&rc->lock, flag);
+
+	if (drop)
+		__rc_free_entry(entry);
+	else
+		atomic64_inc(&rc->fills);
+	bio_endio(bio);
+}
+
+/*
+ * return true if bio is completed from cache. On miss an entry is inserted
+ * before mapping lookup, write completion after it kills the entry, so stale
+ * data never gets in.
+ */
+bool lbz_rc_handle_read(struct lbz_read_cache *rc, struct bio *bio)
+{
+	unsigned int blkid = sector_to_blkid(bio->bi_iter.bi_sector);
+	struct lbz_rc_entry *entry, *new;
+	unsigned long flag = 0;
+
+	if (!__rc_cacheable(rc, bio))
+		return false;
+
+	spin_lock_irqsave(&rc->lock, flag);
+	entry = __rc_search(rc, blkid);
+	if (entry && entry->state != LBZ_RC_FILLING) {
+		__rc_copy_to_bio(bio, entry->page);
+		if (entry->state == LBZ_RC_RECENT) {
+			rc->nr_recent--;
+			rc->nr_frequent++;
+			entry->state = LBZ_RC_FREQUENT;
+		}
+		list_move(&entry->link, &rc->frequent_list);
+		spin_unlock_irqrestore(&rc->lock, flag);
+		atomic64_inc(&rc->hits);
+		bio_endio(bio);
+		return true;
+	}
+	spin_unlock_irqrestore(&rc->lock, flag);
+	atomic64_inc(&rc->misses);
+	/*another read is filling it.*/
+	if (entry)
+		return false;
+
+	new = __rc_alloc_entry(rc, blkid);
+	if (!new)
+		return false;
+	spin_lock_irqsave(&rc->lock, flag);
+	if (__rc_search(rc, blkid))
+		goto drop;
+	while (__rc_nr_pages(rc) >= rc->max_pages && __rc_evict_one(rc))
+		atomic64_inc(&rc->evictions);
+	/*budget is taken by filling entries.*/
+	if (__rc_nr_pages(rc) >= rc->max_pages)
+		goto drop;
+	__rc_link(rc, new);
+	rc->nr_filling++;
+	new->iter = bio->bi_iter;
+	new->user_endio = bio->bi_end_io;
+	new->user_private = bio->bi_private;
+	bio->bi_end_io = lbz_rc_fill_endio;
+	bio->bi_private = new;
+	spin_unlock_irqrestore(&rc->lock, flag);
+	return false;
+drop:
+	spin_unlock_irqrestore(&rc->lock, flag);
+	__rc_free_entry(new);
+	return false;
+}
+
+/*blocks are rewritten or freed, called after mapping is updated.*/
+void lbz_rc_invalidate(struct lbz_read_cache *rc, unsigned int blkid, unsigned int nr_blks)
+{
+	struct lbz_rc_entry *entry, *next;
+	struct rb_node *n;
+	unsigned long flag = 0;
+	LIST_HEAD(free_list);
+
+	spin_lock_irqsave(&rc->lock, flag);
+	entry = __rc_search_range(rc, blkid, nr_blks);
+	while (entry && entry->blkid < blkid + nr_blks) {
+		n = rb_next(&entry->node);
+		next = n ? rb_entry(n, struct lbz_rc_entry, node) : NULL;
+		__rc_unlink(rc, entry);
+		if (entry->state == LBZ_RC_FILLING)
+			entry->dead = true;
+		else
+			list_add(&entry->link, &free_list);
+		atomic64_inc(&rc->invalidations);
+		entry = next;
+	}
+	spin_unlock_irqrestore(&rc->lock, flag);
+
+	list_for_each_entry_safe(entry, next, &free_list, link)
+		__rc_free_entry(entry);
+}
+
+void lbz_rc_set_max_pages(struct lbz_read_cache *rc, unsigned int max_pages)
+{
+	unsigned long flag = 0;
+
+	spin_lock_irqsave(&rc->lock, flag);
+	WRITE_ONCE(rc->max_pages, max_pages);
+	while (__rc_nr_pages(rc) > rc->max_pages && __rc_evict_one(rc))
+		atomic64_inc(&rc->evictions);
+	spin_unlock_irqrestore(&rc->lock, flag);
+}
+
+static unsigned long lbz_rc_shrink_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+	struct lbz_read_cache *rc = container_of(shrink, struct lbz_read_cache, shrinker);
+
+	return READ_ONCE(rc->nr_recent) + READ_ONCE(rc->nr_frequent);
+}
+
+static unsigned long lbz_rc_shrink_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+	struct lbz_read_cache *rc = container_of(shrink, struct lbz_read_cache, shrinker);
+	unsigned long freed = 0, flag = 0;
+
+	spin_lock_irqsave(&rc->lock, flag);
+	while (freed < sc->nr_to_scan && __rc_evict_one(rc))
+		freed++;
+	spin_unlock_irqrestore(&rc->lock, flag);
+	atomic64_add(freed, &rc->shrinker_evictions);
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+void lbz_rc_proc_read(struct lbz_read_cache *rc, struct seq_file *seq)
+{
+	long hits = atomic64_read(&rc->hits), misses = atomic64_read(&rc->misses);
+
+	seq_printf(seq, "nr_pages: %u(max %u)\n"
+					"nr_recent: %u\n"
+					"nr_frequent: %u\n"
+					"nr_filling: %u\n"
+					"hits: %ld\n"
+					"misses: %ld\n"
+					"hit percentage: %ld%%\n"
+					"fills: %lld\n"
+					"invalidations: %lld\n"
+					"evictions: %lld\n"
+					"shrinker_evictions: %lld\n",
+					__rc_nr_pages(rc), rc->max_pages,
+					rc->nr_recent,
+					rc->nr_frequent,
+					rc->nr_filling,
+					hits,
+					misses,
+					hits + misses == 0 ? 0 : hits * 100 / (hits + misses),
+					atomic64_read(&rc->fills),
+					atomic64_read(&rc->invalidations),
+					atomic64_read(&rc->evictions),
+					atomic64_read(&rc->shrinker_evictions));
+}
+
+int lbz_rc_init(struct lbz_read_cache *rc, struct lbz_device *dev)
+{
+	spin_lock_init(&rc->lock);
+	rc->tree = RB_ROOT;
+	INIT_LIST_HEAD(&rc->recent_list);
+	INIT_LIST_HEAD(&rc->frequent_list);
+	rc->nr_recent = rc->nr_frequent = rc->nr_filling = 0;
+	rc->max_pages = LBZ_RC_DEFAULT_PAGES;
+	atomic64_set(&rc->hits, 0);
+	atomic64_set(&rc->misses, 0);
+	atomic64_set(&rc->fills, 0);
+	atomic64_set(&rc->invalidations, 0);
+	atomic64_set(&rc->evictions, 0);
+	atomic64_set(&rc->shrinker_evictions, 0);
+	rc->host = dev;
+
+	rc->shrinker.count_objects = lbz_rc_shrink_count;
+	rc->shrinker.scan_objects = lbz_rc_shrink_scan;
+	rc->shrinker.seeks = DEFAULT_SEEKS;
+	rc->shrinker.batch = LBZ_RC_SHRINK_BATCH;
+	return register_shrinker(&rc->shrinker);
+}
+
+/*all reads have completed, no entry is filling.*/
+void lbz_rc_destroy(struct lbz_read_cache *rc)
+{
+	struct lbz_rc_entry *entry, *next;
+
+	unregister_shrinker(&rc->shrinker);
+	rbtree_postorder_for_each_entry_safe(entry, next, &rc->tree, node)
+		__rc_free_entry(entry);
+	rc->tree = RB_ROOT;
+}
+#endif
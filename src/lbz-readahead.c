@@ -0,0 +1,426 @@
+#include "lbz-dev.h"
+#include "lbz-zone-metadata.h"
+#include "lbz-mapping.h"
+#include "lbz-readahead.h"
+
+#define LBZ_MSG_PREFIX "lbz-readahead"
+
+#ifdef CONFIG_LBZ_READAHEAD_SUPPORT
+/*must be locked by caller.*/
+static struct lbz_ra_entry *__ra_search(struct lbz_readahead *ra, unsigned int blkid)
+{
+	struct rb_node *n = ra->tree.rb_node;
+	struct lbz_ra_entry *entry;
+
+	while (n) {
+		entry = rb_entry(n, struct lbz_ra_entry, node);
+		if (blkid < entry->blkid)
+			n = n->rb_left;
+		else if (blkid > entry->blkid)
+			n = n->rb_right;
+		else
+			return entry;
+	}
+	return NULL;
+}
+
+/*first entry in [blkid, blkid + nr_blks), must be locked by caller.*/
+static struct lbz_ra_entry *__ra_search_range(struct lbz_readahead *ra,
+		unsigned int blkid, unsigned int nr_blks)
+{
+	struct rb_node *n = ra->tree.rb_node;
+	struct lbz_ra_entry *entry, *found = NULL;
+
+	while (n) {
+		entry = rb_entry(n, struct lbz_ra_entry, node);
+		if (entry->blkid >= blkid) {
+			found = entry;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+	if (found && found->blkid < blkid + nr_blks)
+		return found;
+	return NULL;
+}
+
+static void __ra_link(struct lbz_readahead *ra, struct lbz_ra_entry *new)
+{
+	struct rb_node **p = &ra->tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct lbz_ra_entry *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct lbz_ra_entry, node);
+		if (new->blkid < entry->blkid)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, &ra->tree);
+}
+
+static inline struct lbz_ra_entry *__ra_next(struct lbz_ra_entry *entry)
+{
+	struct rb_node *n = rb_next(&entry->node);
+
+	return n ? rb_entry(n, struct lbz_ra_entry, node) : NULL;
+}
+
+static void __ra_free_entry(struct lbz_ra_entry *entry)
+{
+	__free_page(entry->page);
+	LBZ_FREE_MEM(entry, sizeof(struct lbz_ra_entry));
+}
+
+/*take entry out of tree and lru list, must be locked by caller.*/
+static void __ra_unlink(struct lbz_readahead *ra, struct lbz_ra_entry *entry)
+{
+	rb_erase(&entry->node, &ra->tree);
+	if (entry->state == LBZ_RA_VALID) {
+		list_del_init(&entry->link);
+		ra->nr_valid--;
+	} else {
+		ra->nr_filling--;
+	}
+}
+
+/*
+ * all blocks of bio are valid in buffer: copy them to bio and drop them,
+ * must be locked by caller.
+ */
+static bool __ra_serve(struct lbz_readahead *ra, struct bio *bio, unsigned int blkid, unsigned int nr)
+{
+	struct lbz_ra_entry *entry, *next;
+	struct bio_vec bv;
+	struct bvec_iter iter;
+	unsigned int i = 0, off = 0, done, len;
+	char *dst;
+
+	entry = __ra_search(ra, blkid);
+	for (next = entry; i < nr; i++, next = __ra_next(next)) {
+		if (!next || next->blkid != blkid + i || next->state != LBZ_RA_VALID)
+			return false;
+	}
+
+	bio_for_each_segment(bv, bio, iter) {
+		for (done = 0; done < bv.bv_len; done += len) {
+			len = min_t(unsigned int, bv.bv_len - done, LBZ_DATA_BLK_SIZE - off);
+			dst = kmap_atomic(bv.bv_page);
+			memcpy(dst + bv.bv_offset + done, page_address(entry->page) + off, len);
+			kunmap_atomic(dst);
+			off += len;
+			if (off == LBZ_DATA_BLK_SIZE) {
+				next = __ra_next(entry);
+				__ra_unlink(ra, entry);
+				__ra_free_entry(entry);
+				entry = next;
+				off = 0;
+			}
+		}
+	}
+	return true;
+}
+
+/*
+ * find the stream read continues, or start one in least recently used slot.
+ * return true if next window of stream should be prefetched, must be locked
+ * by caller.
+ */
+static bool __ra_observe(struct lbz_readahead *ra, unsigned int blkid, unsigned int nr,
+		unsigned int *start, unsigned int *end)
+{
+	struct lbz_ra_stream *s, *lru = &ra->streams[0];
+	int i = 0;
+
+	for (; i < LBZ_RA_MAX_STREAMS; i++) {
+		s = &ra->streams[i];
+		if (s->next_blkid == blkid && s->seq > 0)
+			goto found;
+		if (time_before(s->last_jiffies, lru->last_jiffies))
+			lru = s;
+	}
+	lru->next_blkid = lru->ra_end = blkid + nr;
+	lru->seq = 1;
+	lru->last_jiffies = jiffies;
+	return false;
+found:
+	s->next_blkid = blkid + nr;
+	s->seq++;
+	s->last_jiffies = jiffies;
+	if (s->ra_end < s->next_blkid)
+		s->ra_end = s->next_blkid;
+	/*prefetch one window ahead, next one starts when half of it is consumed.*/
+	if (s->seq < LBZ_RA_SEQ_TRIGGER || s->ra_end - s->next_blkid >= LBZ_RA_WINDOW_BLKS / 2)
+		return false;
+	*start = s->ra_end;
+	*end = s->ra_end + LBZ_RA_WINDOW_BLKS;
+	s->ra_end = *end;
+	return true;
+}
+
+static void lbz_ra_endio(struct bio *bio)
+{
+	struct lbz_ra_bio *rbio = container_of(bio, struct lbz_ra_bio, bio);
+	struct lbz_readahead *ra = rbio->ra;
+	struct lbz_device *dev = ra->host;
+	struct lbz_ra_entry *entry, *tmp;
+	unsigned long flag = 0;
+	LIST_HEAD(free_list);
+
+	lbz_zone_read_unlock(dev->zone_metadata, rbio->srcu_idx);
+	spin_lock_irqsave(&ra->lock, flag);
+	list_for_each_entry_safe(entry, tmp, &rbio->entries, link) {
+		if (entry->dead) {
+			list_move(&entry->link, &free_list);
+		} else if (bio->bi_status) {
+			__ra_unlink(ra, entry);
+			list_move(&entry->link, &free_list);
+		} else {
+			ra->nr_filling--;
+			entry->state = LBZ_RA_VALID;
+			list_move_tail(&entry->link, &ra->lru_list);
+			ra->nr_valid++;
+		}
+	}
+	spin_unlock_irqrestore(&ra->lock, flag);
+
+	list_for_each_entry_safe(entry, tmp, &free_list, link)
+		__ra_free_entry(entry);
+	if (bio->bi_status)
+		LBZERR_LIMIT("readahead IO encounter error: %d", blk_status_to_errno(bio->bi_status));
+	bio_put(bio);
+	atomic_dec(&ra->inflight);
+}
+
+/*drop placeholders at head of plan, blocks are hole or no bio for them.*/
+static void __ra_drop_plan(struct lbz_readahead *ra, struct list_head *plan, unsigned int nr)
+{
+	struct lbz_ra_entry *entry, *tmp;
+	unsigned long flag = 0;
+	LIST_HEAD(free_list);
+
+	spin_lock_irqsave(&ra->lock, flag);
+	while (nr-- > 0) {
+		entry = list_first_entry(plan, struct lbz_ra_entry, link);
+		if (!entry->dead)
+			__ra_unlink(ra, entry);
+		list_move(&entry->link, &free_list);
+	}
+	spin_unlock_irqrestore(&ra->lock, flag);
+
+	list_for_each_entry_safe(entry, tmp, &free_list, link)
+		__ra_free_entry(entry);
+}
+
+/*one physical run, pages of placeholders at head of plan are read into.*/
+static void __ra_submit_run(struct lbz_readahead *ra, struct list_head *plan,
+		unsigned int pbid, unsigned int nr, int srcu_idx)
+{
+	struct lbz_device *dev = ra->host;
+	struct lbz_ra_entry *entry;
+	struct lbz_ra_bio *rbio;
+	struct bio *bio;
+	unsigned int i = 0;
+
+	bio = bio_alloc_bioset(GFP_NOWAIT | __GFP_NOWARN, nr, &ra->bio_set);
+	if (!bio) {
+		lbz_zone_read_unlock(dev->zone_metadata, srcu_idx);
+		__ra_drop_plan(ra, plan, nr);
+		return;
+	}
+	rbio = container_of(bio, struct lbz_ra_bio, bio);
+	rbio->ra = ra;
+	rbio->srcu_idx = srcu_idx;
+	INIT_LIST_HEAD(&rbio->entries);
+	/*filling entries are only touched by owner, invalidation just marks them dead.*/
+	for (; i < nr; i++) {
+		entry = list_first_entry(plan, struct lbz_ra_entry, link);
+		list_move_tail(&entry->link, &rbio->entries);
+		bio_add_page(bio, entry->page, PAGE_SIZE, 0);
+	}
+	bio_set_dev(bio, dev->phy_bdev);
+	bio->bi_iter.bi_sector = blkid_to_sector(pbid);
+	bio->bi_opf = REQ_OP_READ | REQ_RAHEAD;
+	bio->bi_end_io = lbz_ra_endio;
+	atomic_inc(&ra->inflight);
+	atomic64_inc(&ra->prefetch_bios);
+	atomic64_add(nr, &ra->prefetch_blocks);
+	submit_bio(bio);
+}
+
+/*
+ * Placeholders of window go in before mapping lookup, write completing after
+ * lookup kills them, so stale data never gets in.
+ */
+static void __ra_prefetch(struct lbz_readahead *ra, unsigned int start, unsigned int end)
+{
+	struct lbz_device *dev = ra->host;
+	struct lbz_zone_metadata *zmd = dev->zone_metadata;
+	struct lbz_ra_entry *entry;
+	unsigned int blkid, pbid, nr;
+	unsigned long flag = 0;
+	int srcu_idx;
+	LIST_HEAD(plan);
+
+	end = min(end, dev->mapping->max_blkid);
+	spin_lock_irqsave(&ra->lock, flag);
+	for (blkid = start; blkid < end; blkid++) {
+		if (ra->nr_valid + ra->nr_filling >= LBZ_RA_MAX_PAGES) {
+			if (list_empty(&ra->lru_list))
+				break;
+			/*oldest prefetched block was never read.*/
+			entry = list_first_entry(&ra->lru_list, struct lbz_ra_entry, link);
+			__ra_unlink(ra, entry);
+			__ra_free_entry(entry);
+			atomic64_inc(&ra->evictions);
+		}
+		if (__ra_search(ra, blkid))
+			break;
+		LBZ_ALLOC_MEM(entry, sizeof(struct lbz_ra_entry), GFP_NOWAIT | __GFP_NOWARN);
+		if (!entry)
+			break;
+		entry->page = alloc_page(GFP_NOWAIT | __GFP_NOWARN);
+		if (!entry->page) {
+			LBZ_FREE_MEM(entry, sizeof(struct lbz_ra_entry));
+			break;
+		}
+		entry->blkid = blkid;
+		entry->state = LBZ_RA_FILLING;
+		entry->dead = false;
+		__ra_link(ra, entry);
+		list_add_tail(&entry->link, &plan);
+		ra->nr_filling++;
+	}
+	spin_unlock_irqrestore(&ra->lock, flag);
+	end = blkid;
+
+	for (blkid = start; blkid < end; blkid += nr) {
+		/*zone of run can't be reset until its bio completes.*/
+		srcu_idx = lbz_zone_read_lock(zmd);
+		nr = lbz_mapping_lookup_run(dev->mapping, &pbid, blkid, end - blkid);
+		if (pbid == LBZ_INVALID_PBID) {
+			lbz_zone_read_unlock(zmd, srcu_idx);
+			__ra_drop_plan(ra, &plan, nr);
+			continue;
+		}
+		nr = min(nr, zmd->zone_size_blks - (pbid & (zmd->zone_size_blks - 1)));
+		nr = min_t(unsigned int, nr, BIO_MAX_VECS);
+		__ra_submit_run(ra, &plan, pbid, nr, srcu_idx);
+	}
+	atomic64_inc(&ra->windows);
+}
+
+/*return true if bio is completed from prefetch buffer.*/
+bool lbz_ra_handle_read(struct lbz_readahead *ra, struct bio *bio)
+{
+	unsigned int blkid = sector_to_blkid(bio->bi_iter.bi_sector);
+	unsigned int nr = bio->bi_iter.bi_size >> LBZ_DATA_BLK_SHIFT, start = 0, end = 0;
+	unsigned long flag = 0;
+	bool hit, prefetch;
+
+	spin_lock_irqsave(&ra->lock, flag);
+	hit = __ra_serve(ra, bio, blkid, nr);
+	prefetch = __ra_observe(ra, blkid, nr, &start, &end);
+	spin_unlock_irqrestore(&ra->lock, flag);
+
+	if (prefetch)
+		__ra_prefetch(ra, start, end);
+	if (hit) {
+		atomic64_add(nr, &ra->hit_blocks);
+		bio_endio(bio);
+	}
+	return hit;
+}
+
+/*blocks are rewritten or freed, called after mapping is updated.*/
+void lbz_ra_invalidate(struct lbz_readahead *ra, unsigned int blkid, unsigned int nr_blks)
+{
+	struct lbz_ra_entry *entry, *next;
+	unsigned long flag = 0;
+	LIST_HEAD(free_list);
+
+	spin_lock_irqsave(&ra->lock, flag);
+	entry = __ra_search_range(ra, blkid, nr_blks);
+	while (entry && entry->blkid < blkid + nr_blks) {
+		next = __ra_next(entry);
+		__ra_unlink(ra, entry);
+		if (entry->state == LBZ_RA_FILLING)
+			entry->dead = true;
+		else
+			list_add(&entry->link, &free_list);
+		atomic64_inc(&ra->invalidations);
+		entry = next;
+	}
+	spin_unlock_irqrestore(&ra->lock, flag);
+
+	list_for_each_entry_safe(entry, next, &free_list, link)
+		__ra_free_entry(entry);
+}
+
+void lbz_ra_proc_read(struct lbz_readahead *ra, struct seq_file *seq)
+{
+	int i = 0;
+
+	seq_printf(seq, "nr_valid: %u\n"
+					"nr_filling: %u(max %u)\n"
+					"inflight: %d\n"
+					"windows: %lld\n"
+					"prefetch_bios: %lld\n"
+					"prefetch_blocks: %lld\n"
+					"hit_blocks: %lld\n"
+					"invalidations: %lld\n"
+					"evictions: %lld\n",
+					ra->nr_valid,
+					ra->nr_filling, LBZ_RA_MAX_PAGES,
+					atomic_read(&ra->inflight),
+					atomic64_read(&ra->windows),
+					atomic64_read(&ra->prefetch_bios),
+					atomic64_read(&ra->prefetch_blocks),
+					atomic64_read(&ra->hit_blocks),
+					atomic64_read(&ra->invalidations),
+					atomic64_read(&ra->evictions));
+	for (; i < LBZ_RA_MAX_STREAMS; i++)
+		seq_printf(seq, "stream[%d]: next_blkid(%u), seq(%u), ra_end(%u)\n", i,
+				ra->streams[i].next_blkid, ra->streams[i].seq, ra->streams[i].ra_end);
+}
+
+int lbz_ra_init(struct lbz_readahead *ra, struct lbz_device *dev)
+{
+	spin_lock_init(&ra->lock);
+	ra->tree = RB_ROOT;
+	INIT_LIST_HEAD(&ra->lru_list);
+	ra->nr_valid = ra->nr_filling = 0;
+	memset(ra->streams, 0, sizeof(ra->streams));
+	atomic_set(&ra->inflight, 0);
+	atomic64_set(&ra->windows, 0);
+	atomic64_set(&ra->prefetch_bios, 0);
+	atomic64_set(&ra->prefetch_blocks, 0);
+	atomic64_set(&ra->hit_blocks, 0);
+	atomic64_set(&ra->invalidations, 0);
+	atomic64_set(&ra->evictions, 0);
+	ra->host = dev;
+
+	return bioset_init(&ra->bio_set, BIO_POOL_SIZE, LBZ_RA_BIO_FRONT_PAD, BIOSET_NEED_BVECS);
+}
+
+/*user reads have completed, wait for prefetch bios.*/
+void lbz_ra_destroy(struct lbz_readahead *ra)
+{
+	struct lbz_ra_entry *entry, *next;
+	wait_queue_head_t wq;
+
+	init_waitqueue_head(&wq);
+	do {
+		wait_event_timeout(wq, atomic_read(&ra->inflight) == 0, HZ);
+	} while (atomic_read(&ra->inflight) != 0);
+
+	rbtree_postorder_for_each_entry_safe(entry, next, &ra->tree, node)
+		__ra_free_entry(entry);
+	ra->tree = RB_ROOT;
+	bioset_exit(&ra->bio_set);
+}
+#endif
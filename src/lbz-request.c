@@ -2,6 +2,8 @@
 #include "lbz-io-scheduler.h"
 #include "lbz-dev.h"
 #include "lbz-nat-sit.h"
+#include "lbz-write-buffer.h"
+#include <linux/sort.h>
 
 #define LBZ_MSG_PREFIX "lbz-request"
 
@@ -163,6 +165,7 @@ out:
 }
 /***************just for test io path***************/
 
+static void __lbz_submit_bio(struct lbz_device *dev, struct bio *bio);
 #ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
 struct lbz_flush_hook {
 	void *src_priv;
@@ -194,7 +197,7 @@ static void __lbz_submit_flush_bio_wait(struct lbz_device *dev, struct bio *bio)
 	bio->bi_end_io = lbz_flush_bio_endio;
 	bio->bi_opf |= REQ_SYNC;
 	current->bio_list = NULL;
-	lbz_submit_io_to_iosched(dev->iosched, bio);
+	__lbz_submit_bio(dev, bio); /*split at task boundary as other writes.*/
 	current->bio_list = bls;
 
 	/* Prevent hang_check timer from firing at us during very long I/O */
@@ -227,6 +230,9 @@ struct lbz_long_context {
 	atomic_t remaining;
 };
 
+static struct kmem_cache *lbz_long_ctx_cache;
+static mempool_t *lbz_long_ctx_pool;
+
 static void lbz_long_bio_endio(struct bio *bio)
 {
 	struct lbz_long_context *ctx = bio->bi_private;
@@ -239,21 +245,336 @@ static void lbz_long_bio_endio(struct bio *bio)
 		user_bio->bi_private = ctx->user_private_long;
 		user_bio->bi_end_io = ctx->user_endio_long;
 		bio_endio(user_bio);
-		LBZ_FREE_MEM(ctx, sizeof(struct lbz_long_context));
+		mempool_free(ctx, lbz_long_ctx_pool);
 	}
 	if (bio != user_bio)
 		bio_put(bio);
 
 }
 
-blk_qc_t lbz_dev_submit_bio(struct bio *bio)
+/*
+ * Sectors at the head of bio which one lbz task can carry. Read is resolved
+ * as a whole by iosched, see __submit_read_io. Write is bounded by zone append limit and segments of phy_bdev, the
+ * integrity logs (one page), the in-flight task shard and the nat/sit region
+ * which decides task type.
+ */
+static unsigned int __max_task_blks(struct lbz_device *dev, unsigned int blkid)
+{
+	struct request_queue *q = bdev_get_queue(dev->phy_bdev);
+	unsigned int blk_sectors = 1 << (LBZ_DATA_BLK_SHIFT - SECTOR_SHIFT);
+	unsigned int max_blks;
+
+	max_blks = min_t(unsigned int, PAGE_SIZE / dev->meta_bytes,
+			queue_max_zone_append_sectors(q) / blk_sectors);
+	max_blks = min(max_blks, lbz_task_shard_end(blkid) - blkid);
+#ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
+	max_blks = min(max_blks, lbz_nat_sit_region_end(dev->nat_sit_mgmt, blkid) - blkid);
+#endif
+	return max_blks;
+}
+
+static unsigned int __max_task_sectors(struct lbz_device *dev, struct bio *bio)
+{
+	struct request_queue *q = bdev_get_queue(dev->phy_bdev);
+	unsigned int blk_sectors = 1 << (LBZ_DATA_BLK_SHIFT - SECTOR_SHIFT);
+	unsigned int max_blks, sectors = 0, segs = 0;
+	struct bio_vec bv;
+	struct bvec_iter iter;
+
+	if (bio_data_dir(bio) == READ)
+		return bio_sectors(bio);
+
+	max_blks = __max_task_blks(dev, sector_to_blkid(bio->bi_iter.bi_sector));
+	bio_for_each_segment(bv, bio, iter) {
+		if (++segs > queue_max_segments(q) || sectors >= max_blks * blk_sectors)
+			break;
+		sectors += bv.bv_len >> SECTOR_SHIFT;
+	}
+	sectors = min(sectors, max_blks * blk_sectors);
+	return max(round_down(sectors, blk_sectors), blk_sectors);
+}
+
+/*
+ * Write coalescing: f2fs flushes nat/sit/ssa blocks in bursts of small writes
+ * under one plug. Bio frontend parks small plain writes in a plug callback,
+ * at unplug adjacent ones are merged into one bio which becomes a single
+ * multi-block append task, blkid of every block is mapped from append result
+ * by lbz_write_io_endio as any multi-block write. blk-mq frontend gets the
+ * same from request merging, see lbz_mq_queue_rq.
+ */
+struct lbz_plug_ent {
+	struct bio *bio;
+	unsigned int seq; /*arrival order, keeps sort stable.*/
+};
+
+struct lbz_plug_cb {
+	struct blk_plug_cb cb; /*cb.data is lbz_device.*/
+	struct work_struct work; /*unplug from schedule is punted here.*/
+	unsigned int count;
+	struct lbz_plug_ent ents[LBZ_PLUG_MAX_BIOS];
+};
+
+static struct workqueue_struct *lbz_plug_wq;
+
+static void lbz_coalesce_bio_endio(struct bio *bio)
+{
+	struct lbz_coalesce_bio *cbio = container_of(bio, struct lbz_coalesce_bio, bio);
+	struct bio *member;
+
+	while ((member = bio_list_pop(&cbio->members))) {
+		member->bi_status = bio->bi_status;
+		bio_endio(member);
+	}
+	bio_put(bio);
+}
+
+static struct bio *__alloc_coalesce_bio(struct lbz_device *dev, struct bio *head, unsigned int nr_segs)
+{
+	struct bio *bio = bio_alloc_bioset(GFP_NOIO, nr_segs, &dev->coalesce_bio_set);
+
+	bio_set_dev(bio, head->bi_bdev);
+	bio->bi_opf = head->bi_opf;
+	bio->bi_iter.bi_sector = head->bi_iter.bi_sector;
+	bio_list_init(&container_of(bio, struct lbz_coalesce_bio, bio)->members);
+	return bio;
+}
+
+/*member must be adjacent to the tail of bio, and bio has room for its segments.*/
+static void __add_coalesce_pages(struct bio *bio, struct bio *member)
+{
+	struct bio_vec bv;
+	struct bvec_iter iter;
+
+	bio->bi_opf |= member->bi_opf & ~REQ_OP_MASK;
+	bio_for_each_segment(bv, member, iter)
+		__bio_add_page(bio, bv.bv_page, bv.bv_len, bv.bv_offset);
+}
+
+static int __plug_ent_cmp(const void *a, const void *b)
+{
+	const struct lbz_plug_ent *ea = a, *eb = b;
+
+	if (ea->bio->bi_iter.bi_sector != eb->bio->bi_iter.bi_sector)
+		return ea->bio->bi_iter.bi_sector < eb->bio->bi_iter.bi_sector ? -1 : 1;
+	return ea->seq < eb->seq ? -1 : 1;
+}
+
+/*
+ * sort parked writes by sector and merge runs of adjacent ones, a run never
+ * goes beyond what one task can carry, see __max_task_sectors.
+ */
+static void __lbz_flush_plug(struct lbz_device *dev, struct lbz_plug_cb *plug)
+{
+	struct request_queue *q = bdev_get_queue(dev->phy_bdev);
+	unsigned int max_segs = min_t(unsigned int, queue_max_segments(q), BIO_MAX_VECS);
+	unsigned int i = 0, j, nr_segs, sectors, max_sectors;
+	struct bio *bio, *next, *cbio;
+
+	sort(plug->ents, plug->count, sizeof(struct lbz_plug_ent), __plug_ent_cmp, NULL);
+	while (i < plug->count) {
+		bio = plug->ents[i].bio;
+		nr_segs = bio_segments(bio);
+		sectors = bio_sectors(bio);
+		max_sectors = blkid_to_sector(__max_task_blks(dev, sector_to_blkid(bio->bi_iter.bi_sector)));
+		for (j = i + 1; j < plug->count; j++) {
+			next = plug->ents[j].bio;
+			if (next->bi_iter.bi_sector != bio->bi_iter.bi_sector + sectors ||
+					sectors + bio_sectors(next) > max_sectors ||
+					nr_segs + bio_segments(next) > max_segs)
+				break;
+			sectors += bio_sectors(next);
+			nr_segs += bio_segments(next);
+		}
+		if (j == i + 1) {
+			__lbz_submit_bio(dev, bio);
+			i++;
+			continue;
+		}
+
+		cbio = __alloc_coalesce_bio(dev, bio, nr_segs);
+		cbio->bi_end_io = lbz_coalesce_bio_endio;
+		for (; i < j; i++) {
+			__add_coalesce_pages(cbio, plug->ents[i].bio);
+			bio_list_add(&container_of(cbio, struct lbz_coalesce_bio, bio)->members, plug->ents[i].bio);
+			atomic64_inc(&dev->user_write_coalesced_bios);
+		}
+		__lbz_submit_bio(dev, cbio);
+	}
+	plug->count = 0;
+}
+
+static void lbz_unplug_wk_fn(struct work_struct *work)
+{
+	struct lbz_plug_cb *plug = container_of(work, struct lbz_plug_cb, work);
+
+	__lbz_flush_plug(plug->cb.data, plug);
+	kfree(plug);
+}
+
+static void lbz_unplug(struct blk_plug_cb *cb, bool from_schedule)
+{
+	struct lbz_plug_cb *plug = container_of(cb, struct lbz_plug_cb, cb);
+
+	/*submit may sleep on mempool, which is not allowed when task is going to schedule.*/
+	if (from_schedule) {
+		INIT_WORK(&plug->work, lbz_unplug_wk_fn);
+		queue_work(lbz_plug_wq, &plug->work);
+		return;
+	}
+	__lbz_flush_plug(cb->data, plug);
+	kfree(plug);
+}
+
+/*
+ * park write in the plug of current task, return false if it should be
+ * submitted directly: not plugged, flush/fua, or big enough for one task.
+ */
+static bool __lbz_plug_write(struct lbz_device *dev, struct bio *bio)
+{
+	struct blk_plug_cb *cb;
+	struct lbz_plug_cb *plug;
+
+	if (bio_op(bio) != REQ_OP_WRITE || (bio->bi_opf & (REQ_PREFLUSH | REQ_FUA)) ||
+			bio_sectors(bio) >= __max_task_sectors(dev, bio))
+		return false;
+#ifdef CONFIG_LBZ_WRITE_BUFFER_SUPPORT
+	/*absorbed by write buffer, don't merge it away.*/
+	if (lbz_wb_bufferable(dev->wb, bio))
+		return false;
+#endif
+	cb = blk_check_plugged(lbz_unplug, dev, sizeof(struct lbz_plug_cb));
+	if (!cb)
+		return false;
+	plug = container_of(cb, struct lbz_plug_cb, cb);
+	plug->ents[plug->count].bio = bio;
+	plug->ents[plug->count].seq = plug->count;
+	if (++plug->count == LBZ_PLUG_MAX_BIOS)
+		__lbz_flush_plug(dev, plug);
+	return true;
+}
+
+/*flush_bio is embedded in ctx, only one device flush is in flight.*/
+static void lbz_flush_ctx_endio(struct bio *bio);
+static void __issue_device_flush(struct lbz_flush_ctx *fctx)
+{
+	struct lbz_device *dev = fctx->host;
+	struct bio *bio = &fctx->flush_bio;
+
+	bio_init(bio, NULL, 0);
+	bio_set_dev(bio, dev->phy_bdev);
+	bio->bi_opf = REQ_OP_WRITE | REQ_PREFLUSH | REQ_SYNC;
+	bio->bi_private = fctx;
+	bio->bi_end_io = lbz_flush_ctx_endio;
+	atomic64_inc(&fctx->device_flushes);
+	submit_bio(bio);
+}
+
+static void lbz_flush_ctx_endio(struct bio *bio)
+{
+	struct lbz_flush_ctx *fctx = bio->bi_private;
+	blk_status_t status = bio->bi_status;
+	struct bio_list done;
+	struct bio *user;
+	unsigned long flag = 0;
+	bool reissue = false;
+
+	if (status)
+		LBZERR("device flush encounter: %d", blk_status_to_errno(status));
+	bio_uninit(bio);
+	bio_list_init(&done);
+	spin_lock_irqsave(&fctx->lock, flag);
+	bio_list_merge(&done, &fctx->inflight);
+	bio_list_init(&fctx->inflight);
+	/*flushes arrived during this one, they need a new one.*/
+	if (!bio_list_empty(&fctx->waiting)) {
+		bio_list_merge(&fctx->inflight, &fctx->waiting);
+		bio_list_init(&fctx->waiting);
+		reissue = true;
+	} else {
+		fctx->flushing = false;
+	}
+	spin_unlock_irqrestore(&fctx->lock, flag);
+
+	/*submit_bio may sleep, not in endio.*/
+	if (reissue)
+		queue_work(fctx->flush_wq, &fctx->flush_wk);
+	while ((user = bio_list_pop(&done))) {
+		user->bi_status = status;
+		bio_endio(user);
+	}
+}
+
+static void flush_wk_fn(struct work_struct *work)
+{
+	__issue_device_flush(container_of(work, struct lbz_flush_ctx, flush_wk));
+}
+
+void lbz_dev_flush(struct lbz_device *dev, struct bio *bio)
+{
+	struct lbz_flush_ctx *fctx = dev->flush_ctx;
+	unsigned long flag = 0;
+	bool issue = false;
+
+	atomic64_inc(&fctx->user_flushes);
+	spin_lock_irqsave(&fctx->lock, flag);
+	if (!fctx->flushing) {
+		bio_list_add(&fctx->inflight, bio);
+		fctx->flushing = true;
+		issue = true;
+	} else {
+		bio_list_add(&fctx->waiting, bio);
+	}
+	spin_unlock_irqrestore(&fctx->lock, flag);
+	if (issue)
+		__issue_device_flush(fctx);
+}
+
+void lbz_flush_proc_read(struct lbz_flush_ctx *fctx, struct seq_file *seq)
+{
+	seq_printf(seq, "flushing: %d\n"
+					"user_flushes: %lld\n"
+					"device_flushes: %lld\n",
+					fctx->flushing,
+					atomic64_read(&fctx->user_flushes),
+					atomic64_read(&fctx->device_flushes));
+}
+
+int lbz_flush_ctx_init(struct lbz_flush_ctx *fctx, struct lbz_device *dev)
+{
+	spin_lock_init(&fctx->lock);
+	bio_list_init(&fctx->waiting);
+	bio_list_init(&fctx->inflight);
+	fctx->flushing = false;
+	atomic64_set(&fctx->user_flushes, 0);
+	atomic64_set(&fctx->device_flushes, 0);
+	fctx->host = dev;
+	fctx->flush_wq = alloc_workqueue("%s_flush", WQ_MEM_RECLAIM | WQ_HIGHPRI, 1, dev->devname);
+	if (!fctx->flush_wq)
+		return -ENOMEM;
+	INIT_WORK(&fctx->flush_wk, flush_wk_fn);
+	return 0;
+}
+
+void lbz_flush_ctx_destroy(struct lbz_flush_ctx *fctx)
+{
+	wait_queue_head_t wq;
+
+	init_waitqueue_head(&wq);
+	do {
+		wait_event_timeout(wq, !READ_ONCE(fctx->flushing), HZ);
+	} while (READ_ONCE(fctx->flushing));
+	destroy_workqueue(fctx->flush_wq);
+}
+
+/*
+ * Handle one bio of lbz device, shared by bio and blk-mq frontends.
+ */
+static void __lbz_handle_bio(struct lbz_device *dev, struct bio *bio)
 {
 	/*
 	 * struct lbz_device *d = bio->bi_bdev->bd_disk->private_data;
 	 * struct lbz_bio_hook *hook;
 	 */
-	struct lbz_device *dev = bio->bi_bdev->bd_disk->private_data;
-	unsigned max_sectors = 1 << (LBZ_DATA_BLK_SHIFT - SECTOR_SHIFT);
 	unsigned int blkid = sector_to_blkid(bio->bi_iter.bi_sector);
 
 	if (op_is_flush(bio->bi_opf)) {
@@ -272,29 +593,44 @@ blk_qc_t lbz_dev_submit_bio(struct bio *bio)
 #endif
 
 		LBZDEBUG("receive write flush: %u", blkid);
-		/*return directly for flush bio without data, which may be issued by blkdev_issue_flush.*/
+		/*flush bio without data, which may be issued by blkdev_issue_flush.*/
 		if (!bio_has_data(bio)) {
-			bio_endio(bio);
-			return BLK_QC_T_NONE;
+#ifdef CONFIG_LBZ_WRITE_BUFFER_SUPPORT
+			/*wait for blocks buffered before it first.*/
+			if (lbz_wb_handle_bio(dev->wb, bio))
+				return;
+#endif
+			lbz_dev_flush(dev, bio);
+			return;
 		}
 #ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
 		if (lbz_nat_sit_is_cp_block(dev->nat_sit_mgmt, blkid)) {
 #ifdef CONFIG_LBZ_NAT_SIT_FREE_SUPPORT
 			__lbz_submit_flush_bio_wait(dev, bio);
 #else
-			lbz_submit_io_to_iosched(dev->iosched, bio);
+			__lbz_submit_bio(dev, bio);
 #endif
 			lbz_nat_sit_set_cur_cp(dev->nat_sit_mgmt, blkid);
-			return BLK_QC_T_NONE;
+			return;
 		}
 #endif
 	}
 
 	if (!bio_has_data(bio) || is_dev_faulty(dev) || !is_dev_ready(dev)) {
 		bio_endio(bio);
-		return BLK_QC_T_NONE;
+		return;
 	}
 
+	if (!queue_is_mq(dev->disk->queue) && __lbz_plug_write(dev, bio))
+		return;
+	__lbz_submit_bio(dev, bio);
+}
+
+/*split bio at task boundary and submit every piece to iosched.*/
+static void __lbz_submit_bio(struct lbz_device *dev, struct bio *bio)
+{
+	unsigned max_sectors;
+
 #if 0
 	if (bio_sectors(bio) > max_sectors) {
 		struct bio *split = bio_split(bio, max_sectors, GFP_NOIO, &dev->bio_split);
@@ -305,16 +641,17 @@ blk_qc_t lbz_dev_submit_bio(struct bio *bio)
 		bio = split;
 	}
 #endif
+	max_sectors = __max_task_sectors(dev, bio);
 	if (bio_sectors(bio) > max_sectors) {
 		struct lbz_long_context *ctx;
 
-		LBZ_ALLOC_MEM(ctx, sizeof(struct lbz_long_context), GFP_NOIO);
+		ctx = mempool_alloc(lbz_long_ctx_pool, GFP_NOIO);
 		ctx->user_bio_long = bio;
 		ctx->user_endio_long = bio->bi_end_io;
 		ctx->user_private_long = bio->bi_private;
 		atomic_set(&ctx->remaining, 1);
 
-		while (bio_sectors(bio) > max_sectors) {
+		do {
 			struct bio *split = bio_split(bio, max_sectors, GFP_NOIO, &dev->bio_split);
 
 			LBZDEBUG("receive bio bi_size: %u, bi_vcnt:%d", bio->bi_iter.bi_size, bio->bi_vcnt);
@@ -323,7 +660,8 @@ blk_qc_t lbz_dev_submit_bio(struct bio *bio)
 			split->bi_end_io = lbz_long_bio_endio;
 
 			lbz_submit_io_to_iosched(dev->iosched, split);
-		}
+			max_sectors = __max_task_sectors(dev, bio);
+		} while (bio_sectors(bio) > max_sectors);
 		bio->bi_private = ctx;
 		bio->bi_end_io = lbz_long_bio_endio;
 	}
@@ -342,7 +680,7 @@ blk_qc_t lbz_dev_submit_bio(struct bio *bio)
 	/*clone_and_prep_request(bio);*/
 	//LBZINFO("bio->bi_max_vecs : %d", bio->bi_max_vecs);
 	//clone_and_prep_request(bio);
-	return BLK_QC_T_NONE;
+	return;
 	/*endio immediately.*/
 	/*bio_endio(bio); */
 	/* try to send bio by blk_integrity related func, but it doesn't work, because it only
@@ -364,3 +702,169 @@ blk_qc_t lbz_dev_submit_bio(struct bio *bio)
 	 */
 	//return BLK_QC_T_NONE;
 }
+
+blk_qc_t lbz_dev_submit_bio(struct bio *bio)
+{
+	__lbz_handle_bio(bio->bi_bdev->bd_disk->private_data, bio);
+	return BLK_QC_T_NONE;
+}
+
+#ifdef CONFIG_LBZ_BLK_MQ_SUPPORT
+/*
+ * blk-mq frontend: every bio of request is cloned and goes through the same
+ * path as bio frontend, request ends when all clones complete. The tag set
+ * bounds requests in flight per hardware queue, and retry of writes waiting
+ * for space is kept per hardware queue by iosched retry ctx.
+ */
+static void lbz_mq_bio_endio(struct bio *bio)
+{
+	struct request *rq = bio->bi_private;
+	struct lbz_mq_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	if (bio->bi_status && !cmd->status)
+		cmd->status = bio->bi_status;
+	bio_put(bio);
+	if (atomic_dec_and_test(&cmd->remaining))
+		blk_mq_end_request(rq, cmd->status);
+}
+
+static blk_status_t lbz_mq_queue_rq(struct blk_mq_hw_ctx *hctx,
+		const struct blk_mq_queue_data *bd)
+{
+	struct lbz_device *dev = hctx->queue->queuedata;
+	struct request *rq = bd->rq;
+	struct lbz_mq_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	struct bio *bio, *clone;
+	unsigned int nr_segs = 0;
+
+	blk_mq_start_request(rq);
+	cmd->status = BLK_STS_OK;
+	atomic_set(&cmd->remaining, 1);
+	/*
+	 * flush without data carries no bio, it takes an empty one and shares
+	 * device flush with bio frontend, request ends when that flush completes.
+	 */
+	if (req_op(rq) == REQ_OP_FLUSH) {
+		clone = bio_alloc_bioset(GFP_NOIO, 0, &dev->mq_bio_set);
+		bio_set_dev(clone, dev->disk->part0);
+		clone->bi_opf = REQ_OP_WRITE | REQ_PREFLUSH | REQ_SYNC;
+		clone->bi_private = rq;
+		clone->bi_end_io = lbz_mq_bio_endio;
+		atomic_inc(&cmd->remaining);
+		__lbz_handle_bio(dev, clone);
+		goto out;
+	}
+	/*merged write is appended as one bio, split at task boundary as usual.*/
+	if (req_op(rq) == REQ_OP_WRITE && rq->bio != rq->biotail) {
+		__rq_for_each_bio(bio, rq)
+			nr_segs += bio_segments(bio);
+	}
+	if (nr_segs > 0 && nr_segs <= BIO_MAX_VECS) {
+		clone = __alloc_coalesce_bio(dev, rq->bio, nr_segs);
+		clone->bi_opf &= ~REQ_HIPRI;
+		__rq_for_each_bio(bio, rq) {
+			__add_coalesce_pages(clone, bio);
+			atomic64_inc(&dev->user_write_coalesced_bios);
+		}
+		clone->bi_private = rq;
+		clone->bi_end_io = lbz_mq_bio_endio;
+		atomic_inc(&cmd->remaining);
+		__lbz_handle_bio(dev, clone);
+		goto out;
+	}
+	__rq_for_each_bio(bio, rq) {
+		clone = bio_clone_fast(bio, GFP_NOIO, &dev->mq_bio_set);
+		/*only reads are tracked for lbz_mq_poll, others complete by interrupt.*/
+		if (bio_op(clone) != REQ_OP_READ)
+			clone->bi_opf &= ~REQ_HIPRI;
+		clone->bi_private = rq;
+		clone->bi_end_io = lbz_mq_bio_endio;
+		atomic_inc(&cmd->remaining);
+		__lbz_handle_bio(dev, clone);
+	}
+out:
+	if (atomic_dec_and_test(&cmd->remaining))
+		blk_mq_end_request(rq, cmd->status);
+	return BLK_STS_OK;
+}
+
+/*default queues first, then poll queues, no read queues.*/
+static int lbz_mq_map_queues(struct blk_mq_tag_set *set)
+{
+	struct blk_mq_queue_map *map;
+	unsigned int offset = 0;
+	int i = 0;
+
+	for (; i < set->nr_maps; i++) {
+		map = &set->map[i];
+		if (i == HCTX_TYPE_DEFAULT)
+			map->nr_queues = set->nr_hw_queues - LBZ_MQ_POLL_QUEUES;
+		else if (i == HCTX_TYPE_POLL)
+			map->nr_queues = LBZ_MQ_POLL_QUEUES;
+		else
+			map->nr_queues = 0;
+		map->queue_offset = offset;
+		offset += map->nr_queues;
+		if (map->nr_queues)
+			blk_mq_map_queues(map);
+	}
+	return 0;
+}
+
+/*
+ * Runs of polled read go to poll queues of phy_bdev, which have no interrupt,
+ * so lbz can't tell which of them holds a run. While any polled read is in
+ * flight, every poll of lbz polls all poll queues of phy_bdev once. If
+ * phy_bdev has no poll queue, block layer clears REQ_HIPRI and runs complete
+ * by interrupt.
+ */
+static int lbz_mq_poll(struct blk_mq_hw_ctx *hctx)
+{
+	struct lbz_device *dev = hctx->queue->queuedata;
+	struct request_queue *q = bdev_get_queue(dev->phy_bdev);
+	struct blk_mq_queue_map *map;
+	unsigned int i = 0;
+	int found = 0;
+
+	if (atomic64_read(&dev->user_read_polled_inflight) == 0 ||
+			!test_bit(QUEUE_FLAG_POLL, &q->queue_flags))
+		return 0;
+	map = &q->tag_set->map[HCTX_TYPE_POLL];
+	for (; i < map->nr_queues; i++)
+		found += blk_poll(q, (map->queue_offset + i) << BLK_QC_T_SHIFT, false);
+	return found;
+}
+
+const struct blk_mq_ops lbz_mq_ops = {
+	.queue_rq	= lbz_mq_queue_rq,
+	.map_queues	= lbz_mq_map_queues,
+	.poll		= lbz_mq_poll,
+};
+#endif
+
+void lbz_request_cache_exit(void)
+{
+	destroy_workqueue(lbz_plug_wq);
+	mempool_destroy(lbz_long_ctx_pool);
+	kmem_cache_destroy(lbz_long_ctx_cache);
+}
+
+int lbz_request_cache_init(void)
+{
+	lbz_long_ctx_cache = KMEM_CACHE(lbz_long_context, 0);
+	if (!lbz_long_ctx_cache)
+		return -ENOMEM;
+	lbz_long_ctx_pool = mempool_create_slab_pool(BIO_POOL_SIZE, lbz_long_ctx_cache);
+	if (!lbz_long_ctx_pool)
+		goto pool_err;
+	/*unplug from schedule writes back, may be in reclaim.*/
+	lbz_plug_wq = alloc_workqueue("lbz_plug", WQ_MEM_RECLAIM | WQ_UNBOUND, 0);
+	if (!lbz_plug_wq)
+		goto wq_err;
+	return 0;
+wq_err:
+	mempool_destroy(lbz_long_ctx_pool);
+pool_err:
+	kmem_cache_destroy(lbz_long_ctx_cache);
+	return -ENOMEM;
+}
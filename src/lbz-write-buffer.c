@@ -0,0 +1,551 @@
+#include "lbz-dev.h"
+#include "lbz-io-scheduler.h"
+#include "lbz-nat-sit.h"
+#include "lbz-request.h"
+#include "lbz-write-buffer.h"
+
+#define LBZ_MSG_PREFIX "lbz-write-buffer"
+
+#ifdef CONFIG_LBZ_WRITE_BUFFER_SUPPORT
+#define LBZ_WB_FLUSH_BATCH (64)
+
+/*must be locked by caller.*/
+static struct lbz_wb_entry *__wb_search(struct lbz_write_buffer *wb, unsigned int blkid)
+{
+	struct rb_node *n = wb->tree.rb_node;
+	struct lbz_wb_entry *entry;
+
+	while (n) {
+		entry = rb_entry(n, struct lbz_wb_entry, node);
+		if (blkid < entry->blkid)
+			n = n->rb_left;
+		else if (blkid > entry->blkid)
+			n = n->rb_right;
+		else
+			return entry;
+	}
+	return NULL;
+}
+
+/*first entry in [blkid, blkid + nr_blks), must be locked by caller.*/
+static struct lbz_wb_entry *__wb_search_range(struct lbz_write_buffer *wb,
+		unsigned int blkid, unsigned int nr_blks)
+{
+	struct rb_node *n = wb->tree.rb_node;
+	struct lbz_wb_entry *entry, *found = NULL;
+
+	while (n) {
+		entry = rb_entry(n, struct lbz_wb_entry, node);
+		if (entry->blkid >= blkid) {
+			found = entry;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+	if (found && found->blkid < blkid + nr_blks)
+		return found;
+	return NULL;
+}
+
+static void __wb_link(struct lbz_write_buffer *wb, struct lbz_wb_entry *new)
+{
+	struct rb_node **p = &wb->tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct lbz_wb_entry *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct lbz_wb_entry, node);
+		if (new->blkid < entry->blkid)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, &wb->tree);
+}
+
+/*
+ * entry must be written back before anything else touches its block: a
+ * preflush bio waits for it, or direct writes are deferred behind it.
+ */
+static inline bool __wb_urgent(struct lbz_wb_entry *entry)
+{
+	return entry->fence || !bio_list_empty(&entry->deferred);
+}
+
+/*dirty entry superseded by a direct write, must be locked by caller.*/
+static void __wb_drop(struct lbz_write_buffer *wb, struct lbz_wb_entry *entry)
+{
+	rb_erase(&entry->node, &wb->tree);
+	list_del_init(&entry->link);
+	wb->nr_dirty--;
+	wb->nr_pages--;
+	__free_page(entry->page);
+	LBZ_FREE_MEM(entry, sizeof(struct lbz_wb_entry));
+}
+
+static void __copy_from_bio(struct page *page, struct bio *bio)
+{
+	char *dst = page_address(page), *src;
+	struct bio_vec bv;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bv, bio, iter) {
+		src = kmap_atomic(bv.bv_page);
+		memcpy(dst, src + bv.bv_offset, bv.bv_len);
+		kunmap_atomic(src);
+		dst += bv.bv_len;
+	}
+}
+
+static void __copy_to_bio(struct bio *bio, struct page *page)
+{
+	char *src = page_address(page), *dst;
+	struct bio_vec bv;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bv, bio, iter) {
+		dst = kmap_atomic(bv.bv_page);
+		memcpy(dst + bv.bv_offset, src, bv.bv_len);
+		kunmap_atomic(dst);
+		src += bv.bv_len;
+	}
+}
+
+/*one plain block write to cp/sit/nat area.*/
+bool lbz_wb_bufferable(struct lbz_write_buffer *wb, struct bio *bio)
+{
+#ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
+	struct lbz_device *dev = wb->host;
+	struct lbz_nat_sit_mgmt *mgmt = dev->nat_sit_mgmt;
+	unsigned int blkid = sector_to_blkid(bio->bi_iter.bi_sector);
+#endif
+
+	if (bio_op(bio) != REQ_OP_WRITE || (bio->bi_opf & (REQ_PREFLUSH | REQ_FUA)) ||
+			bio->bi_iter.bi_size != LBZ_DATA_BLK_SIZE)
+		return false;
+#ifdef CONFIG_LBZ_NAT_SIT_SUPPORT
+	return blkid >= mgmt->cp_blkaddr && blkid < mgmt->nat_blkaddr + mgmt->nat_blocks;
+#else
+	return true;
+#endif
+}
+
+/*
+ * Multi-block read goes to device as a whole if none of its blocks is
+ * buffered, otherwise it's read block by block.
+ */
+static bool __wb_read_range(struct lbz_write_buffer *wb, struct bio *bio)
+{
+	struct lbz_device *dev = wb->host;
+	unsigned int blkid = sector_to_blkid(bio->bi_iter.bi_sector);
+	unsigned int end = sector_to_blkid(bio_end_sector(bio));
+	unsigned long flag = 0;
+	struct bio *split;
+	bool hit = false;
+
+	spin_lock_irqsave(&wb->lock, flag);
+	for (; blkid < end && !hit; blkid++)
+		hit = __wb_search(wb, blkid) != NULL;
+	spin_unlock_irqrestore(&wb->lock, flag);
+	if (!hit)
+		return false;
+
+	while (bio->bi_iter.bi_size > LBZ_DATA_BLK_SIZE) {
+		split = bio_split(bio, LBZ_DATA_BLK_SIZE >> SECTOR_SHIFT, GFP_NOIO, &dev->bio_split);
+		bio_chain(split, bio);
+		lbz_submit_io_to_iosched(dev->iosched, split);
+	}
+	lbz_submit_io_to_iosched(dev->iosched, bio);
+	return true;
+}
+
+static bool __wb_read(struct lbz_write_buffer *wb, struct bio *bio)
+{
+	struct lbz_wb_entry *entry;
+	unsigned long flag = 0;
+	bool hit = false;
+
+	if (bio->bi_iter.bi_size != LBZ_DATA_BLK_SIZE)
+		return __wb_read_range(wb, bio);
+	spin_lock_irqsave(&wb->lock, flag);
+	entry = __wb_search(wb, sector_to_blkid(bio->bi_iter.bi_sector));
+	if (entry) {
+		__copy_to_bio(bio, entry->pending ? entry->pending : entry->page);
+		hit = true;
+	}
+	spin_unlock_irqrestore(&wb->lock, flag);
+	if (hit) {
+		atomic64_inc(&wb->read_hits);
+		bio_endio(bio);
+	}
+	return hit;
+}
+
+/*
+ * Buffered write is completed at once. Direct write drops dirty copies of
+ * its blocks, and is deferred behind a block being written back (or one a
+ * preflush bio waits for), so it never lands before older data of the block.
+ * Once a write is deferred on a block, later writes of it are deferred too.
+ */
+static bool __wb_write(struct lbz_write_buffer *wb, struct bio *bio)
+{
+	unsigned int blkid = sector_to_blkid(bio->bi_iter.bi_sector);
+	unsigned int nr_blks = bio_sectors(bio) >> (LBZ_DATA_BLK_SHIFT - SECTOR_SHIFT);
+	bool bufferable = lbz_wb_bufferable(wb, bio), absorbed = false, taken = false, kick = false;
+	struct lbz_wb_entry *entry, *new = NULL;
+	struct page *page = NULL;
+	unsigned long flag = 0;
+
+	if (bufferable) {
+		LBZ_ALLOC_MEM(new, sizeof(struct lbz_wb_entry), GFP_NOIO);
+		page = alloc_page(GFP_NOIO);
+		bufferable = new != NULL && page != NULL;
+	}
+
+	spin_lock_irqsave(&wb->lock, flag);
+	entry = __wb_search_range(wb, blkid, nr_blks);
+	if (bufferable && entry != NULL && bio_list_empty(&entry->deferred)) {
+		if (entry->state == LBZ_WB_DIRTY) {
+			__copy_from_bio(entry->page, bio);
+			/*urgent ones stay at head, see wb_wk_fn.*/
+			if (!__wb_urgent(entry))
+				list_move_tail(&entry->link, &wb->dirty_list);
+		} else {
+			if (entry->pending == NULL) {
+				entry->pending = page;
+				page = NULL;
+				wb->nr_pages++;
+			}
+			__copy_from_bio(entry->pending, bio);
+		}
+		atomic64_inc(&wb->overwrites);
+		absorbed = true;
+	} else if (bufferable && entry == NULL && wb->nr_pages < LBZ_WB_MAX_PAGES) {
+		new->blkid = blkid;
+		new->state = LBZ_WB_DIRTY;
+		new->fence = false;
+		new->page = page;
+		new->pending = NULL;
+		new->wb = wb;
+		bio_list_init(&new->deferred);
+		__copy_from_bio(page, bio);
+		__wb_link(wb, new);
+		list_add_tail(&new->link, &wb->dirty_list);
+		wb->nr_pages++;
+		wb->nr_dirty++;
+		new = NULL;
+		page = NULL;
+		absorbed = true;
+	} else {
+		while (entry != NULL) {
+			if (entry->state == LBZ_WB_DIRTY && !__wb_urgent(entry)) {
+				__wb_drop(wb, entry);
+				entry = __wb_search_range(wb, blkid, nr_blks);
+				continue;
+			}
+			/*dirty one becomes urgent, keep urgent ones at head.*/
+			if (entry->state == LBZ_WB_DIRTY)
+				list_move(&entry->link, &wb->dirty_list);
+			bio_list_add(&entry->deferred, bio);
+			kick = true;
+			atomic64_inc(&wb->deferred_writes);
+			taken = true;
+			break;
+		}
+	}
+	kick = kick || wb->nr_pages >= LBZ_WB_HIGH_WM;
+	spin_unlock_irqrestore(&wb->lock, flag);
+
+	if (new)
+		LBZ_FREE_MEM(new, sizeof(struct lbz_wb_entry));
+	if (page)
+		__free_page(page);
+	if (kick)
+		queue_work(wb->wb_wq, &wb->wb_wk);
+	if (absorbed) {
+		atomic64_inc(&wb->absorbed_writes);
+		bio_endio(bio);
+	}
+	return absorbed || taken;
+}
+
+/*preflush bio waits until blocks buffered before it are written back.*/
+static bool __wb_barrier(struct lbz_write_buffer *wb, struct bio *bio)
+{
+	unsigned long flag = 0;
+
+	spin_lock_irqsave(&wb->lock, flag);
+	if (wb->nr_dirty == 0 && wb->nr_flushing == 0 &&
+			bio_list_empty(&wb->barrier_bios) && bio_list_empty(&wb->barrier_wait)) {
+		spin_unlock_irqrestore(&wb->lock, flag);
+		return false;
+	}
+	bio_list_add(&wb->barrier_bios, bio);
+	spin_unlock_irqrestore(&wb->lock, flag);
+	queue_work(wb->wb_wq, &wb->wb_wk);
+	return true;
+}
+
+/*
+ * return true if bio is taken by buffer, it's completed, deferred or waits
+ * for write back.
+ */
+bool lbz_wb_handle_bio(struct lbz_write_buffer *wb, struct bio *bio)
+{
+	/*empty flush is REQ_OP_FLUSH, which looks like read.*/
+	if (bio->bi_opf & REQ_PREFLUSH)
+		return __wb_barrier(wb, bio);
+	if (!bio_has_data(bio))
+		return false;
+	if (bio_data_dir(bio) == READ)
+		return __wb_read(wb, bio);
+	return __wb_write(wb, bio);
+}
+
+/*
+ * Preflush bios are done with the fence, must be locked by caller. They fail
+ * if any write back failed since last release, so the error reaches fsync.
+ */
+static void __wb_release_barrier(struct lbz_write_buffer *wb, struct bio_list *bios)
+{
+	struct bio *bio;
+
+	if (wb->wb_error) {
+		bio_list_for_each(bio, bios)
+			bio->bi_status = wb->wb_error;
+		wb->wb_error = BLK_STS_OK;
+	}
+	bio_list_merge(&wb->released, bios);
+	bio_list_init(bios);
+}
+
+static void lbz_wb_flush_endio(struct bio *bio)
+{
+	struct lbz_wb_entry *entry = bio->bi_private;
+	struct lbz_write_buffer *wb = entry->wb;
+	struct page *page = entry->page;
+	bool free_entry = false, kick = false;
+	unsigned long flag = 0;
+
+	if (bio->bi_status) {
+		LBZERR("write back block: %u encounter: %d", entry->blkid, bio->bi_status);
+		atomic64_inc(&wb->wb_errors);
+	}
+
+	spin_lock_irqsave(&wb->lock, flag);
+	if (bio->bi_status)
+		wb->wb_error = bio->bi_status;
+	list_del_init(&entry->link);
+	wb->nr_flushing--;
+	wb->nr_pages--;
+	if (entry->pending) {
+		/*rewrite during flushing, deferred writes still wait for it.*/
+		entry->page = entry->pending;
+		entry->pending = NULL;
+		entry->state = LBZ_WB_DIRTY;
+		wb->nr_dirty++;
+		if (__wb_urgent(entry)) {
+			list_add(&entry->link, &wb->dirty_list);
+			kick = true;
+		} else {
+			list_add_tail(&entry->link, &wb->dirty_list);
+		}
+	} else {
+		if (!bio_list_empty(&entry->deferred)) {
+			bio_list_merge(&wb->resubmit, &entry->deferred);
+			bio_list_init(&entry->deferred);
+			kick = true;
+		}
+		rb_erase(&entry->node, &wb->tree);
+		free_entry = true;
+		if (entry->fence && --wb->fence_count == 0) {
+			__wb_release_barrier(wb, &wb->barrier_wait);
+			kick = true;
+		}
+	}
+	if (wb->draining || !bio_list_empty(&wb->barrier_bios))
+		kick = true;
+	spin_unlock_irqrestore(&wb->lock, flag);
+
+	__free_page(page);
+	if (free_entry)
+		LBZ_FREE_MEM(entry, sizeof(struct lbz_wb_entry));
+	bio_put(bio);
+	atomic64_inc(&wb->flushed_blocks);
+	if (kick)
+		queue_work(wb->wb_wq, &wb->wb_wk);
+}
+
+static void __wb_flush_entry(struct lbz_write_buffer *wb, struct lbz_wb_entry *entry)
+{
+	struct lbz_device *dev = wb->host;
+	struct bio *bio = bio_alloc_bioset(GFP_NOIO, 1, &wb->bio_set);
+
+	bio_set_dev(bio, dev->disk->part0);
+	bio->bi_opf = REQ_OP_WRITE;
+	bio->bi_iter.bi_sector = blkid_to_sector(entry->blkid);
+	bio_add_page(bio, entry->page, LBZ_DATA_BLK_SIZE, 0);
+	bio->bi_private = entry;
+	bio->bi_end_io = lbz_wb_flush_endio;
+	lbz_submit_io_to_iosched_direct(dev->iosched, bio);
+}
+
+/*
+ * Write back dirty blocks: urgent ones, all when draining, otherwise oldest
+ * ones until dirty blocks fall to low watermark. Urgent entries are always
+ * at head of dirty_list.
+ */
+static void wb_wk_fn(struct work_struct *work)
+{
+	struct lbz_write_buffer *wb = container_of(work, struct lbz_write_buffer, wb_wk);
+	struct lbz_device *dev = wb->host;
+	struct lbz_wb_entry *batch[LBZ_WB_FLUSH_BATCH], *entry;
+	struct bio_list resubmit, released;
+	unsigned long flag = 0;
+	struct bio *bio;
+	int i = 0, nr = 0;
+
+	bio_list_init(&resubmit);
+	bio_list_init(&released);
+	spin_lock_irqsave(&wb->lock, flag);
+	bio_list_merge(&resubmit, &wb->resubmit);
+	bio_list_init(&wb->resubmit);
+	/*start fence for new preflush bios when the last one is done.*/
+	if (bio_list_empty(&wb->barrier_wait) && !bio_list_empty(&wb->barrier_bios)) {
+		list_for_each_entry(entry, &wb->flushing_list, link) {
+			if (!entry->fence) {
+				entry->fence = true;
+				wb->fence_count++;
+			}
+		}
+		list_for_each_entry(entry, &wb->dirty_list, link) {
+			entry->fence = true;
+			wb->fence_count++;
+		}
+		if (wb->fence_count == 0) {
+			__wb_release_barrier(wb, &wb->barrier_bios);
+		} else {
+			bio_list_merge(&wb->barrier_wait, &wb->barrier_bios);
+			bio_list_init(&wb->barrier_bios);
+		}
+	}
+	bio_list_merge(&released, &wb->released);
+	bio_list_init(&wb->released);
+	spin_unlock_irqrestore(&wb->lock, flag);
+
+	while ((bio = bio_list_pop(&resubmit)))
+		lbz_submit_io_to_iosched(dev->iosched, bio);
+	while ((bio = bio_list_pop(&released))) {
+		if (bio->bi_status)
+			bio_endio(bio);
+		else if (bio_has_data(bio))
+			lbz_submit_io_to_iosched_direct(dev->iosched, bio);
+		else
+			lbz_dev_flush(dev, bio);
+	}
+
+	do {
+		nr = 0;
+		spin_lock_irqsave(&wb->lock, flag);
+		while (nr < LBZ_WB_FLUSH_BATCH && !list_empty(&wb->dirty_list)) {
+			entry = list_first_entry(&wb->dirty_list, struct lbz_wb_entry, link);
+			if (!__wb_urgent(entry) && !wb->draining && wb->nr_dirty <= LBZ_WB_LOW_WM)
+				break;
+			entry->state = LBZ_WB_FLUSHING;
+			list_move_tail(&entry->link, &wb->flushing_list);
+			wb->nr_dirty--;
+			wb->nr_flushing++;
+			batch[nr++] = entry;
+		}
+		spin_unlock_irqrestore(&wb->lock, flag);
+		/*entry is not freed before its write back completes.*/
+		for (i = 0; i < nr; i++)
+			__wb_flush_entry(wb, batch[i]);
+	} while (nr == LBZ_WB_FLUSH_BATCH);
+}
+
+void lbz_wb_proc_read(struct lbz_write_buffer *wb, struct seq_file *seq)
+{
+	seq_printf(seq, "nr_pages: %u(max %u)\n"
+					"nr_dirty: %u\n"
+					"nr_flushing: %u\n"
+					"fence_count: %u\n"
+					"absorbed_writes: %lld\n"
+					"overwrites: %lld\n"
+					"read_hits: %lld\n"
+					"flushed_blocks: %lld\n"
+					"deferred_writes: %lld\n"
+					"wb_errors: %lld\n",
+					wb->nr_pages, LBZ_WB_MAX_PAGES,
+					wb->nr_dirty,
+					wb->nr_flushing,
+					wb->fence_count,
+					atomic64_read(&wb->absorbed_writes),
+					atomic64_read(&wb->overwrites),
+					atomic64_read(&wb->read_hits),
+					atomic64_read(&wb->flushed_blocks),
+					atomic64_read(&wb->deferred_writes),
+					atomic64_read(&wb->wb_errors));
+}
+
+int lbz_wb_init(struct lbz_write_buffer *wb, struct lbz_device *dev)
+{
+	int ret = 0;
+
+	spin_lock_init(&wb->lock);
+	wb->tree = RB_ROOT;
+	INIT_LIST_HEAD(&wb->dirty_list);
+	INIT_LIST_HEAD(&wb->flushing_list);
+	wb->nr_pages = wb->nr_dirty = wb->nr_flushing = 0;
+	bio_list_init(&wb->barrier_bios);
+	bio_list_init(&wb->barrier_wait);
+	wb->fence_count = 0;
+	bio_list_init(&wb->resubmit);
+	bio_list_init(&wb->released);
+	wb->wb_error = BLK_STS_OK;
+	wb->draining = false;
+	atomic64_set(&wb->absorbed_writes, 0);
+	atomic64_set(&wb->overwrites, 0);
+	atomic64_set(&wb->read_hits, 0);
+	atomic64_set(&wb->flushed_blocks, 0);
+	atomic64_set(&wb->deferred_writes, 0);
+	atomic64_set(&wb->wb_errors, 0);
+	wb->host = dev;
+
+	ret = bioset_init(&wb->bio_set, BIO_POOL_SIZE, 0, BIOSET_NEED_BVECS);
+	if (ret < 0)
+		return ret;
+	/*write back may be needed for reclaim.*/
+	wb->wb_wq = alloc_workqueue("%s_wb", WQ_MEM_RECLAIM | WQ_UNBOUND, 0, dev->devname);
+	if (!wb->wb_wq) {
+		bioset_exit(&wb->bio_set);
+		return -ENOMEM;
+	}
+	INIT_WORK(&wb->wb_wk, wb_wk_fn);
+	return 0;
+}
+
+/*write back all buffered blocks before device goes away.*/
+void lbz_wb_destroy(struct lbz_write_buffer *wb)
+{
+	struct lbz_device *dev = wb->host;
+	unsigned long flag = 0;
+	wait_queue_head_t wq;
+
+	spin_lock_irqsave(&wb->lock, flag);
+	wb->draining = true;
+	spin_unlock_irqrestore(&wb->lock, flag);
+	queue_work(wb->wb_wq, &wb->wb_wk);
+
+	init_waitqueue_head(&wq);
+	do {
+		wait_event_timeout(wq, READ_ONCE(wb->nr_pages) == 0 || is_dev_faulty(dev), HZ);
+	} while (READ_ONCE(wb->nr_pages) != 0 && !is_dev_faulty(dev));
+
+	destroy_workqueue(wb->wb_wq);
+	bioset_exit(&wb->bio_set);
+}
+#endif
@@ -1,6 +1,7 @@
 #include "lbz-zone-metadata.h"
 #include "lbz-dev.h"
 #include "lbz-gc.h"
+#include "lbz-io-scheduler.h"
 
 #define LBZ_MSG_PREFIX "lbz-zmd"
 
@@ -91,8 +92,9 @@ void lbz_get_zone(struct lbz_zone *zone)
 	atomic_inc(&zone->refcount);
 }
 
-/* write zone: may referenced by read, if zone write full but still referenced by read, it can be moved to full list.
- * GC zone: trigger reset after all gc write completed and zone not referenced by any context.*/
+/* write zone: if zone write full and all its writes completed, it can be moved to full list.
+ * GC zone: trigger reset after all gc write completed and zone not referenced by any context,
+ * user reads are waited by lbz_zone_wait_readers before reset.*/
 void lbz_put_zone(struct lbz_zone *zone)
 {
 	unsigned long flag = 0;
@@ -129,19 +131,13 @@ void lbz_zone_complete_write(struct lbz_zone *zone)
 void lbz_zone_release_global_res(struct lbz_zone_metadata *zmd, struct lbz_zone *zone)
 {
 	atomic_dec(&zone->weight);
-	atomic_dec(&zmd->nr_valid_blks);
+	atomic64_dec(&zmd->nr_valid_blks);
 }
 
-struct lbz_zone *get_zone_by_pbid(struct lbz_zone_metadata *zmd, unsigned int pbid)
+void lbz_zone_release_global_res_nr(struct lbz_zone_metadata *zmd, struct lbz_zone *zone, int nr)
 {
-	int index;
-	struct lbz_device *dev = zmd->host;
-	
-	/*
-	 * index = pbid / zmd->zone_size_blks;
-	 */
-	index = blk_queue_zone_no(bdev_get_queue(dev->phy_bdev), blkid_to_sector(pbid));
-	return __get_zone(zmd, index);
+	atomic_sub(nr, &zone->weight);
+	atomic64_sub(nr, &zmd->nr_valid_blks);
 }
 
 static void lbz_zone_destroy(struct lbz_zone_metadata *zmd, struct lbz_zone *zone)
@@ -202,6 +198,11 @@ static struct lbz_zone *lbz_zone_insert(struct lbz_zone_metadata *zmd,
 	return zone;
 }
 
+static inline long __active_res(struct lbz_zone *zone, unsigned int wp_block)
+{
+	return ((long)(zone->id + 1) << 32) | wp_block;
+}
+
 void __init_zmd_by_first_zone(struct lbz_zone_metadata *zmd, struct blk_zone *blkz)
 {
 	/* Init */
@@ -245,9 +246,9 @@ static int lbz_init_zone(struct blk_zone *blkz, unsigned int num, void *data)
 
 	zone->wp_block = sector_to_blkid(blkz->wp - blkz->start);
 	atomic_set(&zone->weight, zone->wp_block);
-	zone->start_sector = (unsigned int)blkz->start;
-	zone->len_sectors = (unsigned int)blkz->len;
-	zone->capacity_sectors = (unsigned int)blkz->capacity;
+	zone->start_sector = blkz->start;
+	zone->len_sectors = blkz->len;
+	zone->capacity_sectors = blkz->capacity;
 	zone->cond = blkz->cond;
 	atomic_set(&zone->pending_write_io, 0);
 
@@ -257,30 +258,31 @@ static int lbz_init_zone(struct blk_zone *blkz, unsigned int num, void *data)
 	if (zone->wp_block == 0) {
 		zone->state = BLK_ZONE_COND_EMPTY;
 		lbz_set_zone_state(LBZ_ZONE_INIT, zone);
-		atomic_add(zmd->zone_nr_blocks, &zmd->nr_allocable_blks);
+		atomic64_add(zmd->zone_nr_blocks, &zmd->nr_allocable_blks);
 		lbz_zone_add_to_list(zmd, zone, LBZ_ZONE_INIT);
 	} else if (zone->wp_block < sector_to_blkid(blkz->capacity)) {
 		/*using implict open.*/
 		lbz_get_zone(zone);
 		zone->state = BLK_ZONE_COND_IMP_OPEN;
 		lbz_set_zone_state(LBZ_ZONE_ACTIVE, zone);
-		/*only permit one zone per stream to be opened and not full.*/
-		for (; i < LBZ_ZONE_MAX_STREAM; i++) {
-			if (NULL == zmd->active_zone[i]) {
-				zone->stream = i;
+		/*only permit nr_frontiers zones per stream to be opened and not full.*/
+		for (; i < LBZ_ZONE_MAX_ACTIVE; i++) {
+			if (i % LBZ_ZONE_MAX_FRONTIERS < zmd->nr_frontiers && NULL == zmd->active_zone[i]) {
+				zone->stream = i / LBZ_ZONE_MAX_FRONTIERS;
 				zmd->active_zone[i] = zone;
+				atomic64_set(&zmd->active_res[i], __active_res(zone, zone->wp_block));
 				break;
 			}
 		}
-		BUG_ON(i == LBZ_ZONE_MAX_STREAM);
-		atomic_add(zmd->zone_nr_blocks - zone->wp_block, &zmd->nr_allocable_blks);
+		BUG_ON(i == LBZ_ZONE_MAX_ACTIVE);
+		atomic64_add(zmd->zone_nr_blocks - zone->wp_block, &zmd->nr_allocable_blks);
 	} else {
 		zone->state = BLK_ZONE_COND_FULL;
 		lbz_set_zone_state(LBZ_ZONE_FULL, zone);
 		lbz_zone_add_to_list(zmd, zone, LBZ_ZONE_FULL);
 	}
 	/*assume all written data are valid at this time.*/
-	atomic_add(zone->wp_block, &zmd->nr_valid_blks);
+	atomic64_add(zone->wp_block, &zmd->nr_valid_blks);
 
 	if (blkz->cond == BLK_ZONE_COND_OFFLINE) {
 		set_bit(LBZ_ZONE_OFFLINE, &zone->flags);
@@ -291,7 +293,7 @@ static int lbz_init_zone(struct blk_zone *blkz, unsigned int num, void *data)
 	} else {
 		zmd->nr_useable_zones++;
 	}
-	atomic_add(zmd->zone_nr_blocks, &zmd->nr_total_blks);
+	atomic64_add(zmd->zone_nr_blocks, &zmd->nr_total_blks);
 	zmd->zones[num] = zone;
 	lbz_close_zone(zone, zmd);
 
@@ -381,8 +383,7 @@ struct lbz_zone *lbz_find_victim_zone(struct lbz_zone_metadata *zmd, enum lbz_vi
 	}
 	list_del_init(&min_zone->link);
 	lbz_get_zone(min_zone); /* must get before set state, because LBZ_ZONE_GC may induce reset of zone
-							 * read: lbz_get_zone->read->lbz_put_zone->change state to BLK_ZONE_COND_EMPTY->reset
-							 * by reset work.*/
+							 * by reset work once refcount is zero.*/
 	lbz_set_zone_state(LBZ_ZONE_GC, min_zone);
 	zmd->full_zone_count--;
 	zmd->active_zone_count++;
@@ -441,86 +442,184 @@ struct lbz_zone * __get_free_zone(struct lbz_zone_metadata *zmd)
 	return zone;
 }
 
-void __alloc_res(struct lbz_zone *zone)
+/*
+ * Active zone of frontier is full, hand it to zone state thread.
+ * must be locked by caller, filler and later alloc may both get here.
+ */
+static void __retire_active_zone(struct lbz_zone_metadata *zmd, int fid, struct lbz_zone *zone)
 {
-	zone->wp_block++;
-	atomic_inc(&zone->weight);
+	if (zmd->active_zone[fid] != zone)
+		return;
+	zone->wp_block = zmd->zone_nr_blocks;
+	lbz_clear_zone_state(LBZ_ZONE_ACTIVE, zone);
+	lbz_set_zone_state(LBZ_ZONE_TO_FULL, zone);
+	zmd->active_zone[fid] = NULL;
+	atomic64_set(&zmd->active_res[fid], 0);
+	/*wp_block will not be modified after this put*/
+	lbz_put_zone(zone);
 }
 
 /*
- * user write alloc res will be denied when there are no space for gc.
+ * Reserve blocks in active zone without zmd_lock. active_res of frontier packs
+ * (zone id + 1, wp_block), so one cmpxchg both checks zone is still active for
+ * this frontier and moves its wp. Zone is referenced and marked pending before
+ * cmpxchg, so a zone we reserved in can't become full and be gc before write.
+ * return -ENOSPC if frontier has no active zone or it is full.
+ */
+static int __alloc_res_fast(struct lbz_zone_metadata *zmd, struct lbz_zone **ret_zone,
+		unsigned int *nr_blks, int fid)
+{
+	long res = atomic64_read(&zmd->active_res[fid]), old;
+	unsigned int id, wp, granted;
+	struct lbz_zone *zone;
+	unsigned long flag;
+
+	for (;;) {
+		id = res >> 32;
+		wp = (unsigned int)res;
+		if (id == 0 || wp >= zmd->zone_nr_blocks)
+			return -ENOSPC;
+		zone = __get_zone(zmd, id - 1);
+		granted = min(*nr_blks, zmd->zone_nr_blocks - wp);
+		/* get for io write and gc write.
+		 * in case that another context close this zone.*/
+		lbz_get_zone(zone);
+		__pending_write(zone);
+		old = atomic64_cmpxchg(&zmd->active_res[fid], res, res + granted);
+		if (old == res)
+			break;
+		lbz_zone_complete_write(zone);
+		lbz_put_zone(zone);
+		res = old;
+	}
+	atomic_add(granted, &zone->weight);
+	atomic64_add(granted, &zmd->active_zone_writes[fid / LBZ_ZONE_MAX_FRONTIERS]); /*statistic stream writes.*/
+	atomic64_add(granted, &zmd->frontier_writes[fid]);
+	atomic64_add(granted, &zmd->nr_valid_blks);
+	*nr_blks = granted;
+	*ret_zone = zone;
+	if (wp + granted == zmd->zone_nr_blocks) {
+		spin_lock_irqsave(&zmd->zmd_lock, flag);
+		__retire_active_zone(zmd, fid, zone);
+		spin_unlock_irqrestore(&zmd->zmd_lock, flag);
+	}
+	return 0;
+}
+
+/*
+ * Slow path, open an empty zone for frontier when active zone is absent or full.
  */
-int lbz_zone_alloc_res(struct lbz_zone_metadata *zmd, struct lbz_zone **ret_zone, enum lbz_alloc_flag mod, int stream_id)
+static int __switch_active_zone(struct lbz_zone_metadata *zmd, enum lbz_alloc_flag mod, int fid)
 {
 	unsigned long flag;
 	struct lbz_device *dev = zmd->host;
+	struct lbz_zone *zone;
+	long res;
 	int ret = 0;
-	bool open_zone = false;
 
 	spin_lock_irqsave(&zmd->zmd_lock, flag);
+	zone = zmd->active_zone[fid];
+	res = atomic64_read(&zmd->active_res[fid]);
+	/*another context has already switched.*/
+	if (NULL != zone && (unsigned int)res < zmd->zone_nr_blocks)
+		goto out;
+	if (NULL != zone)
+		__retire_active_zone(zmd, fid, zone);
+	zone = __get_free_zone(zmd);
+	if (NULL == zone) {
+		LBZDEBUG("alloc zone encounter error.");
+		ret = -EAGAIN;
+		/*if one stream can not alloc res, it may retry alloc on another stream by caller.*/
+#ifndef CONFIG_LBZ_NAT_SIT_STREAM_SUPPORT
+		lbz_trigger_gc_reclaim(dev->gc_ctx);
+#endif
+		goto out;
+	}
+	zone->stream = fid / LBZ_ZONE_MAX_FRONTIERS;
+	/*zone state will not handle this during write.*/
+	lbz_get_zone(zone);
+	lbz_set_zone_state(LBZ_ZONE_ACTIVE, zone);
+	zone->state = BLK_ZONE_COND_EXP_OPEN;
+	zmd->active_zone[fid] = zone;
+	atomic64_set(&zmd->active_res[fid], __active_res(zone, zone->wp_block));
+out:
+	spin_unlock_irqrestore(&zmd->zmd_lock, flag);
+	return ret;
+}
+
+/*
+ * Take user write quota from nr_allocable_blks before reserving in zone, so
+ * concurrent writes can't all pass the check and eat into gc reserve. Quota
+ * is cut to the blocks above floor, return 0 if there is none.
+ */
+static unsigned int __take_user_quota(struct lbz_zone_metadata *zmd, unsigned int nr_blks,
+		long floor)
+{
+	long left = atomic64_sub_return(nr_blks, &zmd->nr_allocable_blks);
+	long over = floor - left;
+
+	if (over <= 0)
+		return nr_blks;
+	over = min_t(long, over, nr_blks);
+	atomic64_add(over, &zmd->nr_allocable_blks);
+	return nr_blks - over;
+}
+
+/*
+ * user write alloc res will be denied when there are no space for gc.
+ * nr_blks: blocks wanted by caller, blocks granted on return. Grant is cut at
+ * the end of active zone, caller should alloc the rest again.
+ * Frontiers of stream are used round-robin, when no empty zone is left for
+ * the picked one, others of the stream still have room in their zones.
+ * zmd_lock is only taken when active zone of frontier is switched.
+ */
+int lbz_zone_alloc_res(struct lbz_zone_metadata *zmd, struct lbz_zone **ret_zone,
+		unsigned int *nr_blks, enum lbz_alloc_flag mod, int stream_id)
+{
+	struct lbz_device *dev = zmd->host;
+	unsigned int first = atomic_inc_return(&zmd->frontier_rr[stream_id]), n = 0, quota = 0;
+	int ret = 0, fid = 0;
+
 	if (is_dev_faulty(dev)) {
-		ret = -EIO;
 		LBZERR("(%s)lbz dev faulty", dev->devname);
-		goto out;
+		return -EIO;
 	}
 	if (mod == LBZ_ALLOC_FLAG_USER) {
-		if (atomic_read(&zmd->nr_allocable_blks) < zmd->reserved_blks_gc) {
-			ret = -EAGAIN;
+		quota = __take_user_quota(zmd, *nr_blks, zmd->reserved_blks_gc);
+		if (quota == 0) {
 			LBZDEBUG("(%s)have not enough blks for user write.", dev->devname);
-			goto out;
+			return -EAGAIN;
 		}
-	}
-	if (unlikely((NULL == zmd->active_zone[stream_id]) || (zmd->active_zone[stream_id]->wp_block == zmd->zone_nr_blocks))) {
-		/*wp_block will not be modified after this put*/
-		if (NULL != zmd->active_zone[stream_id])
-			lbz_put_zone(zmd->active_zone[stream_id]);
-		zmd->active_zone[stream_id] = __get_free_zone(zmd);
-		if (NULL == zmd->active_zone[stream_id]) {
-			LBZDEBUG("alloc zone encounter error.");
-			ret = -EAGAIN;
-			/*if one stream can not alloc res, it may retry alloc on another stream by caller.*/
-#ifndef CONFIG_LBZ_NAT_SIT_STREAM_SUPPORT
-			lbz_trigger_gc_reclaim(dev->gc_ctx);
-			BUG_ON(mod == LBZ_ALLOC_FLAG_GC);
-#endif
-			goto out;
+		*nr_blks = quota;
+	} else if (mod == LBZ_ALLOC_FLAG_USER_SYNC) {
+		quota = __take_user_quota(zmd, *nr_blks,
+				(long)zmd->reserved_blks_gc - zmd->reserved_blks_sync);
+		if (quota == 0) {
+			LBZDEBUG("(%s)have not enough blks for sync user write.", dev->devname);
+			return -EAGAIN;
 		}
-		zmd->active_zone[stream_id]->stream = stream_id;
-		/*zone state will not handle this during write.*/
-		lbz_get_zone(zmd->active_zone[stream_id]);
-		lbz_set_zone_state(LBZ_ZONE_ACTIVE, zmd->active_zone[stream_id]);
-		zmd->active_zone[stream_id]->state = BLK_ZONE_COND_EXP_OPEN;
-		open_zone = true;
-	}
-	/* get for io write and gc write.
-	 * in case that another context close this zone.*/
-	lbz_get_zone(zmd->active_zone[stream_id]);
-	__alloc_res(zmd->active_zone[stream_id]);
-	atomic64_inc(&zmd->active_zone_writes[stream_id]); /*statistic stream writes.*/
-	atomic_dec(&zmd->nr_allocable_blks);
-	atomic_inc(&zmd->nr_valid_blks);
-	*ret_zone = zmd->active_zone[stream_id];
-	__pending_write(zmd->active_zone[stream_id]);
-	if (zmd->active_zone[stream_id]->wp_block == zmd->zone_nr_blocks) {
-		lbz_clear_zone_state(LBZ_ZONE_ACTIVE, zmd->active_zone[stream_id]);
-		lbz_set_zone_state(LBZ_ZONE_TO_FULL, zmd->active_zone[stream_id]);
-		lbz_put_zone(zmd->active_zone[stream_id]);
-		zmd->active_zone[stream_id] = NULL;
+		*nr_blks = quota;
 	}
-out:
-	spin_unlock_irqrestore(&zmd->zmd_lock, flag);
-	/*may open by another context, but not important.*/
-	if (open_zone) {
-		/*ret = lbz_open_zone(*ret_zone, zmd);*/
-		/*check code for reopen.*/
-		if (ret < 0) {
-			LBZERR("zone: %lx, open encounter error: %d", (unsigned long)*ret_zone, ret);
-			lbz_dev_set_faulty(dev);
-			/*for active and write.*/
-			lbz_put_zone(*ret_zone);
-			lbz_put_zone(*ret_zone);
+	for (; n < zmd->nr_frontiers; n++) {
+		fid = stream_id * LBZ_ZONE_MAX_FRONTIERS + (first + n) % zmd->nr_frontiers;
+		while (-ENOSPC == (ret = __alloc_res_fast(zmd, ret_zone, nr_blks, fid))) {
+			ret = __switch_active_zone(zmd, mod, fid);
+			if (ret < 0)
+				break;
 		}
+		if (ret != -EAGAIN)
+			break;
 	}
+#ifndef CONFIG_LBZ_NAT_SIT_STREAM_SUPPORT
+	BUG_ON(ret == -EAGAIN && mod == LBZ_ALLOC_FLAG_GC);
+#endif
+	/*give back quota not granted, grant may be cut at end of zone.*/
+	if (ret < 0)
+		atomic64_add(quota, &zmd->nr_allocable_blks);
+	else if (quota)
+		atomic64_add(quota - *nr_blks, &zmd->nr_allocable_blks);
+	else
+		atomic64_sub(*nr_blks, &zmd->nr_allocable_blks);
 	return ret;
 }
 
@@ -531,10 +630,11 @@ void lbz_zone_proc_read(struct lbz_zone_metadata *zmd, struct seq_file *seq)
 
 	seq_printf(seq, "empty_zone_count: %u\n"
 					"full_zone_count: %u\n"
-					"nr_total_blks: %d\n"
-					"nr_allocable_blks: %d\n"
-					"nr_valid_blks: %d\n"
+					"nr_total_blks: %lld\n"
+					"nr_allocable_blks: %lld\n"
+					"nr_valid_blks: %lld\n"
 					"reserved_blks_gc: %u\n"
+					"reserved_blks_sync: %u\n"
 					"reclaim_wm_gc_low: %u\n"
 					"reclaim_wm_gc_high: %u\n"
 					"zone_size_sectors: %u\n"
@@ -551,10 +651,11 @@ void lbz_zone_proc_read(struct lbz_zone_metadata *zmd, struct seq_file *seq)
 					"zs_reset_times: %lu\n",
 					zmd->empty_zone_count,
 					zmd->full_zone_count,
-					atomic_read(&zmd->nr_total_blks),
-					atomic_read(&zmd->nr_allocable_blks),
-					atomic_read(&zmd->nr_valid_blks),
+					atomic64_read(&zmd->nr_total_blks),
+					atomic64_read(&zmd->nr_allocable_blks),
+					atomic64_read(&zmd->nr_valid_blks),
 					zmd->reserved_blks_gc,
+					zmd->reserved_blks_sync,
 					zmd->reclaim_wm_gc_low,
 					zmd->reclaim_wm_gc_high,
 					zmd->zone_size_sectors,
@@ -571,12 +672,22 @@ void lbz_zone_proc_read(struct lbz_zone_metadata *zmd, struct seq_file *seq)
 					zmd->zs_reset_times);
 	for (i = 0; i < LBZ_ZONE_MAX_STREAM; i++)
 		seq_printf(seq, "active_zone_writes[%d]: %llu\n", i, atomic64_read(&zmd->active_zone_writes[i]));
+	seq_printf(seq, "nr_frontiers: %u\n", zmd->nr_frontiers);
+	for (i = 0; i < LBZ_ZONE_MAX_ACTIVE; i++) {
+		long res = atomic64_read(&zmd->active_res[i]);
+
+		if (i % LBZ_ZONE_MAX_FRONTIERS >= zmd->nr_frontiers)
+			continue;
+		seq_printf(seq, "frontier[%d]: stream(%d), zone(%ld), wp_block(%u), writes(%llu), rate(%lu blks/s)\n",
+				i, i / LBZ_ZONE_MAX_FRONTIERS, (res >> 32) - 1, (unsigned int)res,
+				atomic64_read(&zmd->frontier_writes[i]), zmd->frontier_rate[i]);
+	}
 
 	seq_printf(seq, "-------zone info-------\n");
 	for (i = 0; i < zmd->nr_zones; i++) {
 		zone = zmd->zones[i];
 		seq_printf(seq, "zone(%d): state(%d), flags(%lu), refcount(%d), wp_block(%u),"
-						"start_sector(%u), len_sectors(%u), capacity_sectors(%u), weight(%u),"
+						"start_sector(%llu), len_sectors(%llu), capacity_sectors(%llu), weight(%u),"
 						"pending_write_io(%d), valid_percent(%d%%), stream(%d)\n",
 						zone->id, zone->state, zone->flags, atomic_read(&zone->refcount),
 						zone->wp_block, zone->start_sector, zone->len_sectors, zone->capacity_sectors,
@@ -591,6 +702,7 @@ void lbz_destroy_zone_metadata(struct lbz_zone_metadata *zmd)
 
 	del_timer_sync(&zmd->zone_state_timer);
 	destroy_workqueue(zmd->zone_state_wq);
+	cleanup_srcu_struct(&zmd->read_srcu);
 	/*close all zone no matter whether it opened or not.*/
 	for (; i < zmd->nr_zones; i++)
 		lbz_close_zone(zmd->zones[i], zmd);
@@ -601,16 +713,18 @@ static void zone_state_wk_fn(struct work_struct *work)
 {
 	struct lbz_zone_metadata *zmd = container_of(work, struct lbz_zone_metadata, zone_state_wk);
 	struct lbz_device *dev = zmd->host;
-	struct lbz_zone *zone = NULL;
+	struct lbz_zone *zone = NULL, *tmp;
 	unsigned long flag = 0;
 	bool send_zone_mgmgt = false;
 	int i = 0, ret = 0, k = 0;
+	LIST_HEAD(reset_list);
 
 	if (is_dev_faulty(dev) || !is_dev_ready(dev))
 		return;
 
 	for (i = 0; i < zmd->nr_zones; i++) {
 		zone = zmd->zones[i];
+		send_zone_mgmgt = false;
 		/*close zone.*/
 		if (is_lbz_zone_state(LBZ_ZONE_TO_FULL, zone)) {
 			spin_lock_irqsave(&zone->lock, flag);
@@ -637,57 +751,104 @@ static void zone_state_wk_fn(struct work_struct *work)
 		}
 		if (0 != atomic_read(&zone->refcount))
 			continue;
-		/*reset zone.*/
+		/*collect zones to reset, gc zone is not in any list.*/
 		if (is_lbz_zone_state(LBZ_ZONE_GC, zone)) {
 			spin_lock_irqsave(&zone->lock, flag);
 			if (zone->state == BLK_ZONE_COND_EMPTY) {
 				send_zone_mgmgt = true;
 			}
 			spin_unlock_irqrestore(&zone->lock, flag);
-			if (send_zone_mgmgt) {
-				ret = lbz_reset_zone(zone, zmd);
-				if (ret < 0) {
-					lbz_dev_set_faulty(dev);
-					LBZERR("zone(%lx) reset encounter error: %d", (unsigned long)zone, ret);
-					goto out;
-				}
-				if (atomic_read(&zone->weight) != 0)
-					panic("zone(%lx), reset encounter valid blocks!", (unsigned long)zone);
-
-				zone->stream = -1;
+			if (send_zone_mgmgt)
+				list_add_tail(&zone->link, &reset_list);
+		}
+	}
+	if (list_empty(&reset_list))
+		goto out;
 
-				zone->wp_block = 0;
-				zone->state = BLK_ZONE_COND_EMPTY;
-				zone->flags = (1 << LBZ_ZONE_INIT);
-				for (k = 0; k < zmd->zone_nr_reverse_map_blocks; k++)
-					memset(zone->zrms[k], 0xff, PAGE_SIZE);
-				spin_lock_irqsave(&zmd->zmd_lock, flag);
-				/*not in any list before.*/
-				list_add_tail(&zone->link, &zmd->empty_zone_list);
-				zmd->empty_zone_count++;
-				/*lbz_find_victim_zone added.*/
-				zmd->active_zone_count--;
-				atomic_add(zmd->zone_nr_blocks, &zmd->nr_allocable_blks);
-				spin_unlock_irqrestore(&zmd->zmd_lock, flag);
-				zmd->zs_reset_times++;
-			}
-			lbz_complete_one_zone(dev->gc_ctx);
-			continue;
+	/*reads looked up old pbids before gc moved them may be still in flight.*/
+	lbz_zone_wait_readers(zmd);
+	/*blocks moved by gc must be durable before their old copies go away.*/
+	ret = blkdev_issue_flush(dev->phy_bdev);
+	if (ret < 0) {
+		lbz_dev_set_faulty(dev);
+		LBZERR("flush before zone reset encounter error: %d", ret);
+		goto out;
+	}
+	list_for_each_entry_safe(zone, tmp, &reset_list, link) {
+		list_del_init(&zone->link);
+		ret = lbz_reset_zone(zone, zmd);
+		if (ret < 0) {
+			lbz_dev_set_faulty(dev);
+			LBZERR("zone(%lx) reset encounter error: %d", (unsigned long)zone, ret);
+			goto out;
 		}
+		if (atomic_read(&zone->weight) != 0)
+			panic("zone(%lx), reset encounter valid blocks!", (unsigned long)zone);
+
+		zone->stream = -1;
+
+		zone->wp_block = 0;
+		zone->state = BLK_ZONE_COND_EMPTY;
+		zone->flags = (1 << LBZ_ZONE_INIT);
+		for (k = 0; k < zmd->zone_nr_reverse_map_blocks; k++)
+			memset(zone->zrms[k], 0xff, PAGE_SIZE);
+		spin_lock_irqsave(&zmd->zmd_lock, flag);
+		/*not in any list before.*/
+		list_add_tail(&zone->link, &zmd->empty_zone_list);
+		zmd->empty_zone_count++;
+		/*lbz_find_victim_zone added.*/
+		zmd->active_zone_count--;
+		atomic64_add(zmd->zone_nr_blocks, &zmd->nr_allocable_blks);
+		spin_unlock_irqrestore(&zmd->zmd_lock, flag);
+		zmd->zs_reset_times++;
+		lbz_iosched_wake_space_waiters(dev->iosched);
+		lbz_complete_one_zone(dev->gc_ctx);
 	}
 out:
-	return;
+	/*zones left on error stay out of any list, device is faulty.*/
+	list_for_each_entry_safe(zone, tmp, &reset_list, link)
+		list_del_init(&zone->link);
+}
+
+/*blocks per second of every frontier since last tick.*/
+static void __sample_frontier_rate(struct lbz_zone_metadata *zmd)
+{
+	unsigned int msecs = jiffies_to_msecs(jiffies - zmd->last_jiffies);
+	long writes;
+	int i = 0;
+
+	if (msecs == 0)
+		return;
+	for (; i < LBZ_ZONE_MAX_ACTIVE; i++) {
+		writes = atomic64_read(&zmd->frontier_writes[i]);
+		zmd->frontier_rate[i] = (writes - zmd->frontier_last_writes[i]) * 1000 / msecs;
+		zmd->frontier_last_writes[i] = writes;
+	}
 }
 
 static void __zs_timer_fn(struct timer_list *timer)
 {
 	struct lbz_zone_metadata *zmd = container_of(timer, struct lbz_zone_metadata, zone_state_timer);
 
+	__sample_frontier_rate(zmd);
 	queue_work(zmd->zone_state_wq, &zmd->zone_state_wk);
 	mod_timer(&zmd->zone_state_timer, jiffies + zmd->zone_state_expire);
 	zmd->last_jiffies = jiffies;
 }
 
+/*
+ * Frontiers of all streams are open at the same time, keep them in open and
+ * active zone limits of device, 0 means no limit.
+ */
+static unsigned int __nr_frontiers(struct block_device *bdev)
+{
+	unsigned int limit = min_not_zero(bdev_max_open_zones(bdev), bdev_max_active_zones(bdev));
+
+	if (limit == 0)
+		return LBZ_ZONE_MAX_FRONTIERS;
+	return clamp_t(unsigned int, limit / LBZ_ZONE_MAX_STREAM, 1, LBZ_ZONE_MAX_FRONTIERS);
+}
+
 int lbz_init_zone_metadata(struct lbz_zone_metadata *zmd, struct lbz_device *dev)
 {
 	int ret = 0, i = 0;
@@ -697,9 +858,17 @@ int lbz_init_zone_metadata(struct lbz_zone_metadata *zmd, struct lbz_device *dev
 	INIT_LIST_HEAD(&zmd->full_zone_list);
 	INIT_LIST_HEAD(&zmd->active_zone_list);
 	for (; i < LBZ_ZONE_MAX_STREAM; i++) {
-		zmd->active_zone[i] = NULL;
 		atomic64_set(&zmd->active_zone_writes[i], 0);
+		atomic_set(&zmd->frontier_rr[i], 0);
+	}
+	for (i = 0; i < LBZ_ZONE_MAX_ACTIVE; i++) {
+		zmd->active_zone[i] = NULL;
+		atomic64_set(&zmd->active_res[i], 0);
+		atomic64_set(&zmd->frontier_writes[i], 0);
+		zmd->frontier_last_writes[i] = 0;
+		zmd->frontier_rate[i] = 0;
 	}
+	zmd->nr_frontiers = __nr_frontiers(dev->phy_bdev);
 	zmd->empty_zone_count = 0;
 	zmd->partial_zone_count = 0;
 	zmd->full_zone_count = 0;
@@ -708,10 +877,19 @@ int lbz_init_zone_metadata(struct lbz_zone_metadata *zmd, struct lbz_device *dev
 	zmd->nr_zones = blk_queue_nr_zones(bdev_get_queue(dev->phy_bdev));
 	zmd->zone_size_sectors = blk_queue_zone_sectors(bdev_get_queue(dev->phy_bdev));
 	zmd->zone_size_blks = sector_to_blkid(zmd->zone_size_sectors);
+	if (!is_power_of_2(zmd->zone_size_blks)) {
+		LBZERR("(%s)zone size %u blocks is not power of 2", dev->devname, zmd->zone_size_blks);
+		return -EINVAL;
+	}
+	zmd->zone_size_blks_shift = ilog2(zmd->zone_size_blks);
+	if (((u64)zmd->nr_zones << zmd->zone_size_blks_shift) >= LBZ_MAX_DEV_BLKS) {
+		LBZERR("(%s)%u zones exceed %u addressable blocks", dev->devname, zmd->nr_zones, LBZ_MAX_DEV_BLKS);
+		return -EINVAL;
+	}
 
-	atomic_set(&zmd->nr_total_blks, 0);
-	atomic_set(&zmd->nr_allocable_blks, 0);
-	atomic_set(&zmd->nr_valid_blks, 0);
+	atomic64_set(&zmd->nr_total_blks, 0);
+	atomic64_set(&zmd->nr_allocable_blks, 0);
+	atomic64_set(&zmd->nr_valid_blks, 0);
 
 	zmd->host = dev;
 
@@ -723,22 +901,31 @@ int lbz_init_zone_metadata(struct lbz_zone_metadata *zmd, struct lbz_device *dev
 
 	/*reserve one zone for gc, in case that gc cannot execute because of out of space.*/
 	zmd->reserved_blks_gc = zmd->zone_nr_blocks;
+	zmd->reserved_blks_sync = zmd->reserved_blks_gc / LBZ_SYNC_RESERVE_SHARE;
 	zmd->reclaim_wm_gc_low = LBZ_GC_RECLAIM_DEFAULT_WM_LOW;
 	zmd->reclaim_wm_gc_high = LBZ_GC_RECLAIM_DEFAULT_WM_HIGH;
 	zmd->zone_reclaim_wm = LBZ_ZONE_RECLAIM_DEFAULT_WM;
 
 	zmd->zs_close_times = 0;
 	zmd->zs_reset_times = 0;
+	ret = init_srcu_struct(&zmd->read_srcu);
+	if (ret < 0) {
+		LBZERR("(%s)init read srcu encounter error: %d", dev->devname, ret);
+		lbz_drop_zones(zmd);
+		return ret;
+	}
 	snprintf(zmd->zone_state_name, BDEVNAME_SIZE, "%s_zs", dev->devname);
 	zmd->zone_state_wq = create_singlethread_workqueue(zmd->zone_state_name);
 	if (IS_ERR(zmd->zone_state_wq)) {
 		LBZERR("alloc workqueue [%s] error:%ld", zmd->zone_state_name, PTR_ERR(zmd->zone_state_wq));
+		cleanup_srcu_struct(&zmd->read_srcu);
 		lbz_drop_zones(zmd);
 		return PTR_ERR(zmd->zone_state_wq);
 	}
 	INIT_WORK(&zmd->zone_state_wk, zone_state_wk_fn);
 	timer_setup(&zmd->zone_state_timer, __zs_timer_fn, 0);
 	zmd->zone_state_expire = LBZ_ZONE_STATE_EXPIRE;
+	zmd->last_jiffies = jiffies;
 	zmd->zone_state_timer.expires = jiffies + zmd->zone_state_expire;
 	add_timer(&zmd->zone_state_timer);
 